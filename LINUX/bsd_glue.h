@@ -211,6 +211,7 @@ struct thread;
 /* Atomic variables. */
 #define NM_ATOMIC_TEST_AND_SET(p)	test_and_set_bit(0, (p))
 #define NM_ATOMIC_CLEAR(p)		clear_bit(0, (p))
+#define NM_ATOMIC_CMPSET32(p, o, n)	(cmpxchg((p), (o), (n)) == (o))
 
 #define NM_ATOMIC_SET(p, v)             atomic_set(p, v)
 #define NM_ATOMIC_INC(p)                atomic_inc(p)
@@ -229,6 +230,23 @@ struct thread;
 	}							\
 	s; } )
 
+/*
+ * m_append() appends _len bytes to an skb built by m_devget(),
+ * for packets that span several netmap slots. The linear area is
+ * grown at least geometrically, so appending many fragments costs
+ * a bounded number of reallocations. Returns 1 on success, 0 otherwise.
+ */
+#define	m_append(_m, _len, _buf)	( {				\
+	struct sk_buff *s = (_m);					\
+	int need = (int)(_len) - (int)skb_tailroom(s);			\
+	int ok = 1;							\
+	if (need > 0 && pskb_expand_head(s, 0, max_t(int, need, s->len),	\
+			GFP_ATOMIC))					\
+		ok = 0;							\
+	if (ok)								\
+		memcpy(skb_put(s, _len), _buf, _len);			\
+	ok; } )
+
 #define	mbuf			sk_buff
 #define	m_nextpkt		next			// chain of mbufs
 #define m_freem(m)		dev_kfree_skb_any(m)	// free a sk_buff
@@ -244,6 +262,8 @@ struct thread;
  * and it is 0 for no setting, ring_nr+1 otherwise.
  */
 #define MBUF_TXQ(m)		skb_get_queue_mapping(m)
+#define MBUF_HASH(m)		skb_get_hash(m)
+#define MBUF_TSTAMP(m)		((uint64_t)ktime_to_ns((m)->tstamp))
 #define MBUF_RXQ(m)		(skb_rx_queue_recorded(m) ? skb_get_rx_queue(m) : 0)
 #define SET_MBUF_DESTRUCTOR(m, f) m->destructor = (void *)f
 
@@ -489,4 +509,9 @@ void netmap_bns_unregister(void);
 #define BIT_ULL(nr)	(1ULL << (nr))
 #endif /* !BIT_ULL */
 
+/* ---- tracepoints, see netmap_kring_sync() ------ */
+#include "netmap_trace.h"
+#define netmap_trace_sync(ev, k, err)	trace_netmap_sync_##ev((k)->name, \
+		(k)->tx == NR_TX, (k)->rhead, (k)->nr_hwcur, (k)->nr_hwtail, err)
+
 #endif /* NETMAP_BSD_GLUE_H */
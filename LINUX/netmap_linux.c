@@ -38,9 +38,15 @@
 #ifdef NETMAP_LINUX_HAVE_SCHED_MM
 #include <linux/sched/mm.h>
 #endif /* NETMAP_LINUX_HAVE_SCHED_MM */
+#ifdef NETMAP_LINUX_HAVE_NET_GSO
+#include <net/gso.h> /* skb_gso_segment() */
+#endif /* NETMAP_LINUX_HAVE_NET_GSO */
 
 #include "netmap_linux_config.h"
 
+#define CREATE_TRACE_POINTS
+#include "netmap_trace.h"
+
 void *
 nm_os_malloc(size_t size)
 {
@@ -239,15 +245,62 @@ nm_os_csum_fold(rawsum_t cur_sum)
 	return csum_fold(cur_sum);
 }
 
-/* on linux we send up one packet at a time */
+uint64_t
+nm_os_get_ns(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+uint64_t
+nm_os_get_realtime_ns(void)
+{
+	return ktime_to_ns(ktime_get_real());
+}
+
+uint64_t
+nm_os_get_cycles(void)
+{
+	return get_cycles();
+}
+
+/*
+ * When netif_receive_skb_list() is available, the packets are chained
+ * through skb->next and the whole batch is passed up on the last call
+ * (with m == NULL), so the stack processes it in one go instead of
+ * queueing each skb on the backlog with netif_rx().
+ * We are called in process context, hence the bh disable.
+ */
 void *
 nm_os_send_up(struct ifnet *ifp, struct mbuf *m, struct mbuf *prev)
 {
+#ifdef NETMAP_LINUX_HAVE_NETIF_RECEIVE_SKB_LIST
+	LIST_HEAD(list);
+	struct mbuf *next;
+
+	(void)ifp;
+	if (m != NULL) {
+		m->priority = NM_MAGIC_PRIORITY_RX; /* do not reinject to netmap */
+		m->next = NULL;
+		if (prev)
+			prev->next = m;
+		return m;
+	}
+	/* here prev is the head of the chain */
+	for (m = prev; m; m = next) {
+		next = m->next;
+		list_add_tail(&m->list, &list);
+	}
+	local_bh_disable();
+	netif_receive_skb_list(&list);
+	local_bh_enable();
+	return NULL;
+#else /* !NETMAP_LINUX_HAVE_NETIF_RECEIVE_SKB_LIST */
 	(void)ifp;
 	(void)prev;
 	m->priority = NM_MAGIC_PRIORITY_RX; /* do not reinject to netmap */
 	netif_rx(m);
 	return NULL;
+#endif /* !NETMAP_LINUX_HAVE_NETIF_RECEIVE_SKB_LIST */
 }
 
 int
@@ -256,6 +309,31 @@ nm_os_mbuf_has_offld(struct mbuf *m)
 	return m->ip_summed == CHECKSUM_PARTIAL || skb_is_gso(m);
 }
 
+/* same as validate_xmit_skb(), with no device features */
+struct mbuf *
+nm_os_mbuf_segment(struct mbuf *m)
+{
+	struct sk_buff *segs;
+
+	if (skb_is_gso(m)) {
+		/* the segments get their checksums computed */
+		segs = skb_gso_segment(m, 0);
+		if (IS_ERR(segs)) {
+			m_freem(m);
+			return NULL;
+		} else if (segs) {
+			consume_skb(m);
+			return segs;
+		}
+	}
+	if (m->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(m)) {
+		m_freem(m);
+		return NULL;
+	}
+	m->next = NULL;
+	return m;
+}
+
 #ifdef WITH_GENERIC
 /* ####################### MITIGATION SUPPORT ###################### */
 
@@ -269,6 +347,8 @@ nm_os_mbuf_has_offld(struct mbuf *m)
  *   until the timer expires;
  * - when the timer expires and there are pending packets,
  *   a notification is sent up and the timer is restarted.
+ * The timer period is either netmap_generic_mit or, with adaptive
+ * mitigation, chosen per ring by netmap_generic_mit_update().
  */
 static NETMAP_LINUX_TIMER_RTYPE
 generic_timer_handler(struct hrtimer *t)
@@ -278,6 +358,7 @@ generic_timer_handler(struct hrtimer *t)
     u_int work_done;
 
     if (!mit->mit_pending) {
+        netmap_generic_mit_update(mit);
         return HRTIMER_NORESTART;
     }
 
@@ -286,6 +367,8 @@ generic_timer_handler(struct hrtimer *t)
      * a notification.
      */
     mit->mit_pending = 0;
+    mit->mit_delivered++;
+    netmap_generic_mit_update(mit);
     /* below is a variation of netmap_generic_irq  XXX revise */
     if (nm_netmap_on(mit->mit_na)) {
         netmap_common_irq(mit->mit_na, mit->mit_ring_idx, &work_done);
@@ -312,13 +395,13 @@ nm_os_mitigation_init(struct nm_generic_mit *mit, int idx,
 void
 nm_os_mitigation_start(struct nm_generic_mit *mit)
 {
-    hrtimer_start(&mit->mit_timer, ktime_set(0, netmap_generic_mit), HRTIMER_MODE_REL);
+    hrtimer_start(&mit->mit_timer, ktime_set(0, mit->mit_interval), HRTIMER_MODE_REL);
 }
 
 void
 nm_os_mitigation_restart(struct nm_generic_mit *mit)
 {
-    hrtimer_forward_now(&mit->mit_timer, ktime_set(0, netmap_generic_mit));
+    hrtimer_forward_now(&mit->mit_timer, ktime_set(0, mit->mit_interval));
 }
 
 int
@@ -723,6 +806,73 @@ nm_os_catch_tx(struct netmap_generic_adapter *gna, int intercept)
 	return 0;
 }
 
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+/* Batched transmission, used when the netmap-aware qdisc is disabled.
+ * The tx queue lock is taken on the first packet of a txsync and
+ * released after the last one (a->more == 0), on errors, or by the
+ * final flush call from generic_netmap_txsync() (a->addr == NULL).
+ * While the batch is open, a->head points to the locked tx queue.
+ * Differently from dev_queue_xmit(), the packets are not passed to
+ * the taps (e.g. tcpdump on the interface).
+ */
+static void
+generic_txbatch_end(struct nm_os_gen_arg *a)
+{
+	struct netdev_queue *txq = a->head;
+
+	HARD_TX_UNLOCK(a->ifp, txq);
+	rcu_read_unlock_bh();
+	a->head = NULL;
+}
+
+static int
+generic_txbatch_xmit(struct nm_os_gen_arg *a)
+{
+	struct mbuf *m = a->m;
+	struct ifnet *ifp = a->ifp;
+	struct netdev_queue *txq = a->head;
+	netdev_tx_t ret;
+
+	if (txq == NULL) {
+		if (unlikely(!netif_running(ifp) || !netif_carrier_ok(ifp)))
+			goto drop;
+		txq = netdev_get_tx_queue(ifp, a->ring_nr);
+		rcu_read_lock_bh();
+		HARD_TX_LOCK(ifp, txq, smp_processor_id());
+		a->head = txq;
+	}
+
+	if (unlikely(netif_xmit_frozen_or_stopped(txq))) {
+		/* The driver is out of descriptors. Release the
+		 * lock, so that the caller can reclaim completed
+		 * buffers and try again. */
+		generic_txbatch_end(a);
+		goto drop;
+	}
+
+	/* generic_ndo_start_xmit() passes this to the driver. */
+	ret = netdev_start_xmit(m, ifp, txq, a->more);
+	if (unlikely(!dev_xmit_complete(ret))) {
+		/* Not consumed: drop the reference the driver would have
+		 * released on completion. */
+		generic_txbatch_end(a);
+		RD(3, "Warning: driver is busy [%d]", ret);
+		goto drop;
+	}
+	if (!a->more)
+		generic_txbatch_end(a);
+
+	return 0;
+
+drop:
+	/* Reset priority, so that generic_netmap_tx_clean() can
+	 * reclaim this mbuf. */
+	m->priority = 0;
+	kfree_skb(m);
+	return -1;
+}
+#endif /* NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+
 /* Transmit routine used by generic_netmap_txsync(). Returns 0 on success
    and -1 on error (which may be packet drops or other errors). */
 int
@@ -732,6 +882,18 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 	struct ifnet *ifp = a->ifp;
 	u_int len = a->len;
 	netdev_tx_t ret;
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+	struct netmap_generic_adapter *gna =
+		(struct netmap_generic_adapter *)NA(ifp);
+	int batch = !gna->txqdisc && netmap_generic_txbatch;
+
+	if (a->addr == NULL) {
+		/* End of txsync: flush the open batch, if any. */
+		if (a->head != NULL)
+			generic_txbatch_end(a);
+		return 0;
+	}
+#endif /* NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
 
 	/* We know that the driver needs to prepend ifp->needed_headroom bytes
 	 * to each packet to be transmitted. We then reset the mbuf pointers
@@ -788,6 +950,11 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 		m->next = NULL;
 	}
 
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+	if (batch)
+		return generic_txbatch_xmit(a);
+#endif /* NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+
 	ret = dev_queue_xmit(m);
 
 	if (unlikely(ret != NET_XMIT_SUCCESS)) {
@@ -1080,6 +1247,8 @@ linux_netmap_ioctl(struct file *file, u_int cmd, u_long data /* arg */)
 	union {
 		struct nm_ifreq ifr;
 		struct nmreq nmr;
+		struct nmreq_syncv syncv;
+		struct nmreq_ring_stats rstats;
 	} arg;
 	size_t argsize = 0;
 
@@ -1090,6 +1259,12 @@ linux_netmap_ioctl(struct file *file, u_int cmd, u_long data /* arg */)
 	case NIOCCONFIG:
 		argsize = sizeof(arg.ifr);
 		break;
+	case NIOCSYNCV:
+		argsize = sizeof(arg.syncv);
+		break;
+	case NIOCRINGSTATS:
+		argsize = sizeof(arg.rstats);
+		break;
 	default:
 		argsize = sizeof(arg.nmr);
 		break;
@@ -1118,6 +1293,46 @@ linux_netmap_compat_ioctl(struct file *file, unsigned int cmd,
 }
 #endif
 
+#ifdef NETMAP_LINUX_HAVE_URING_CMD
+#include <linux/io_uring.h>
+#if __has_include(<linux/io_uring/cmd.h>)
+#include <linux/io_uring/cmd.h>
+#endif
+
+/*
+ * io_uring passthrough (IORING_OP_URING_CMD). The cmd_op of the sqe is
+ * NIOCTXSYNC, NIOCRXSYNC or NIOCSYNCV, the latter with its nmreq_syncv
+ * in the command area of the sqe. The syncs never sleep, so they
+ * complete inline and the cqe carries 0 or -errno. Readiness comes
+ * from IORING_OP_POLL_ADD, which is served by linux_netmap_poll().
+ */
+static int
+linux_netmap_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct netmap_priv_d *priv = ioucmd->file->private_data;
+	struct nmreq_syncv syncv;
+	u_int cmd = ioucmd->cmd_op;
+
+	(void)issue_flags;	/* UNUSED */
+	switch (cmd) {
+	case NIOCTXSYNC:
+	case NIOCRXSYNC:
+		break;
+	case NIOCSYNCV:
+		BUILD_BUG_ON(sizeof(syncv) > 16); /* fits a plain sqe */
+#ifdef NETMAP_LINUX_HAVE_IO_URING_SQE_CMD
+		memcpy(&syncv, io_uring_sqe_cmd(ioucmd->sqe), sizeof(syncv));
+#else
+		memcpy(&syncv, ioucmd->cmd, sizeof(syncv));
+#endif
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+	return -netmap_ioctl(priv, cmd, (caddr_t)&syncv, NULL);
+}
+#endif /* NETMAP_LINUX_HAVE_URING_CMD */
+
 static int
 linux_netmap_release(struct inode *inode, struct file *file)
 {
@@ -1158,9 +1373,33 @@ static struct file_operations netmap_fops = {
     .compat_ioctl = linux_netmap_compat_ioctl,
 #endif
     .poll = linux_netmap_poll,
+#ifdef NETMAP_LINUX_HAVE_URING_CMD
+    .uring_cmd = linux_netmap_uring_cmd,
+#endif
     .release = linux_netmap_release,
 };
 
+struct netmap_priv_d *
+nm_os_priv_get(int fd, void **cookie)
+{
+	struct file *f = fget(fd);
+
+	if (f == NULL)
+		return NULL;
+	if (f->f_op != &netmap_fops || f->private_data == NULL) {
+		fput(f);
+		return NULL;
+	}
+	*cookie = f;
+	return f->private_data;
+}
+
+void
+nm_os_priv_put(void *cookie)
+{
+	fput((struct file *)cookie);
+}
+
 
 #ifdef WITH_VALE
 #ifdef CONFIG_NET_NS
@@ -1308,6 +1547,7 @@ netmap_bns_unregister(void)
 #include <linux/poll.h>
 #include <linux/kthread.h>
 #include <linux/cpumask.h> /* nr_cpu_ids */
+#include <linux/capability.h> /* capable() */
 
 u_int
 nm_os_ncpus(void)
@@ -1315,6 +1555,18 @@ nm_os_ncpus(void)
 	return nr_cpu_ids;
 }
 
+int
+nm_os_cpu_online(u_int cpu)
+{
+	return cpu < nr_cpu_ids && cpu_online(cpu);
+}
+
+int
+nm_os_kpoll_allowed(void)
+{
+	return capable(CAP_NET_ADMIN) ? 0 : EPERM;
+}
+
 struct nm_kctx {
 	struct mm_struct *mm;       /* to access guest memory */
 	struct task_struct *worker; /* the kernel thread */
@@ -1570,7 +1822,9 @@ nm_os_kctx_create(struct nm_kctx_cfg *cfg, unsigned int cfgtype,
 	struct nm_kctx *nmk = NULL;
 	int error;
 
-	if (cfgtype != PTNETMAP_CFGTYPE_QEMU) {
+	/* a configuration is only needed by ptnetmap, the other users
+	 * (VALE polling, NR_KPOLL) pass none and run continuously */
+	if (opaque && cfgtype != PTNETMAP_CFGTYPE_QEMU) {
 		D("Unsupported cfgtype %u", cfgtype);
 		return NULL;
 	}
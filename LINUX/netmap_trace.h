@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2017 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tracepoints of the netmap core, e.g.
+ *	perf record -e netmap:netmap_sync_exit ...
+ * The sync ones wrap the kring->nm_sync() calls made on behalf of the
+ * system calls (see netmap_kring_sync()). They are instantiated in
+ * netmap_linux.c.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM netmap
+
+#if !defined(_NETMAP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NETMAP_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(netmap_sync,
+	TP_PROTO(const char *name, int tx, unsigned int head,
+		 unsigned int hwcur, unsigned int hwtail, int error),
+
+	TP_ARGS(name, tx, head, hwcur, hwtail, error),
+
+	TP_STRUCT__entry(
+		__array(char, name, 64)
+		__field(int, tx)
+		__field(unsigned int, head)
+		__field(unsigned int, hwcur)
+		__field(unsigned int, hwtail)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		strncpy(__entry->name, name, sizeof(__entry->name) - 1);
+		__entry->name[sizeof(__entry->name) - 1] = '\0';
+		__entry->tx = tx;
+		__entry->head = head;
+		__entry->hwcur = hwcur;
+		__entry->hwtail = hwtail;
+		__entry->error = error;
+	),
+
+	TP_printk("%s %s head %u hwcur %u hwtail %u error %d",
+		__entry->name, __entry->tx ? "txsync" : "rxsync",
+		__entry->head, __entry->hwcur, __entry->hwtail,
+		__entry->error)
+);
+
+DEFINE_EVENT(netmap_sync, netmap_sync_enter,
+	TP_PROTO(const char *name, int tx, unsigned int head,
+		 unsigned int hwcur, unsigned int hwtail, int error),
+	TP_ARGS(name, tx, head, hwcur, hwtail, error)
+);
+
+DEFINE_EVENT(netmap_sync, netmap_sync_exit,
+	TP_PROTO(const char *name, int tx, unsigned int head,
+		 unsigned int hwcur, unsigned int hwtail, int error),
+	TP_ARGS(name, tx, head, hwcur, hwtail, error)
+);
+
+#endif /* _NETMAP_TRACE_H */
+
+/* the header is not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE netmap_trace
+#include <trace/define_trace.h>
@@ -537,6 +537,15 @@ ioctlDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		IoCompleteRequest(Irp, IO_NO_INCREMENT);
 		return NtStatus;
 
+	case NIOCSYNCV:
+	case NIOCRINGSTATS:
+		/* not supported on Windows yet */
+		DbgPrint("Netmap.sys: NIOCSYNCV/NIOCRINGSTATS not supported");
+		NtStatus = EOPNOTSUPP;
+		Irp->IoStatus.Status = NtStatus;
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+		return NtStatus;
+
 	default:
 		//bail out if unknown request issued
 		DbgPrint("Netmap.sys: wrong request issued! (%i)", irpSp->Parameters.DeviceIoControl.IoControlCode);
@@ -1010,12 +1019,74 @@ nm_os_ncpus(void)
 	return 1;  // TODO
 }
 
+int
+nm_os_cpu_online(u_int cpu)
+{
+	return cpu < nm_os_ncpus();
+}
+
+/* NR_KPOLL threads are not allowed until there is a privilege check */
+int
+nm_os_kpoll_allowed(void)
+{
+	return EOPNOTSUPP;
+}
+
 int
 nm_os_mbuf_has_offld(struct mbuf *m)
 {
 	return 0;  // TODO
 }
 
+struct mbuf *
+nm_os_mbuf_segment(struct mbuf *m)
+{
+	m_freem(m);
+	return NULL;
+}
+
+/* not supported, NIOCSYNCV only works on the fd of the ioctl */
+struct netmap_priv_d *
+nm_os_priv_get(int fd, void **cookie)
+{
+	(void)fd;
+	(void)cookie;
+	return NULL;
+}
+
+void
+nm_os_priv_put(void *cookie)
+{
+	(void)cookie;
+}
+
+uint64_t
+nm_os_get_ns(void)
+{
+	LARGE_INTEGER freq, count;
+
+	count = KeQueryPerformanceCounter(&freq);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000 +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 /
+		freq.QuadPart;
+}
+
+uint64_t
+nm_os_get_realtime_ns(void)
+{
+	LARGE_INTEGER t;
+
+	/* 100ns units since 1601 */
+	KeQuerySystemTime(&t);
+	return (uint64_t)(t.QuadPart - 116444736000000000LL) * 100;
+}
+
+uint64_t
+nm_os_get_cycles(void)
+{
+	return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
 void
 nm_os_get_module(void)
 {
@@ -230,6 +230,7 @@ static void nm_os_selinfo_uninit(win_SELINFO *queue) { /* XXX nothing to do here
 
 #define mb				KeMemoryBarrier
 #define rmb				KeMemoryBarrier //XXX_ale: doesn't seems to exist just a read barrier
+#define wmb				KeMemoryBarrier
 
 /*
  *	TIME FUNCTIONS
@@ -312,6 +313,8 @@ typedef struct _FUNCTION_POINTER_XCHANGE {
 #define GEN_TX_MBUF_IFP(m)			m->dev
 #define MBUF_LEN(m)				((m)->m_len)
 #define MBUF_TXQ(m)                             0
+#define MBUF_HASH(m)                            0
+#define MBUF_TSTAMP(m)                          0
 
 int MBUF_TRANSMIT(struct netmap_adapter *na, struct ifnet *ifp, struct mbuf *m);
 
@@ -352,6 +355,8 @@ win32_ndis_packet_freem(struct mbuf* m)
  * m_devget() is used to construct an mbuf from a host ring to the host stack
  */
 #define m_devget(data, len, offset, dev, fn)		win_make_mbuf(dev, len, data)
+/* mbufs have a single buffer, multi-slot packets are dropped */
+#define m_append(m, len, data)				0
 #define m_freem(mbuf)					win32_ndis_packet_freem(mbuf);
 #define m_copydata(source, offset, length, dst)		RtlCopyMemory(dst, source->pkt, length)
 
@@ -375,6 +380,8 @@ PVOID send_up_to_stack(struct ifnet *ifp, struct mbuf *m, PVOID head);
 #define atomic_t			NM_ATOMIC_T
 #define NM_ATOMIC_TEST_AND_SET(p)       InterlockedBitTestAndSet(p,0)
 #define NM_ATOMIC_CLEAR(p)              InterlockedBitTestAndReset(p,0)
+#define NM_ATOMIC_CMPSET32(p, o, n)	\
+	(InterlockedCompareExchange((volatile LONG *)(p), (n), (o)) == (LONG)(o))
 #define refcount_acquire(_a)    	InterlockedExchangeAdd((atomic_t *)_a, 1)
 #define refcount_release(_a)    	(InterlockedDecrement((atomic_t *)_a) <= 0)
 #define NM_ATOMIC_SET(p, v)             InterlockedExchange(p, v)
@@ -842,6 +842,25 @@ run:
 	memset(&pollfd, 0, sizeof(pollfd));
 	signal(SIGINT, sigint_h);
 
+	/* when busy waiting, sync all the pipes and the input port with
+	 * a single NIOCSYNCV, if the kernel supports it
+	 */
+	struct nmreq_sync syncv[npipes + 1];
+	struct nmreq_syncv sv;
+	bool use_syncv = glob_arg.busy_wait;
+	memset(&syncv, 0, sizeof(syncv));
+	for (i = 0; i < npipes; ++i) {
+		syncv[i].ns_fd = ports[i].nmd->fd;
+		syncv[i].ns_flags = NETMAP_SYNC_TX;
+		syncv[i].ns_last = NETMAP_SYNC_ALLRINGS;
+	}
+	syncv[npipes].ns_fd = -1; /* rxport */
+	syncv[npipes].ns_flags = NETMAP_SYNC_RX;
+	syncv[npipes].ns_last = NETMAP_SYNC_ALLRINGS;
+	memset(&sv, 0, sizeof(sv));
+	sv.nsv_entries = (uintptr_t)syncv;
+	sv.nsv_count = npipes + 1;
+
 	/* make sure we wake up as often as needed, even when there are no
 	 * packets coming in
 	 */
@@ -854,6 +873,27 @@ run:
 		u_int polli = 0;
 		iter++;
 
+		if (use_syncv) {
+			if (ioctl(rxport->nmd->fd, NIOCSYNCV, &sv) == 0) {
+				u_int failed = 0;
+
+				for (i = 0; i <= npipes; i++) {
+					if (syncv[i].ns_error == 0)
+						continue;
+					RD(1, "NIOCSYNCV entry %d failed (%s)", i,
+						strerror(syncv[i].ns_error));
+					failed++;
+				}
+				if (!failed)
+					goto synced;
+				/* some rings were not synced, fall back to
+				 * poll() for this round */
+			} else {
+				D("NIOCSYNCV failed (%s), using poll()", strerror(errno));
+				use_syncv = false;
+			}
+		}
+
 		for (i = 0; i < npipes; ++i) {
 			struct netmap_ring *ring = ports[i].ring;
 			if (!glob_arg.busy_wait && !nm_tx_pending(ring)) {
@@ -879,6 +919,7 @@ run:
 			goto send_stats;
 		}
 
+	synced:
 		if (oq) {
 			/* try to push packets from the overflow queues
 			 * to the corresponding pipes
@@ -331,10 +331,10 @@ ports attached to the switch)
  *    - rx from netmap userspace:
  *           1) ioctl(NIOCRXSYNC)/netmap_poll() in process context
  *               kring->nm_sync() == generic_netmap_rxsync()
- *                   mbq_safe_dequeue()
+ *                   mbq_ring_peek()/mbq_ring_consume()
  *           2) device driver
  *               generic_rx_handler()
- *                   mbq_safe_enqueue()
+ *                   mbq_ring_enqueue()
  *                   na->nm_notify() == netmap_notify()
  *    - rx from host stack
  *        FreeBSD: same as native
@@ -501,6 +501,15 @@ static int netmap_admode = NETMAP_ADMODE_BEST;
  * nanoseconds. */
 int netmap_generic_mit = 100*1000;
 
+/* With netmap_generic_mit_adaptive, each rx ring of a generic adapter
+ * picks its own mitigation interval between netmap_generic_mit_lo and
+ * netmap_generic_mit_hi (nanoseconds), so that a notification carries
+ * about netmap_generic_mit_batch packets. */
+int netmap_generic_mit_adaptive = 0;
+int netmap_generic_mit_lo = 20*1000;
+int netmap_generic_mit_hi = 1000*1000;
+int netmap_generic_mit_batch = 64;
+
 /* We use by default netmap-aware qdiscs with generic netmap adapters,
  * even if there can be a little performance hit with hardware NICs.
  * However, using the qdisc is the safer approach, for two reasons:
@@ -515,6 +524,27 @@ int netmap_generic_mit = 100*1000;
  */
 int netmap_generic_txqdisc = 1;
 
+/* When the netmap-aware qdisc is not used, generic adapters on linux
+ * pass the packets of a txsync straight to the driver, holding the
+ * tx queue lock for the whole batch and setting the xmit_more hint
+ * on all the packets but the last one. Set to 0 to go through
+ * dev_queue_xmit() for each packet. */
+int netmap_generic_txbatch = 1;
+
+/* Maximum number of mbufs intercepted by a generic adapter that can
+ * be waiting for a rxsync on each rx ring (rounded up to a power of 2). */
+int netmap_generic_rxqlen = 1024;
+
+/* Number of host ring pairs given to hardware adapters when they are
+ * first bound. The packets from the host stack are spread over the
+ * host rx rings following the tx queue picked by the stack, or the
+ * flow hash on devices with fewer tx queues than host rings. */
+int netmap_host_rings = 1;
+
+/* Update the per-kring sync counters (see NIOCRINGSTATS). Off by
+ * default, since timing the syncs costs two clock reads each. */
+int netmap_sync_stats = 0;
+
 /* Default number of slots and queues for generic adapters. */
 int netmap_generic_ringsize = 1024;
 int netmap_generic_rings = 1;
@@ -525,6 +555,17 @@ int ptnet_vnet_hdr = 1;
 /* 0 if ptnetmap should not use worker threads for TX processing */
 int ptnetmap_tx_workers = 1;
 
+/* 0 if the ptnetmap workers should use fixed polling and interrupt
+ * heuristics instead of adapting them to the traffic of each ring */
+int ptnetmap_adaptive = 1;
+
+/* default limit of the slots passed to each backend txsync by the
+ * ptnetmap tx workers, 0 means half the ring */
+int ptnetmap_tx_batch = 0;
+
+/* maximum number of NR_KPOLL threads, 0 means one per CPU */
+int netmap_kpoll_max = 0;
+
 /*
  * SYSCTL calls are grouped between SYSBEGIN and SYSEND to be emulated
  * in some other operating systems
@@ -547,11 +588,22 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, flags, CTLFLAG_RW, &netmap_flags, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, fwd, CTLFLAG_RW, &netmap_fwd, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, admode, CTLFLAG_RW, &netmap_admode, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit, CTLFLAG_RW, &netmap_generic_mit, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit_adaptive, CTLFLAG_RW, &netmap_generic_mit_adaptive, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit_lo, CTLFLAG_RW, &netmap_generic_mit_lo, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit_hi, CTLFLAG_RW, &netmap_generic_mit_hi, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit_batch, CTLFLAG_RW, &netmap_generic_mit_batch, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_ringsize, CTLFLAG_RW, &netmap_generic_ringsize, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rings, CTLFLAG_RW, &netmap_generic_rings, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txqdisc, CTLFLAG_RW, &netmap_generic_txqdisc, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txbatch, CTLFLAG_RW, &netmap_generic_txbatch, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rxqlen, CTLFLAG_RW, &netmap_generic_rxqlen, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, host_rings, CTLFLAG_RW, &netmap_host_rings, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, sync_stats, CTLFLAG_RW, &netmap_sync_stats, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, ptnet_vnet_hdr, CTLFLAG_RW, &ptnet_vnet_hdr, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, ptnetmap_tx_workers, CTLFLAG_RW, &ptnetmap_tx_workers, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, ptnetmap_adaptive, CTLFLAG_RW, &ptnetmap_adaptive, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, ptnetmap_tx_batch, CTLFLAG_RW, &ptnetmap_tx_batch, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, kpoll_max, CTLFLAG_RW, &netmap_kpoll_max, 0 , "");
 
 SYSEND;
 
@@ -811,8 +863,8 @@ netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 	}
 
 	/* account for the (possibly fake) host rings */
-	n[NR_TX] = na->num_tx_rings + 1;
-	n[NR_RX] = na->num_rx_rings + 1;
+	n[NR_TX] = netmap_all_rings(na, NR_TX);
+	n[NR_RX] = netmap_all_rings(na, NR_RX);
 
 	len = (n[NR_TX] + n[NR_RX]) * sizeof(struct netmap_kring) + tailroom;
 
@@ -902,11 +954,14 @@ netmap_krings_delete(struct netmap_adapter *na)
 void
 netmap_hw_krings_delete(struct netmap_adapter *na)
 {
-	struct mbq *q = &na->rx_rings[na->num_rx_rings].rx_queue;
+	u_int i;
+
+	for (i = na->num_rx_rings; i < netmap_all_rings(na, NR_RX); i++) {
+		struct mbq_ring *q = &na->rx_rings[i].rx_queue;
 
-	ND("destroy sw mbq with len %d", mbq_len(q));
-	mbq_purge(q);
-	mbq_safe_fini(q);
+		ND("destroy sw mbq with len %d", mbq_ring_len(q));
+		mbq_ring_fini(q);
+	}
 	netmap_krings_delete(na);
 }
 
@@ -932,12 +987,15 @@ netmap_mem_drop(struct netmap_adapter *na)
 /* call with NMG_LOCK held */
 static void netmap_unset_ringid(struct netmap_priv_d *);
 static void netmap_krings_put(struct netmap_priv_d *);
+static void netmap_kpoll_stop(struct netmap_priv_d *);
 void
 netmap_do_unregif(struct netmap_priv_d *priv)
 {
 	struct netmap_adapter *na = priv->np_na;
 
 	NMG_LOCK_ASSERT();
+	/* the polling thread must be gone before the rings */
+	netmap_kpoll_stop(priv);
 	na->active_fds--;
 	/* unset nr_pending_mode and possibly release exclusive mode */
 	netmap_krings_put(priv);
@@ -1085,6 +1143,11 @@ netmap_dtor(void *data)
  */
 
 
+/* largest multi-slot packet passed to the host stack */
+#define NM_HOST_MAXPKT	(65536 + 64)
+/* mbufs moved at once to and from the host rx_queue */
+#define NM_HOST_BATCH	32
+
 /*
  * Pass a whole queue of mbufs to the host stack as coming from 'dst'
  * We do not need to lock because the queue is private.
@@ -1096,8 +1159,8 @@ netmap_send_up(struct ifnet *dst, struct mbq *q)
 	struct mbuf *m;
 	struct mbuf *head = NULL, *prev = NULL;
 
-	/* Send packets up, outside the lock; head/prev machinery
-	 * is only useful for Windows. */
+	/* Send packets up, outside the lock; the head/prev machinery
+	 * lets the OS pass up the whole batch on the last call. */
 	while ((m = mbq_dequeue(q)) != NULL) {
 		if (netmap_verbose & NM_VERB_HOST)
 			D("sending up pkt %p size %d", m, MBUF_LEN(m));
@@ -1112,9 +1175,12 @@ netmap_send_up(struct ifnet *dst, struct mbq *q)
 
 
 /*
- * Scan the buffers from hwcur to ring->head, and put a copy of those
- * marked NS_FORWARD (or all of them if forced) into a queue of mbufs.
- * Drop remaining packets in the unlikely event
+ * Scan the buffers from hwcur to ring->head, and put a copy of the
+ * packets marked NS_FORWARD (or all of them if forced) into a queue
+ * of mbufs. A packet spans all the slots up to the first one without
+ * NS_MOREFRAG, and is forwarded according to the flags of its first
+ * slot. Packets truncated by ring->head are dropped, since hwcur is
+ * moved past them anyway. Drop remaining packets in the unlikely event
  * of an mbuf shortage.
  */
 static void
@@ -1122,25 +1188,56 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 {
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
-	u_int n;
+	u_int n = kring->nr_hwcur;
 	struct netmap_adapter *na = kring->na;
 
-	for (n = kring->nr_hwcur; n != head; n = nm_next(n, lim)) {
+	while (n != head) {
 		struct mbuf *m;
 		struct netmap_slot *slot = &kring->ring->slot[n];
+		int fwd = force || (slot->flags & NS_FORWARD);
+		u_int first = n, len = 0, nfrags = 0, bad = 0;
 
-		if ((slot->flags & NS_FORWARD) == 0 && !force)
+		/* find the end of the packet */
+		do {
+			slot = &kring->ring->slot[n];
+			if (slot->len > NETMAP_BUF_SIZE(na))
+				bad = 1;
+			if (fwd)
+				slot->flags &= ~NS_FORWARD; // XXX needed ?
+			len += slot->len;
+			nfrags++;
+			n = nm_next(n, lim);
+		} while ((slot->flags & NS_MOREFRAG) && n != head);
+
+		if (!fwd)
 			continue;
-		if (slot->len < 14 || slot->len > NETMAP_BUF_SIZE(na)) {
-			RD(5, "bad pkt at %d len %d", n, slot->len);
+		if (slot->flags & NS_MOREFRAG) {
+			RD(5, "incomplete pkt at %d", first);
+			continue;
+		}
+		slot = &kring->ring->slot[first];
+		/* the ethernet header must be in the first fragment */
+		if (bad || slot->len < 14 || len > NM_HOST_MAXPKT) {
+			RD(5, "bad pkt at %d len %d frags %d", first, len, nfrags);
 			continue;
 		}
-		slot->flags &= ~NS_FORWARD; // XXX needed ?
-		/* XXX TODO: adapt to the case of a multisegment packet */
 		m = m_devget(NMB(na, slot), slot->len, 0, na->ifp, NULL);
-
 		if (m == NULL)
 			break;
+		/* one more copy per fragment, into the same mbuf */
+		while (--nfrags > 0) {
+			first = nm_next(first, lim);
+			slot = &kring->ring->slot[first];
+			if (!m_append(m, slot->len, (caddr_t)NMB(na, slot))) {
+				m_freem(m);
+				m = NULL;
+				break;
+			}
+		}
+		if (m == NULL) {
+			RD(5, "no room for a %d bytes pkt", len);
+			continue;
+		}
 		mbq_enqueue(q, m);
 	}
 }
@@ -1157,7 +1254,7 @@ static inline int
 nm_may_forward_up(struct netmap_kring *kring)
 {
 	return	_nm_may_forward(kring) &&
-		 kring->ring_id != kring->na->num_rx_rings;
+		 kring->ring_id < kring->na->num_rx_rings;
 }
 
 static inline int
@@ -1165,13 +1262,13 @@ nm_may_forward_down(struct netmap_kring *kring, int sync_flags)
 {
 	return	_nm_may_forward(kring) &&
 		 (sync_flags & NAF_CAN_FORWARD_DOWN) &&
-		 kring->ring_id == kring->na->num_rx_rings;
+		 kring->ring_id >= kring->na->num_rx_rings;
 }
 
 /*
  * Send to the NIC rings packets marked NS_FORWARD between
  * kring->nr_hwcur and kring->rhead.
- * Called under kring->rx_queue.lock on the sw rx ring.
+ * Called from netmap_rxsync_from_host() on a sw rx ring.
  *
  * It can only be called if the user opened all the TX hw rings,
  * see NAF_CAN_FORWARD_DOWN flag.
@@ -1181,9 +1278,9 @@ nm_may_forward_down(struct netmap_kring *kring, int sync_flags)
  * during the execution of the system call.
  */
 static u_int
-netmap_sw_to_nic(struct netmap_adapter *na)
+netmap_sw_to_nic(struct netmap_kring *kring)
 {
-	struct netmap_kring *kring = &na->rx_rings[na->num_rx_rings];
+	struct netmap_adapter *na = kring->na;
 	struct netmap_slot *rxslot = kring->ring->slot;
 	u_int i, rxcur = kring->nr_hwcur;
 	u_int const head = kring->rhead;
@@ -1259,8 +1356,8 @@ netmap_txsync_to_host(struct netmap_kring *kring, int flags)
 
 /*
  * rxsync backend for packets coming from the host stack.
- * They have been put in kring->rx_queue by netmap_transmit().
- * We protect access to the kring using kring->rx_queue.lock
+ * They have been put in kring->rx_queue by netmap_transmit(),
+ * we are the only consumer (the kring is busy) so no lock is needed.
  *
  * also moves to the nic hw rings any packet the user has marked
  * for transparent-mode forwarding, then sets the NR_FORWARD
@@ -1275,34 +1372,40 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
 	int ret = 0;
-	struct mbq *q = &kring->rx_queue, fq;
-
-	mbq_init(&fq); /* fq holds packets to be freed */
-
-	mbq_lock(q);
+	struct mbq_ring *q = &kring->rx_queue;
 
 	/* First part: import newly received packets */
-	n = mbq_len(q);
-	if (n) { /* grab packets from the queue */
-		struct mbuf *m;
+	if (mbq_ring_len(q)) { /* grab packets from the queue */
+		struct mbuf *batch[NM_HOST_BATCH];
 		uint32_t stop_i;
+		u_int i;
 
 		nm_i = kring->nr_hwtail;
 		stop_i = nm_prev(kring->nr_hwcur, lim);
-		while ( nm_i != stop_i && (m = mbq_dequeue(q)) != NULL ) {
-			int len = MBUF_LEN(m);
-			struct netmap_slot *slot = &ring->slot[nm_i];
-
-			m_copydata(m, 0, len, NMB(na, slot));
-			ND("nm %d len %d", nm_i, len);
-			if (netmap_verbose)
-                                D("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
-
-			slot->len = len;
-			slot->flags = 0;
-			nm_i = nm_next(nm_i, lim);
-			mbq_enqueue(&fq, m);
-		}
+		do {
+			n = stop_i - nm_i;
+			if ((int)n < 0)
+				n += lim + 1;
+			if (n > NM_HOST_BATCH)
+				n = NM_HOST_BATCH;
+			n = mbq_ring_dequeue_batch(q, batch, n);
+			for (i = 0; i < n; i++) {
+				struct mbuf *m = batch[i];
+				int len = MBUF_LEN(m);
+				struct netmap_slot *slot = &ring->slot[nm_i];
+
+				m_copydata(m, 0, len, NMB(na, slot));
+				ND("nm %d len %d", nm_i, len);
+				if (netmap_verbose)
+					D("%s", nm_dump_buf(NMB(na, slot), len,
+						128, NULL));
+
+				slot->len = len;
+				slot->flags = 0;
+				nm_i = nm_next(nm_i, lim);
+				m_freem(m);
+			}
+		} while (n == NM_HOST_BATCH);
 		kring->nr_hwtail = nm_i;
 	}
 
@@ -1312,7 +1415,7 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 	nm_i = kring->nr_hwcur;
 	if (nm_i != head) { /* something was released */
 		if (nm_may_forward_down(kring, flags)) {
-			ret = netmap_sw_to_nic(na);
+			ret = netmap_sw_to_nic(kring);
 			if (ret > 0) {
 				kring->nr_kflags |= NR_FORWARD;
 				ret = 0;
@@ -1321,11 +1424,6 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 		kring->nr_hwcur = head;
 	}
 
-	mbq_unlock(q);
-
-	mbq_purge(&fq);
-	mbq_fini(&fq);
-
 	return ret;
 }
 
@@ -1580,6 +1678,11 @@ nm_txsync_prologue(struct netmap_kring *kring, struct netmap_ring *ring)
 	u_int cur = ring->cur; /* read only once */
 	u_int n = kring->nkr_num_slots;
 
+#ifdef WITH_PIPES
+	if (kring->nr_kflags & NKR_SHMSYNC)
+		netmap_pipe_shm_import(kring);
+#endif /* WITH_PIPES */
+
 	ND(5, "%s kcur %d ktail %d head %d cur %d tail %d",
 		kring->name,
 		kring->nr_hwcur, kring->nr_hwtail,
@@ -1654,6 +1757,10 @@ nm_rxsync_prologue(struct netmap_kring *kring, struct netmap_ring *ring)
 	 * - cur could in principle go back, however it does not matter
 	 *   because we are processing a brand new rxsync()
 	 */
+#ifdef WITH_PIPES
+	if (kring->nr_kflags & NKR_SHMSYNC)
+		netmap_pipe_shm_import(kring);
+#endif /* WITH_PIPES */
 	cur = kring->rcur = ring->cur;	/* read only once */
 	head = kring->rhead = ring->head;	/* read only once */
 #if 1 /* kernel sanity checks */
@@ -1677,7 +1784,8 @@ nm_rxsync_prologue(struct netmap_kring *kring, struct netmap_ring *ring)
 			NM_FAIL_ON(cur < head && cur > kring->nr_hwtail);
 		}
 	}
-	if (ring->tail != kring->rtail) {
+	/* with NR_SHM_SYNC the tail of rx rings belongs to the peer */
+	if (ring->tail != kring->rtail && !(kring->nr_kflags & NKR_SHMSYNC)) {
 		RD(5, "%s tail overwritten was %d need %d",
 			kring->name,
 			ring->tail, kring->rtail);
@@ -1708,6 +1816,8 @@ netmap_ring_reinit(struct netmap_kring *kring)
 
 	// XXX KASSERT nm_kr_tryget
 	RD(10, "called for %s", kring->name);
+	if (netmap_sync_stats)
+		kring->stats.errors++;
 	// XXX probably wrong to trust userspace
 	kring->rhead = ring->head;
 	kring->rcur  = ring->cur;
@@ -1801,11 +1911,30 @@ netmap_interp_ringid(struct netmap_priv_d *priv, uint16_t ringid, uint32_t flags
 			}
 			priv->np_qfirst[t] = (reg == NR_REG_SW ?
 				nma_get_nrings(na, t) : 0);
-			priv->np_qlast[t] = nma_get_nrings(na, t) + 1;
+			priv->np_qlast[t] = netmap_all_rings(na, t);
 			ND("%s: %s %d %d", reg == NR_REG_SW ? "SW" : "NIC+SW",
 				nm_txrx2str(t),
 				priv->np_qfirst[t], priv->np_qlast[t]);
 			break;
+		case NR_REG_ONE_SW:
+			if (!(na->na_flags & NAF_HOST_RINGS)) {
+				D("host rings not supported");
+				return EINVAL;
+			}
+			if (i >= na->num_host_tx_rings &&
+			    i >= na->num_host_rx_rings) {
+				D("invalid host ring id %d", i);
+				return EINVAL;
+			}
+			/* if not enough rings, use the first one */
+			j = i;
+			if (j >= nma_get_host_nrings(na, t))
+				j = 0;
+			priv->np_qfirst[t] = nma_get_nrings(na, t) + j;
+			priv->np_qlast[t] = priv->np_qfirst[t] + 1;
+			ND("ONE_SW: %s %d %d", nm_txrx2str(t),
+				priv->np_qfirst[t], priv->np_qlast[t]);
+			break;
 		case NR_REG_ONE_NIC:
 			if (i >= na->num_tx_rings && i >= na->num_rx_rings) {
 				D("invalid ring id %d", i);
@@ -1893,6 +2022,29 @@ netmap_unset_ringid(struct netmap_priv_d *priv)
 }
 
 
+/* true if the kring belongs to a netmap pipe */
+static inline int
+nm_kring_is_pipe(struct netmap_kring *kring)
+{
+#ifdef WITH_PIPES
+	return kring->pipe != NULL;
+#else
+	return 0;
+#endif /* WITH_PIPES */
+}
+
+/* A ring is in busy-poll mode only if all of its users asked for it:
+ * a single user that may sleep on the ring needs the notifications.
+ */
+static inline void
+netmap_kring_update_bpoll(struct netmap_kring *kring)
+{
+	if (kring->users && kring->bpoll_users == kring->users)
+		kring->nr_kflags |= NKR_BUSYPOLL;
+	else
+		kring->nr_kflags &= ~NKR_BUSYPOLL;
+}
+
 /* Set the nr_pending_mode for the requested rings.
  * If requested, also try to get exclusive access to the rings, provided
  * the rings we want to bind are not exclusively owned by a previous bind.
@@ -1904,8 +2056,22 @@ netmap_krings_get(struct netmap_priv_d *priv)
 	u_int i;
 	struct netmap_kring *kring;
 	int excl = (priv->np_flags & NR_EXCLUSIVE);
+	int bpoll = (priv->np_flags & NR_BUSY_POLL);
+	int shm = (priv->np_flags & NR_SHM_SYNC);
+	int tstamp = (priv->np_flags & NR_RX_TSTAMP);
+	u_int tsclock = NR_TSTAMP_CLOCK(priv->np_flags);
 	enum txrx t;
 
+#ifdef WITH_PIPES
+	/* producers of a fan-in pipe and consumers of a broadcast
+	 * pipe get a ring of their own */
+	if (priv->np_flags & (NR_PIPE_FANIN | NR_PIPE_BCAST)) {
+		int error = netmap_pipe_pick_ring(priv);
+		if (error)
+			return error;
+	}
+#endif /* WITH_PIPES */
+
 	if (netmap_verbose)
 		D("%s: grabbing tx [%d, %d) rx [%d, %d)",
 			na->name,
@@ -1927,6 +2093,24 @@ netmap_krings_get(struct netmap_priv_d *priv)
 				ND("ring %s busy", kring->name);
 				return EBUSY;
 			}
+			if (shm && !nm_kring_is_pipe(kring)) {
+				ND("%s: NR_SHM_SYNC only for pipes", kring->name);
+				return EINVAL;
+			}
+			if (nm_kring_is_pipe(kring) &&
+			    (kring->users || kring->pipe->users) &&
+			    !shm != !(kring->nr_kflags & NKR_SHMSYNC))
+			{
+				/* both ends must agree on NR_SHM_SYNC */
+				ND("ring %s: NR_SHM_SYNC mismatch", kring->name);
+				return EINVAL;
+			}
+			if (tstamp && t == NR_RX && kring->tstamp_users &&
+			    kring->nkr_tsclock != tsclock) {
+				ND("ring %s: NR_RX_TSTAMP clock mismatch",
+					kring->name);
+				return EINVAL;
+			}
 		}
 	}
 
@@ -1936,9 +2120,26 @@ netmap_krings_get(struct netmap_priv_d *priv)
 	for_rx_tx(t) {
 		for (i = priv->np_qfirst[t]; i < priv->np_qlast[t]; i++) {
 			kring = &NMR(na, t)[i];
+			if (kring->users == 0)
+				bzero(&kring->stats, sizeof(kring->stats));
+			/* no notification seen yet, the first poll must
+			 * look at the ring anyway */
+			kring->nkr_notified = 1;
 			kring->users++;
 			if (excl)
 				kring->nr_kflags |= NKR_EXCLUSIVE;
+			if (bpoll)
+				kring->bpoll_users++;
+			netmap_kring_update_bpoll(kring);
+			if (shm) {
+				kring->nr_kflags |= NKR_SHMSYNC;
+				kring->pipe->nr_kflags |= NKR_SHMSYNC;
+			}
+			if (tstamp && t == NR_RX) {
+				kring->tstamp_users++;
+				kring->nkr_tsclock = tsclock;
+				kring->nr_kflags |= NKR_RXTSTAMP;
+			}
 	                kring->nr_pending_mode = NKR_NETMAP_ON;
 		}
 	}
@@ -1957,6 +2158,8 @@ netmap_krings_put(struct netmap_priv_d *priv)
 	u_int i;
 	struct netmap_kring *kring;
 	int excl = (priv->np_flags & NR_EXCLUSIVE);
+	int bpoll = (priv->np_flags & NR_BUSY_POLL);
+	int tstamp = (priv->np_flags & NR_RX_TSTAMP);
 	enum txrx t;
 
 	ND("%s: releasing tx [%d, %d) rx [%d, %d)",
@@ -1973,8 +2176,20 @@ netmap_krings_put(struct netmap_priv_d *priv)
 			if (excl)
 				kring->nr_kflags &= ~NKR_EXCLUSIVE;
 			kring->users--;
+			if (bpoll)
+				kring->bpoll_users--;
+			netmap_kring_update_bpoll(kring);
+			if (tstamp && t == NR_RX &&
+			    --kring->tstamp_users == 0)
+				kring->nr_kflags &= ~NKR_RXTSTAMP;
 			if (kring->users == 0)
 				kring->nr_pending_mode = NKR_NETMAP_OFF;
+			if (nm_kring_is_pipe(kring) && kring->users == 0 &&
+			    kring->pipe->users == 0) {
+				/* nobody left on either end */
+				kring->nr_kflags &= ~NKR_SHMSYNC;
+				kring->pipe->nr_kflags &= ~NKR_SHMSYNC;
+			}
 		}
 	}
 }
@@ -2059,6 +2274,15 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 	NMG_LOCK_ASSERT();
 	/* ring configuration may have changed, fetch from the card */
 	netmap_update_config(na);
+	if (na->active_fds == 0 && na->tx_rings == NULL &&
+	    na->nm_krings_create == netmap_hw_krings_create) {
+		u_int nh = netmap_host_rings;
+
+		/* only NICs can have several host rings. This must be
+		 * done before netmap_set_ringid(), which needs it */
+		nm_bound_var(&nh, 1, 1, NETMAP_RING_MASK, "host_rings");
+		na->num_host_tx_rings = na->num_host_rx_rings = nh;
+	}
 	priv->np_na = na;     /* store the reference */
 	error = netmap_set_ringid(priv, ringid, flags);
 	if (error)
@@ -2154,18 +2378,43 @@ err:
 }
 
 
+/*
+ * NR_RX_TSTAMP: stamp the slots that the rxsync has just made
+ * available (from rtail to hwtail) with a single reading of the clock.
+ */
+static void
+netmap_rx_tstamp(struct netmap_kring *kring)
+{
+	struct netmap_slot *slot = kring->ring->slot;
+	u_int const lim = kring->nkr_num_slots - 1;
+	uint64_t ts = nm_get_tstamp(kring->nkr_tsclock);
+	u_int i;
+
+	for (i = kring->rtail; i != kring->nr_hwtail; i = nm_next(i, lim))
+		slot[i].ptr = ts;
+}
+
 /*
  * update kring and ring at the end of rxsync/txsync.
  */
 static inline void
 nm_sync_finalize(struct netmap_kring *kring)
 {
+	if (unlikely(kring->nr_kflags & NKR_RXTSTAMP)) {
+		if (kring->nr_kflags & NKR_TSTAMPED)
+			kring->nr_kflags &= ~NKR_TSTAMPED;
+		else if (kring->rtail != kring->nr_hwtail)
+			netmap_rx_tstamp(kring);
+	}
 	/*
 	 * Update ring tail to what the kernel knows
 	 * After txsync: head/rhead/hwcur might be behind cur/rcur
 	 * if no carrier.
 	 */
-	kring->ring->tail = kring->rtail = kring->nr_hwtail;
+	kring->rtail = kring->nr_hwtail;
+	/* with NR_SHM_SYNC the tail of rx rings is updated by the peer */
+	if (kring->tx == NR_TX || !(kring->nr_kflags & NKR_SHMSYNC))
+		kring->ring->tail = kring->rtail;
 
 	ND(5, "%s now hwcur %d hwtail %d head %d cur %d tail %d",
 		kring->name, kring->nr_hwcur, kring->nr_hwtail,
@@ -2182,6 +2431,298 @@ ring_timestamp_set(struct netmap_ring *ring)
 }
 
 
+/*
+ * kring->nm_sync() on behalf of a system call, with the tracepoints
+ * and, if netmap_sync_stats is set, the kring counters.
+ * The slots moved are the ones hwcur (tx) or hwtail (rx) advanced by.
+ */
+static inline int
+netmap_kring_sync(struct netmap_kring *kring, int flags)
+{
+	int stats = netmap_sync_stats;
+	uint64_t t0 = 0;
+	u_int pos = 0;
+	int error;
+
+	netmap_trace_sync(enter, kring, 0);
+	if (unlikely(stats)) {
+		t0 = nm_os_get_ns();
+		pos = kring->tx == NR_TX ? kring->nr_hwcur : kring->nr_hwtail;
+	}
+	error = kring->nm_sync(kring, flags);
+	if (unlikely(stats)) {
+		struct nm_kring_stats *st = &kring->stats;
+		int n = (kring->tx == NR_TX ? kring->nr_hwcur :
+				kring->nr_hwtail) - pos;
+
+		if (n < 0)
+			n += kring->nkr_num_slots;
+		st->syncs++;
+		st->slots += n;
+		st->sync_ns += nm_os_get_ns() - t0;
+		if (error)
+			st->errors++;
+	}
+	netmap_trace_sync(exit, kring, error);
+	return error;
+}
+
+/*
+ * Body of NIOCTXSYNC and NIOCRXSYNC: sync the rings in direction t
+ * that are bound to priv, restricted to the ones between first and
+ * last (inclusive).
+ */
+static int
+netmap_sync_rings(struct netmap_priv_d *priv, enum txrx t, u_int first,
+		u_int last)
+{
+	struct mbq q;	/* packets from RX hw queues to host stack */
+	struct netmap_adapter *na;
+	struct netmap_kring *krings;
+	u_int i, qfirst, qlast;
+	int sync_flags;
+	int error = 0;
+
+	if (priv->np_nifp == NULL)
+		return ENXIO;
+	mb(); /* make sure following reads are not from cache */
+
+	na = priv->np_na;      /* we have a reference */
+
+	if (na == NULL) {
+		D("Internal error: nifp != NULL && na == NULL");
+		return ENXIO;
+	}
+
+	mbq_init(&q);
+	krings = NMR(na, t);
+	qfirst = priv->np_qfirst[t];
+	qlast = priv->np_qlast[t];
+	if (qfirst < first)
+		qfirst = first;
+	if (qlast > last + 1)
+		qlast = last + 1;
+	sync_flags = priv->np_sync_flags;
+
+	for (i = qfirst; i < qlast; i++) {
+		struct netmap_kring *kring = krings + i;
+		struct netmap_ring *ring = kring->ring;
+
+		if (unlikely(nm_kr_tryget(kring, 1, &error))) {
+			error = (error ? EIO : 0);
+			continue;
+		}
+
+		if (t == NR_TX) {
+			if (netmap_verbose & NM_VERB_TXSYNC)
+				D("pre txsync ring %d cur %d hwcur %d",
+				    i, ring->cur,
+				    kring->nr_hwcur);
+			if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+				netmap_ring_reinit(kring);
+			} else if (netmap_kring_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
+				nm_sync_finalize(kring);
+			}
+			if (netmap_verbose & NM_VERB_TXSYNC)
+				D("post txsync ring %d cur %d hwcur %d",
+				    i, ring->cur,
+				    kring->nr_hwcur);
+		} else {
+			if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+				netmap_ring_reinit(kring);
+			}
+			if (nm_may_forward_up(kring)) {
+				/* transparent forwarding, see netmap_poll() */
+				netmap_grab_packets(kring, &q, netmap_fwd);
+			}
+			if (netmap_kring_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
+				nm_sync_finalize(kring);
+			}
+			ring_timestamp_set(ring);
+		}
+		nm_kr_put(kring);
+	}
+
+	if (mbq_peek(&q)) {
+		netmap_send_up(na->ifp, &q);
+	}
+
+	return error;
+}
+
+/*
+ * NIOCSYNCV: run netmap_sync_rings() on each entry of a user array.
+ * The entries are copied in and out in small chunks, so that no
+ * allocation is needed. Entries referring to other file descriptors
+ * hold a reference to the file for the duration of the sync, which
+ * keeps their netmap_priv_d alive.
+ */
+#define NM_SYNCV_CHUNK	32
+
+static int
+netmap_syncv(struct netmap_priv_d *priv, struct nmreq_syncv *req)
+{
+	struct nmreq_sync v[NM_SYNCV_CHUNK];
+	char *uaddr = (char *)(uintptr_t)req->nsv_entries;
+	u_int left = req->nsv_count;
+	int error;
+
+	if (left > NETMAP_SYNCV_MAX)
+		return E2BIG;
+	while (left > 0) {
+		u_int n = left < NM_SYNCV_CHUNK ? left : NM_SYNCV_CHUNK, i;
+
+		error = copyin(uaddr, v, n * sizeof(v[0]));
+		if (error)
+			return error;
+		for (i = 0; i < n; i++) {
+			struct nmreq_sync *e = &v[i];
+			struct netmap_priv_d *p = priv;
+			void *cookie = NULL;
+
+			e->ns_error = 0;
+			if (e->ns_fd >= 0) {
+				p = nm_os_priv_get(e->ns_fd, &cookie);
+				if (p == NULL) {
+					e->ns_error = EBADF;
+					continue;
+				}
+			}
+			if (e->ns_flags & NETMAP_SYNC_TX)
+				e->ns_error = netmap_sync_rings(p, NR_TX,
+						e->ns_first, e->ns_last);
+			if ((e->ns_flags & NETMAP_SYNC_RX) && !e->ns_error)
+				e->ns_error = netmap_sync_rings(p, NR_RX,
+						e->ns_first, e->ns_last);
+			if (cookie)
+				nm_os_priv_put(cookie);
+		}
+		error = copyout(v, uaddr, n * sizeof(v[0]));
+		if (error)
+			return error;
+		uaddr += n * sizeof(v[0]);
+		left -= n;
+	}
+	return 0;
+}
+
+
+/*
+ * NR_KPOLL support: a kernel thread spinning on the rings bound to
+ * priv, on behalf of an application that never issues a system call.
+ * The thread runs txsync on the tx rings where the application has
+ * advanced head, or where some slots are still to be reclaimed, and
+ * rxsync on all the rx rings, which also returns the slots released
+ * by the application. Concurrent NIOC*SYNC or poll() from the
+ * application are still safe, as they are serialized by nm_kr_tryget().
+ */
+static void
+netmap_kpoll_work(void *data, int is_kthread)
+{
+	struct netmap_priv_d *priv = data;
+	struct netmap_adapter *na = priv->np_na;
+	u_int i;
+
+	for (i = priv->np_qfirst[NR_TX]; i < priv->np_qlast[NR_TX]; i++) {
+		struct netmap_kring *kring = &NMR(na, NR_TX)[i];
+
+		if (kring->ring->head != kring->rhead ||
+		    nm_kr_txspace(kring) + 1 < kring->nkr_num_slots)
+			netmap_sync_rings(priv, NR_TX, i, i);
+	}
+	for (i = priv->np_qfirst[NR_RX]; i < priv->np_qlast[NR_RX]; i++)
+		netmap_sync_rings(priv, NR_RX, i, i);
+}
+
+/* number of running NR_KPOLL threads, protected by NMG_LOCK */
+static u_int netmap_kpoll_threads;
+
+/* call with NMG_LOCK held, after a successful netmap_do_regif() */
+static int
+netmap_kpoll_start(struct netmap_priv_d *priv, uint32_t cpu)
+{
+	struct nm_kctx_cfg kcfg;
+	u_int max = netmap_kpoll_max > 0 ? netmap_kpoll_max : nm_os_ncpus();
+	int error;
+
+	/* the thread spins forever on a CPU, so this is not for everybody */
+	error = nm_os_kpoll_allowed();
+	if (error)
+		return error;
+	if (netmap_kpoll_threads >= max) {
+		RD(1, "too many kpoll threads (%u), see dev.netmap.kpoll_max",
+			netmap_kpoll_threads);
+		return EBUSY;
+	}
+	if (cpu && (cpu - 1 >= nm_os_ncpus() || !nm_os_cpu_online(cpu - 1)))
+		return EINVAL;
+	bzero(&kcfg, sizeof(kcfg));
+	kcfg.worker_fn = netmap_kpoll_work;
+	kcfg.worker_private = priv;
+	kcfg.use_kthread = 1;
+	priv->np_kpoll = nm_os_kctx_create(&kcfg, 0, NULL);
+	if (priv->np_kpoll == NULL)
+		return ENOMEM;
+	if (cpu)
+		nm_os_kctx_worker_setaff(priv->np_kpoll, cpu - 1);
+	error = nm_os_kctx_worker_start(priv->np_kpoll);
+	if (error) {
+		nm_os_kctx_destroy(priv->np_kpoll);
+		priv->np_kpoll = NULL;
+		return error;
+	}
+	netmap_kpoll_threads++;
+	return 0;
+}
+
+/* call with NMG_LOCK held */
+static void
+netmap_kpoll_stop(struct netmap_priv_d *priv)
+{
+	if (priv->np_kpoll == NULL)
+		return;
+	nm_os_kctx_worker_stop(priv->np_kpoll);
+	nm_os_kctx_destroy(priv->np_kpoll);
+	priv->np_kpoll = NULL;
+	netmap_kpoll_threads--;
+}
+
+
+/*
+ * NIOCRINGSTATS: copy out the counters of a ring of the bound port.
+ * Called with NMG_LOCK held.
+ */
+static int
+netmap_ring_stats_get(struct netmap_priv_d *priv,
+		struct nmreq_ring_stats *req)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct nm_kring_stats *st;
+	enum txrx t;
+
+	if (priv->np_nifp == NULL || na == NULL)
+		return ENXIO;
+	if (req->nrs_dir == NETMAP_SYNC_TX)
+		t = NR_TX;
+	else if (req->nrs_dir == NETMAP_SYNC_RX)
+		t = NR_RX;
+	else
+		return EINVAL;
+	if (req->nrs_ring >= netmap_all_rings(na, t))
+		return EINVAL;
+	st = &NMR(na, t)[req->nrs_ring].stats;
+#ifdef WITH_PIPES
+	req->nrs_drops = NMR(na, t)[req->nrs_ring].pipe_bcast_drops;
+#endif /* WITH_PIPES */
+	req->nrs_syncs = st->syncs;
+	req->nrs_slots = st->slots;
+	req->nrs_sync_ns = st->sync_ns;
+	req->nrs_errors = st->errors;
+	req->nrs_poll_wait = st->poll_wait;
+	req->nrs_poll_ready = st->poll_ready;
+	return 0;
+}
+
 /*
  * ioctl(2) support for the "netmap" device.
  *
@@ -2191,22 +2732,21 @@ ring_timestamp_set(struct netmap_ring *ring)
  * - NIOCREGIF
  * - NIOCTXSYNC
  * - NIOCRXSYNC
+ * - NIOCSYNCV
+ * - NIOCRINGSTATS
  *
  * Return 0 on success, errno otherwise.
  */
 int
 netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread *td)
 {
-	struct mbq q;	/* packets from RX hw queues to host stack */
 	struct nmreq *nmr = (struct nmreq *) data;
 	struct netmap_adapter *na = NULL;
 	struct netmap_mem_d *nmd = NULL;
 	struct ifnet *ifp = NULL;
 	int error = 0;
-	u_int i, qfirst, qlast;
+	u_int i;
 	struct netmap_if *nifp;
-	struct netmap_kring *krings;
-	int sync_flags;
 	enum txrx t;
 
 	if (cmd == NIOCGINFO || cmd == NIOCREGIF) {
@@ -2288,7 +2828,9 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			/* possibly attach/detach NIC and VALE switch */
 			error = netmap_bdg_ctl(nmr, NULL);
 			break;
-		} else if (i == NETMAP_PT_HOST_CREATE || i == NETMAP_PT_HOST_DELETE) {
+		} else if (i == NETMAP_PT_HOST_CREATE || i == NETMAP_PT_HOST_DELETE
+				|| i == NETMAP_PT_HOST_STATS
+				|| i == NETMAP_PT_HOST_BATCH_LIM) {
 			/* forward the command to the ptnetmap subsystem */
 			error = ptnetmap_ctl(nmr, priv->np_na);
 			break;
@@ -2354,6 +2896,27 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				break;
 			}
 
+			if ((nmr->nr_flags & (NR_KPOLL | NR_RX_TSTAMP)) &&
+			    (nmr->nr_flags &
+			    (NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON))) {
+				error = EINVAL;
+				break;
+			}
+
+			/* spare2[0] is the drop policy of broadcast pipes */
+			if ((nmr->nr_flags & NR_KPOLL) &&
+			    (nmr->nr_flags & NR_PIPE_BCAST)) {
+				error = EINVAL;
+				break;
+			}
+
+			if ((nmr->nr_flags & NR_RX_TSTAMP) &&
+			    NR_TSTAMP_CLOCK(nmr->nr_flags) >
+			    NR_TSTAMP_CLOCK(NR_TSTAMP_RAW)) {
+				error = EINVAL;
+				break;
+			}
+
 			error = netmap_do_regif(priv, na, nmr->nr_ringid, nmr->nr_flags);
 			if (error) {    /* reg. failed, release priv and ref */
 				break;
@@ -2361,6 +2924,13 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			nifp = priv->np_nifp;
 			priv->np_td = td; // XXX kqueue, debugging only
 
+			if (nmr->nr_flags & NR_PIPE_FANIN) {
+				/* tell the producer which tx ring it got */
+				nmr->nr_arg1 = priv->np_qfirst[NR_TX];
+			} else if (nmr->nr_flags & NR_PIPE_BCAST) {
+				/* tell the consumer which rx ring it got */
+				nmr->nr_arg1 = priv->np_qfirst[NR_RX];
+			}
 			/* return the offset of the netmap_if object */
 			nmr->nr_rx_rings = na->num_rx_rings;
 			nmr->nr_tx_rings = na->num_tx_rings;
@@ -2390,6 +2960,14 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			}
 			nmr->nr_offset = netmap_mem_if_offset(na->nm_mem, nifp);
 
+			if (nmr->nr_flags & NR_KPOLL) {
+				error = netmap_kpoll_start(priv, nmr->spare2[0]);
+				if (error) {
+					netmap_do_unregif(priv);
+					break;
+				}
+			}
+
 			/* store ifp reference so that priv destructor may release it */
 			priv->np_ifp = ifp;
 		} while (0);
@@ -2406,77 +2984,34 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 
 	case NIOCTXSYNC:
 	case NIOCRXSYNC:
-		nifp = priv->np_nifp;
-
-		if (nifp == NULL) {
-			error = ENXIO;
-			break;
-		}
-		mb(); /* make sure following reads are not from cache */
-
-		na = priv->np_na;      /* we have a reference */
-
-		if (na == NULL) {
-			D("Internal error: nifp != NULL && na == NULL");
-			error = ENXIO;
-			break;
-		}
-
-		mbq_init(&q);
 		t = (cmd == NIOCTXSYNC ? NR_TX : NR_RX);
-		krings = NMR(na, t);
-		qfirst = priv->np_qfirst[t];
-		qlast = priv->np_qlast[t];
-		sync_flags = priv->np_sync_flags;
-
-		for (i = qfirst; i < qlast; i++) {
-			struct netmap_kring *kring = krings + i;
-			struct netmap_ring *ring = kring->ring;
-
-			if (unlikely(nm_kr_tryget(kring, 1, &error))) {
-				error = (error ? EIO : 0);
-				continue;
-			}
-
-			if (cmd == NIOCTXSYNC) {
-				if (netmap_verbose & NM_VERB_TXSYNC)
-					D("pre txsync ring %d cur %d hwcur %d",
-					    i, ring->cur,
-					    kring->nr_hwcur);
-				if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
-					netmap_ring_reinit(kring);
-				} else if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
-					nm_sync_finalize(kring);
-				}
-				if (netmap_verbose & NM_VERB_TXSYNC)
-					D("post txsync ring %d cur %d hwcur %d",
-					    i, ring->cur,
-					    kring->nr_hwcur);
-			} else {
-				if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
-					netmap_ring_reinit(kring);
-				}
-				if (nm_may_forward_up(kring)) {
-					/* transparent forwarding, see netmap_poll() */
-					netmap_grab_packets(kring, &q, netmap_fwd);
-				}
-				if (kring->nm_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
-					nm_sync_finalize(kring);
-				}
-				ring_timestamp_set(ring);
-			}
-			nm_kr_put(kring);
-		}
+		error = netmap_sync_rings(priv, t, 0, NETMAP_SYNC_ALLRINGS);
+		break;
 
-		if (mbq_peek(&q)) {
-			netmap_send_up(na->ifp, &q);
-		}
+	case NIOCSYNCV:
+		error = netmap_syncv(priv, (struct nmreq_syncv *)data);
+		break;
 
+	case NIOCRINGSTATS:
+		NMG_LOCK();
+		error = netmap_ring_stats_get(priv,
+				(struct nmreq_ring_stats *)data);
+		NMG_UNLOCK();
 		break;
 
-#ifdef WITH_VALE
+#if defined(WITH_VALE) || defined(WITH_MONITOR)
 	case NIOCCONFIG:
-		error = netmap_bdg_config(nmr);
+		error = EOPNOTSUPP;
+#ifdef WITH_MONITOR
+		/* filters of copy monitors */
+		NMG_LOCK();
+		error = netmap_monitor_config(priv, (struct nm_ifreq *)data);
+		NMG_UNLOCK();
+#endif
+#ifdef WITH_VALE
+		if (error == EOPNOTSUPP)
+			error = netmap_bdg_config(nmr);
+#endif
 		break;
 #endif
 #ifdef __FreeBSD__
@@ -2519,6 +3054,57 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 }
 
 
+/*
+ * A fd bound to many rings sleeps on the global wait queue, and
+ * each wakeup would sync all of them. Instead, only the rings that
+ * have been notified since the last scan are synced, plus the ones
+ * where the application moved head (slots to transmit, or to give
+ * back to the NIC), the ones that are still ready (poll is level
+ * triggered) and the ones that may change without a notification
+ * (no interrupts, busy polling users).
+ * The flag is cleared before the sync, so a notification that races
+ * with it is not lost, at most it causes one more sync.
+ */
+static inline int
+nm_poll_needed(struct netmap_kring *kring)
+{
+	if (kring->nkr_notified) {
+		kring->nkr_notified = 0;
+		mb();
+		return 1;
+	}
+	return (kring->nr_kflags & (NKR_NOINTR | NKR_BUSYPOLL)) ||
+		kring->rhead != kring->ring->head ||
+		!nm_ring_empty(kring->ring);
+}
+
+/*
+ * Account a netmap_poll() in the counters of the first ring bound in
+ * each direction that was asked for, as ready if the events are
+ * returned, as a wait (the caller is going to sleep) otherwise.
+ */
+static void
+netmap_poll_stats(struct netmap_priv_d *priv, int events, int revents)
+{
+	int ev[NR_TXRX];
+	enum txrx t;
+
+	ev[NR_TX] = POLLOUT | POLLWRNORM;
+	ev[NR_RX] = POLLIN | POLLRDNORM;
+	for_rx_tx(t) {
+		struct nm_kring_stats *st;
+
+		if (!(events & ev[t]) ||
+		    priv->np_qfirst[t] >= priv->np_qlast[t])
+			continue;
+		st = &NMR(priv->np_na, t)[priv->np_qfirst[t]].stats;
+		if (revents & ev[t])
+			st->poll_ready++;
+		else
+			st->poll_wait++;
+	}
+}
+
 /*
  * select(2) and poll(2) handlers for the "netmap" device.
  *
@@ -2664,6 +3250,9 @@ flush_tx:
 			if (!send_down && !want_tx && ring->cur == kring->nr_hwcur)
 				continue;
 
+			if (check_all_tx && !send_down && !nm_poll_needed(kring))
+				continue;
+
 			if (nm_kr_tryget(kring, 1, &revents))
 				continue;
 
@@ -2671,7 +3260,7 @@ flush_tx:
 				netmap_ring_reinit(kring);
 				revents |= POLLERR;
 			} else {
-				if (kring->nm_sync(kring, sync_flags))
+				if (netmap_kring_sync(kring, sync_flags))
 					revents |= POLLERR;
 				else
 					nm_sync_finalize(kring);
@@ -2716,6 +3305,9 @@ do_retry_rx:
 			kring = &na->rx_rings[i];
 			ring = kring->ring;
 
+			if (check_all_rx && !nm_poll_needed(kring))
+				continue;
+
 			if (unlikely(nm_kr_tryget(kring, 1, &revents)))
 				continue;
 
@@ -2737,7 +3329,7 @@ do_retry_rx:
 			 * the nm_sync() below only on for the host RX ring (see
 			 * netmap_rxsync_from_host()). */
 			kring->nr_kflags &= ~NR_FORWARD;
-			if (kring->nm_sync(kring, sync_flags))
+			if (netmap_kring_sync(kring, sync_flags))
 				revents |= POLLERR;
 			else
 				nm_sync_finalize(kring);
@@ -2777,6 +3369,9 @@ do_retry_rx:
 		netmap_send_up(na->ifp, &q);
 	}
 
+	if (unlikely(netmap_sync_stats))
+		netmap_poll_stats(priv, events, revents);
+
 	return (revents);
 #undef want_tx
 #undef want_rx
@@ -2830,6 +3425,7 @@ netmap_notify(struct netmap_kring *kring, int flags)
 	struct netmap_adapter *na = kring->na;
 	enum txrx t = kring->tx;
 
+	kring->nkr_notified = 1;
 	nm_os_selwakeup(&kring->si);
 	/* optimization: avoid a wake up on the global
 	 * queue if nobody has registered for more
@@ -2853,6 +3449,11 @@ netmap_attach_common(struct netmap_adapter *na)
 			na->name, na->num_tx_rings, na->num_rx_rings);
 		return EINVAL;
 	}
+	/* one host ring pair (possibly fake) unless told otherwise */
+	if (na->num_host_tx_rings == 0)
+		na->num_host_tx_rings = 1;
+	if (na->num_host_rx_rings == 0)
+		na->num_host_rx_rings = 1;
 
 #ifdef __FreeBSD__
 	if (na->na_flags & NAF_HOST_RINGS && na->ifp) {
@@ -3065,10 +3666,21 @@ int
 netmap_hw_krings_create(struct netmap_adapter *na)
 {
 	int ret = netmap_krings_create(na, 0);
+	u_int i;
+
 	if (ret == 0) {
-		/* initialize the mbq for the sw rx ring */
-		mbq_safe_init(&na->rx_rings[na->num_rx_rings].rx_queue);
-		ND("initialized sw rx queue %d", na->num_rx_rings);
+		/* initialize the mbqs for the sw rx rings */
+		for (i = na->num_rx_rings; i < netmap_all_rings(na, NR_RX); i++) {
+			struct netmap_kring *kring = &na->rx_rings[i];
+
+			ret = mbq_ring_init(&kring->rx_queue,
+					kring->nkr_num_slots);
+			if (ret) {
+				netmap_hw_krings_delete(na);
+				break;
+			}
+			ND("initialized sw rx queue %d", i);
+		}
 	}
 	return ret;
 }
@@ -3125,13 +3737,20 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 {
 	struct netmap_adapter *na = NA(ifp);
 	struct netmap_kring *kring, *tx_kring;
-	u_int len = MBUF_LEN(m);
+	u_int len;
 	u_int error = ENOBUFS;
-	unsigned int txr;
-	struct mbq *q;
+	unsigned int txr, hr;
+	struct mbq_ring *q;
 	int busy;
 
-	kring = &na->rx_rings[na->num_rx_rings];
+	/* steer to a host ring, following the tx queue chosen by the
+	 * stack, or the flow hash if there are fewer tx queues */
+	hr = 0;
+	if (na->num_host_rx_rings > 1) {
+		hr = (na->num_tx_rings >= na->num_host_rx_rings ?
+			MBUF_TXQ(m) : MBUF_HASH(m)) % na->num_host_rx_rings;
+	}
+	kring = &na->rx_rings[na->num_rx_rings + hr];
 	// XXX [Linux] we do not need this lock
 	// if we follow the down/configure/up protocol -gl
 	// mtx_lock(&na->core_lock);
@@ -3154,44 +3773,68 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 
 	q = &kring->rx_queue;
 
-	// XXX reconsider long packets if we handle fragments
-	if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
-		D("%s from_host, drop packet size %d > %d", na->name,
-			len, NETMAP_BUF_SIZE(na));
-		goto done;
-	}
-
 	if (nm_os_mbuf_has_offld(m)) {
-		RD(1, "%s drop mbuf that needs offloadings", na->name);
-		goto done;
+		/* segment and checksum in software, so that the host
+		 * stack can keep its offloadings on */
+		m = nm_os_mbuf_segment(m);
+		if (m == NULL) {
+			RD(1, "%s drop mbuf that needs offloadings", na->name);
+			goto done;
+		}
 	}
 
-	/* protect against netmap_rxsync_from_host(), netmap_sw_to_nic()
-	 * and maybe other instances of netmap_transmit (the latter
-	 * not possible on Linux).
-	 * We enqueue the mbuf only if we are sure there is going to be
-	 * enough room in the host RX ring, otherwise we drop it.
+	/* No lock against netmap_rxsync_from_host() or other instances
+	 * of netmap_transmit (the latter not possible on Linux), the
+	 * mbufs go to the lock-free rx_queue in batches.
+	 * We enqueue each mbuf only if there is going to be enough room
+	 * in the host RX ring, as far as we can tell from a snapshot of
+	 * the kring, otherwise we drop it and the ones that follow.
 	 */
-	mbq_lock(q);
-
-        busy = kring->nr_hwtail - kring->nr_hwcur;
-        if (busy < 0)
-                busy += kring->nkr_num_slots;
-	if (busy + mbq_len(q) >= kring->nkr_num_slots - 1) {
-		RD(2, "%s full hwcur %d hwtail %d qlen %d", na->name,
-			kring->nr_hwcur, kring->nr_hwtail, mbq_len(q));
-	} else {
-		mbq_enqueue(q, m);
-		ND(2, "%s %d bufs in queue", na->name, mbq_len(q));
-		/* notify outside the lock */
-		m = NULL;
-		error = 0;
+	busy = kring->nr_hwtail - kring->nr_hwcur;
+	if (busy < 0)
+		busy += kring->nkr_num_slots;
+	for (error = 0; m != NULL && error == 0; ) {
+		struct mbuf *batch[NM_HOST_BATCH];
+		u_int n = 0, k;
+
+		while (m != NULL && n < NM_HOST_BATCH) {
+			// XXX reconsider long packets if we handle fragments
+			len = MBUF_LEN(m);
+			if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
+				RD(1, "%s from_host, drop packet size %d > %d",
+					na->name, len, NETMAP_BUF_SIZE(na));
+				error = ENOBUFS;
+				break;
+			}
+			if (busy + mbq_ring_len(q) + n >= kring->nkr_num_slots - 1) {
+				RD(2, "%s full hwcur %d hwtail %d qlen %d",
+					na->name, kring->nr_hwcur,
+					kring->nr_hwtail, mbq_ring_len(q));
+				error = ENOBUFS;
+				break;
+			}
+			batch[n++] = m;
+			m = m->m_nextpkt;
+			batch[n - 1]->m_nextpkt = NULL;
+		}
+		k = mbq_ring_enqueue_batch(q, batch, n);
+		ND(2, "%s %d bufs in queue", na->name, mbq_ring_len(q));
+		if (k < n) {
+			error = ENOBUFS;
+			while (k < n)
+				m_freem(batch[k++]);
+		}
 	}
-	mbq_unlock(q);
 
 done:
-	if (m)
+	/* drop what could not be queued */
+	while (m) {
+		struct mbuf *next = m->m_nextpkt;
+
+		m->m_nextpkt = NULL;
 		m_freem(m);
+		m = next;
+	}
 	/* unconditionally wake up listeners */
 	kring->nm_notify(kring, 0);
 	/* this is normally netmap_notify(), but for nics
@@ -31,11 +31,15 @@
 #include <sys/module.h>
 #include <sys/errno.h>
 #include <sys/jail.h>
+#include <sys/priv.h> /* priv_check() */
 #include <sys/poll.h>  /* POLLIN, POLLOUT */
 #include <sys/kernel.h> /* types used in module initialization */
 #include <sys/conf.h>	/* DEV_MODULE_ORDERED */
 #include <sys/endian.h>
 #include <sys/syscallsubr.h> /* kern_ioctl() */
+#include <sys/capsicum.h> /* cap_rights_init() */
+#include <sys/file.h> /* fget(), fdrop() */
+#include <fs/devfs/devfs_int.h> /* struct cdev_privdata */
 
 #include <sys/rwlock.h>
 
@@ -62,7 +66,13 @@
 #include <net/ethernet.h> /* ether_ifdetach */
 #include <net/if_dl.h> /* LLADDR */
 #include <machine/bus.h>        /* bus_dmamap_* */
+#include <machine/cpu.h>	/* get_cyclecount() */
+#include <net/if_vlan_var.h>	/* struct ether_vlan_header */
 #include <netinet/in.h>		/* in6_cksum_pseudo() */
+#include <netinet/ip.h>
+#include <netinet/ip_var.h>	/* in_delayed_cksum() */
+#include <netinet/ip6.h>
+#include <netinet6/ip6_var.h>	/* in6_delayed_cksum() */
 #include <machine/in_cksum.h>  /* in_pseudo(), in_cksum_hdr() */
 
 #include <net/netmap.h>
@@ -107,6 +117,66 @@ nm_os_free(void *addr)
 	free(addr, M_DEVBUF);
 }
 
+uint64_t
+nm_os_get_ns(void)
+{
+	struct timespec ts;
+
+	nanouptime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+nm_os_get_realtime_ns(void)
+{
+	struct timespec ts;
+
+	nanotime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+nm_os_get_cycles(void)
+{
+	return get_cyclecount();
+}
+
+struct netmap_priv_d *
+nm_os_priv_get(int fd, void **cookie)
+{
+	struct thread *td = curthread;
+	struct file *fp, *fpop;
+	cap_rights_t rights;
+	void *priv = NULL;
+
+	if (fget(td, fd, cap_rights_init(&rights, CAP_IOCTL), &fp))
+		return NULL;
+	/* f_cdevpriv is only meaningful on devfs files */
+	if (fp->f_type != DTYPE_VNODE || fp->f_ops != &devfs_ops_f) {
+		fdrop(fp, td);
+		return NULL;
+	}
+	/* devfs_get_cdevpriv() looks at the file being operated on */
+	fpop = td->td_fpop;
+	td->td_fpop = fp;
+	if (devfs_get_cdevpriv(&priv) ||
+	    fp->f_cdevpriv->cdp_dtr != netmap_dtor)
+		priv = NULL;
+	td->td_fpop = fpop;
+	if (priv == NULL) {
+		fdrop(fp, td);
+		return NULL;
+	}
+	*cookie = fp;
+	return priv;
+}
+
+void
+nm_os_priv_put(void *cookie)
+{
+	fdrop((struct file *)cookie, curthread);
+}
+
 void
 nm_os_ifnet_lock(void)
 {
@@ -265,6 +335,87 @@ nm_os_mbuf_has_offld(struct mbuf *m)
 					 CSUM_SCTP_IPV6 | CSUM_TSO);
 }
 
+/*
+ * There is no software TSO on FreeBSD, but the TCP and UDP checksums
+ * left to the NIC can be completed here, with the same routines used
+ * by the stack for the interfaces that cannot compute them.
+ */
+struct mbuf *
+nm_os_mbuf_segment(struct mbuf *m)
+{
+	char eh[ETHER_HDR_LEN + ETHER_VLAN_ENCAP_LEN];
+	int ehlen = ETHER_HDR_LEN;
+	int csum = m->m_pkthdr.csum_flags;
+	uint16_t etype;
+
+	if (csum & (CSUM_TSO | CSUM_SCTP | CSUM_SCTP_IPV6))
+		goto drop;
+	if (!(csum & (CSUM_DELAY_DATA | CSUM_DELAY_DATA_IPV6)))
+		goto done;
+
+	/* the delayed checksum routines expect the IP header first,
+	 * so take the Ethernet header away and put it back later */
+	m = m_pullup(m, ETHER_HDR_LEN);
+	if (m == NULL)
+		return NULL;
+	etype = ntohs(mtod(m, struct ether_header *)->ether_type);
+	if (etype == ETHERTYPE_VLAN) {
+		ehlen += ETHER_VLAN_ENCAP_LEN;
+		m = m_pullup(m, ehlen);
+		if (m == NULL)
+			return NULL;
+		etype = ntohs(mtod(m, struct ether_vlan_header *)->evl_proto);
+	}
+	m_copydata(m, 0, ehlen, eh);
+	m_adj(m, ehlen);
+
+	switch (etype) {
+#ifdef INET
+	case ETHERTYPE_IP:
+		if (!(csum & CSUM_DELAY_DATA))
+			goto drop;
+		m = m_pullup(m, sizeof(struct ip));
+		if (m == NULL)
+			return NULL;
+		in_delayed_cksum(m);
+		m->m_pkthdr.csum_flags &= ~CSUM_DELAY_DATA;
+		break;
+#endif /* INET */
+#ifdef INET6
+	case ETHERTYPE_IPV6: {
+		struct ip6_hdr *ip6;
+
+		if (!(csum & CSUM_DELAY_DATA_IPV6))
+			goto drop;
+		m = m_pullup(m, sizeof(struct ip6_hdr));
+		if (m == NULL)
+			return NULL;
+		ip6 = mtod(m, struct ip6_hdr *);
+		/* extension headers are not supported */
+		if (ip6->ip6_nxt != IPPROTO_TCP && ip6->ip6_nxt != IPPROTO_UDP)
+			goto drop;
+		in6_delayed_cksum(m, ntohs(ip6->ip6_plen),
+				sizeof(struct ip6_hdr));
+		m->m_pkthdr.csum_flags &= ~CSUM_DELAY_DATA_IPV6;
+		break;
+	}
+#endif /* INET6 */
+	default:
+		goto drop;
+	}
+
+	M_PREPEND(m, ehlen, M_NOWAIT);
+	if (m == NULL)
+		return NULL;
+	m_copyback(m, 0, ehlen, eh);
+done:
+	m->m_nextpkt = NULL;
+	return m;
+drop:
+	m_freem(m);
+	return NULL;
+}
+
 static void
 freebsd_generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 {
@@ -1008,6 +1159,18 @@ nm_os_ncpus(void)
 	return mp_maxid + 1;
 }
 
+int
+nm_os_cpu_online(u_int cpu)
+{
+	return cpu <= mp_maxid && !CPU_ABSENT(cpu);
+}
+
+int
+nm_os_kpoll_allowed(void)
+{
+	return priv_check(curthread, PRIV_DRIVER);
+}
+
 struct nm_kctx_ctx {
 	struct thread *user_td;		/* thread user-space (kthread creator) to send ioctl */
 	struct ptnetmap_cfgentry_bhyve	cfg;
@@ -1136,7 +1299,9 @@ nm_os_kctx_create(struct nm_kctx_cfg *cfg, unsigned int cfgtype,
 {
 	struct nm_kctx *nmk = NULL;
 
-	if (cfgtype != PTNETMAP_CFGTYPE_BHYVE) {
+	/* a configuration is only needed by ptnetmap, the other users
+	 * (VALE polling, NR_KPOLL) pass none and run continuously */
+	if (opaque && cfgtype != PTNETMAP_CFGTYPE_BHYVE) {
 		D("Unsupported cfgtype %u", cfgtype);
 		return NULL;
 	}
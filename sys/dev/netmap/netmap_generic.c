@@ -234,12 +234,12 @@ nm_os_get_mbuf(struct ifnet *ifp, int len)
 #define for_each_tx_kring(_i, _k, _na) \
             for_each_kring_n(_i, _k, (_na)->tx_rings, (_na)->num_tx_rings)
 #define for_each_tx_kring_h(_i, _k, _na) \
-            for_each_kring_n(_i, _k, (_na)->tx_rings, (_na)->num_tx_rings + 1)
+            for_each_kring_n(_i, _k, (_na)->tx_rings, netmap_all_rings(_na, NR_TX))
 
 #define for_each_rx_kring(_i, _k, _na) \
             for_each_kring_n(_i, _k, (_na)->rx_rings, (_na)->num_rx_rings)
 #define for_each_rx_kring_h(_i, _k, _na) \
-            for_each_kring_n(_i, _k, (_na)->rx_rings, (_na)->num_rx_rings + 1)
+            for_each_kring_n(_i, _k, (_na)->rx_rings, netmap_all_rings(_na, NR_RX))
 
 
 /* ======================== PERFORMANCE STATISTICS =========================== */
@@ -329,6 +329,69 @@ netmap_generic_irq(struct netmap_adapter *na, u_int q, u_int *work_done)
 #endif  /* RATE_GENERIC */
 }
 
+/* ============== RX NOTIFICATION MITIGATION =============== */
+
+static inline int
+generic_mit_enabled(void)
+{
+	return netmap_generic_mit_adaptive || netmap_generic_mit >= 32768;
+}
+
+/* publish the counters of a ring in its netmap_gen_stats */
+static inline void
+generic_mit_publish(struct nm_generic_mit *mit)
+{
+	struct netmap_kring *kring = &mit->mit_na->rx_rings[mit->mit_ring_idx];
+	struct netmap_gen_stats *st;
+
+	if (kring->ring == NULL)
+		return;
+	st = NETMAP_GEN_STATS(kring->ring);
+	st->irq_delivered = mit->mit_delivered;
+	st->irq_suppressed = mit->mit_suppressed;
+	st->mit_interval = generic_mit_enabled() ? mit->mit_interval : 0;
+}
+
+/*
+ * Adapt the mitigation period of a ring to the rate of its packets,
+ * the same way NICs do with adaptive interrupt coalescing: the period
+ * is doubled if more than generic_mit_batch packets were held back
+ * during the last one, and halved if less than a quarter of them,
+ * always staying between generic_mit_lo and generic_mit_hi.
+ * Without generic_mit_adaptive, the period follows generic_mit.
+ * The counters of the ring are published here as well.
+ */
+void
+netmap_generic_mit_update(struct nm_generic_mit *mit)
+{
+	u_int lo = netmap_generic_mit_lo, hi = netmap_generic_mit_hi;
+	u_int batch = netmap_generic_mit_batch, iv = mit->mit_interval;
+
+	if (!netmap_generic_mit_adaptive) {
+		mit->mit_interval = netmap_generic_mit;
+		mit->mit_held = 0;
+		generic_mit_publish(mit);
+		return;
+	}
+	if (lo < 1000)
+		lo = 1000;
+	if (hi < lo)
+		hi = lo;
+	if (batch < 4)
+		batch = 4;
+	if (mit->mit_held > batch)
+		iv *= 2;
+	else if (mit->mit_held < batch / 4)
+		iv /= 2;
+	if (iv < lo)
+		iv = lo;
+	else if (iv > hi)
+		iv = hi;
+	mit->mit_interval = iv;
+	mit->mit_held = 0;
+	generic_mit_publish(mit);
+}
+
 static int
 generic_netmap_unregister(struct netmap_adapter *na)
 {
@@ -364,10 +427,13 @@ generic_netmap_unregister(struct netmap_adapter *na)
 	}
 
 	for_each_rx_kring(r, kring, na) {
-		/* Free the mbufs still pending in the RX queues,
-		 * that did not end up into the corresponding netmap
-		 * RX rings. */
-		mbq_safe_purge(&kring->rx_queue);
+		/* Free the mbufs still pending in the RX queues of the
+		 * deactivated rings, that did not end up into the
+		 * corresponding netmap RX rings. The active rings
+		 * may be in a rxsync, which owns the consumer side. */
+		if (kring->nr_mode == NKR_NETMAP_OFF &&
+				kring->gen_rxq.slot != NULL)
+			mbq_ring_purge(&kring->gen_rxq);
 		nm_os_mitigation_cleanup(&gna->mit[r]);
 	}
 
@@ -392,7 +458,7 @@ generic_netmap_unregister(struct netmap_adapter *na)
 		nm_os_free(gna->mit);
 
 		for_each_rx_kring(r, kring, na) {
-			mbq_safe_fini(&kring->rx_queue);
+			mbq_ring_fini(&kring->gen_rxq);
 		}
 
 		for_each_tx_kring(r, kring, na) {
@@ -430,6 +496,7 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 	struct netmap_kring *kring = NULL;
 	int error;
 	int i, r;
+	u_int qlen;
 
 	if (!na) {
 		return EINVAL;
@@ -456,11 +523,27 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 		for_each_rx_kring(r, kring, na) {
 			/* Init mitigation support. */
 			nm_os_mitigation_init(&gna->mit[r], r, na);
-
+			gna->mit[r].mit_interval = netmap_generic_mit_adaptive ?
+				netmap_generic_mit_lo : netmap_generic_mit;
+			gna->mit[r].mit_held = 0;
+			gna->mit[r].mit_delivered = 0;
+			gna->mit[r].mit_suppressed = 0;
+			if (kring->ring)
+				memset(NETMAP_GEN_STATS(kring->ring), 0,
+					sizeof(struct netmap_gen_stats));
+			kring->gen_rxq.slot = NULL;
+		}
+		qlen = netmap_generic_rxqlen;
+		nm_bound_var(&qlen, 1024, 64, 65536, "generic_rxqlen");
+		for_each_rx_kring(r, kring, na) {
 			/* Initialize the rx queue, as generic_rx_handler() can
 			 * be called as soon as nm_os_catch_rx() returns.
 			 */
-			mbq_safe_init(&kring->rx_queue);
+			error = mbq_ring_init(&kring->gen_rxq, qlen);
+			if (error) {
+				D("rx queue allocation failed");
+				goto free_rx_queues;
+			}
 		}
 
 		/*
@@ -557,8 +640,9 @@ free_tx_pools:
 		nm_os_free(kring->tx_pool);
 		kring->tx_pool = NULL;
 	}
+free_rx_queues:
 	for_each_rx_kring(r, kring, na) {
-		mbq_safe_fini(&kring->rx_queue);
+		mbq_ring_fini(&kring->gen_rxq);
 	}
 	nm_os_free(gna->mit);
 out:
@@ -782,7 +866,11 @@ generic_set_tx_event(struct netmap_kring *kring, u_int hwcur)
  * and passes them to the standard device driver
  * (ndo_start_xmit() or ifp->if_transmit() ).
  * On linux this is not done directly, but using dev_queue_xmit(),
- * since it implements the TX flow control (and takes some locks).
+ * since it implements the TX flow control (and takes some locks),
+ * unless the netmap-aware qdisc is disabled and generic_txbatch is set:
+ * in that case the whole batch is handed to the driver under a single
+ * acquisition of the tx queue lock, with the 'more' hint set on all
+ * the packets but the last one.
  */
 static int
 generic_netmap_txsync(struct netmap_kring *kring, int flags)
@@ -821,6 +909,7 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 		a.ifp = ifp;
 		a.ring_nr = ring_nr;
 		a.head = a.tail = NULL;
+		a.more = 0;
 
 		while (nm_i != head) {
 			struct netmap_slot *slot = &ring->slot[nm_i];
@@ -855,6 +944,20 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 			a.addr = addr;
 			a.len = len;
 			a.qevent = (nm_i == event);
+			/* Tell the driver that more packets follow, so that
+			 * it can defer the doorbell. The hint is only given
+			 * if the mbuf for the next slot is ready, otherwise
+			 * we may break early and leave the doorbell pending. */
+			a.more = 0;
+			if (nm_next(nm_i, lim) != head) {
+				u_int nx = nm_next(nm_i, lim);
+
+				if (unlikely(kring->tx_pool[nx] == NULL)) {
+					kring->tx_pool[nx] = nm_os_get_mbuf(ifp,
+						NETMAP_BUF_SIZE(na));
+				}
+				a.more = (kring->tx_pool[nx] != NULL);
+			}
 			/* When not in txqdisc mode, we should ask
 			 * notifications when NS_REPORT is set, or roughly
 			 * every half ring. To optimize this, we set a
@@ -908,7 +1011,9 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 			IFRATE(rate_ctx.new.txpkt++);
 		}
 		if (a.head != NULL) {
+			/* flush the batch (or release the tx queue) */
 			a.addr = NULL;
+			a.more = 0;
 			nm_os_generic_xmit_frame(&a);
 		}
 		/* Update hwcur to the next slot to transmit. Here nm_i
@@ -971,14 +1076,14 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 		RD(2, "Warning: driver pushed up big packet "
 				"(size=%d)", (int)MBUF_LEN(m));
 		m_freem(m);
-	} else if (unlikely(mbq_len(&kring->rx_queue) > 1024)) {
+	} else if (unlikely(mbq_ring_enqueue(&kring->gen_rxq, m))) {
+		/* the queue is full (see generic_rxqlen) */
 		m_freem(m);
-	} else {
-		mbq_safe_enqueue(&kring->rx_queue, m);
 	}
 
-	if (netmap_generic_mit < 32768) {
+	if (!generic_mit_enabled()) {
 		/* no rx mitigation, pass notification up */
+		gna->mit[r].mit_delivered++;
 		netmap_generic_irq(na, r, &work_done);
 	} else {
 		/* same as send combining, filter notification if there is a
@@ -987,7 +1092,10 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 		if (likely(nm_os_mitigation_active(&gna->mit[r]))) {
 			/* Record that there is some pending work. */
 			gna->mit[r].mit_pending = 1;
+			gna->mit[r].mit_held++;
+			gna->mit[r].mit_suppressed++;
 		} else {
+			gna->mit[r].mit_delivered++;
 			netmap_generic_irq(na, r, &work_done);
 			nm_os_mitigation_start(&gna->mit[r]);
 		}
@@ -997,17 +1105,73 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 	return 1;
 }
 
+#ifdef linux
+/*
+ * Copy a nonlinear skb (e.g. an aggregated frame, or a frame that the
+ * driver built on its rx pages) into the slots starting at *nm_i, whose
+ * lengths have already been set. m_copydata() would walk the fragments
+ * from the beginning for each slot; here they are visited only once,
+ * and each page is mapped only while it is being copied.
+ * Returns -1 if one of the slots has an invalid buffer.
+ */
+static int
+generic_rx_copy_frags(struct netmap_adapter *na, struct netmap_ring *ring,
+		u_int *nm_i, struct mbuf *m)
+{
+	u_int const lim = ring->num_slots - 1;
+	struct skb_seq_state st;
+	const u8 *data = NULL;
+	u_int consumed = 0, avail = 0;
+	int morefrag, error = 0;
+
+	skb_prepare_seq_read(m, 0, m->len, &st);
+	do {
+		struct netmap_slot *slot = &ring->slot[*nm_i];
+		char *dst = NMB(na, slot);
+		u_int left = slot->len;
+
+		if (dst == NETMAP_BUF_BASE(na)) { /* Bad buffer */
+			error = -1;
+			break;
+		}
+		while (left) {
+			u_int copy;
+
+			if (avail == 0) {
+				avail = skb_seq_read(consumed, &data, &st);
+				if (unlikely(avail == 0))
+					break;
+			}
+			copy = avail < left ? avail : left;
+			memcpy(dst, data, copy);
+			dst += copy;
+			data += copy;
+			avail -= copy;
+			left -= copy;
+			consumed += copy;
+		}
+		morefrag = slot->flags & NS_MOREFRAG;
+		*nm_i = nm_next(*nm_i, lim);
+	} while (morefrag);
+	skb_abort_seq_read(&st);
+
+	return error;
+}
+#endif /* linux */
+
 /*
  * generic_netmap_rxsync() extracts mbufs from the queue filled by
  * generic_netmap_rx_handler() and puts their content in the netmap
  * receive ring.
- * Access must be protected because the rx handler is asynchronous,
+ * The rx handler is asynchronous, but the queue is lock-free and
+ * the rxsync owns its consumer side.
  */
 static int
 generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 {
 	struct netmap_ring *ring = kring->ring;
 	struct netmap_adapter *na = kring->na;
+	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
 	u_int nm_i;	/* index into the netmap ring */ //j,
 	u_int n;
 	u_int const lim = kring->nkr_num_slots - 1;
@@ -1021,12 +1185,20 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 	int avail; /* in bytes */
 	int mlen;
 	int copy;
+	int tstamp = kring->nr_kflags & NKR_RXTSTAMP;
+	uint64_t now = 0, realofs = 0, ts = 0;
 
 	if (head > lim)
 		return netmap_ring_reinit(kring);
 
 	IFRATE(rate_ctx.new.rxsync++);
 
+	/* The notification counters are only bumped by
+	 * generic_rx_handler(); they reach the ring here and at the
+	 * end of each mitigation period, not once per packet. */
+	if (kring->ring_id < na->num_rx_rings)
+		generic_mit_publish(&gna->mit[kring->ring_id]);
+
 	/*
 	 * First part: skip past packets that userspace has released.
 	 * This can possibly make room for the second part.
@@ -1061,16 +1233,21 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 		avail += lim + 1;
 	avail *= nm_buf_len;
 
-	/* First pass: While holding the lock on the RX mbuf queue,
-	 * extract as many mbufs as they fit the available space,
-	 * and put them in a temporary queue.
+	/* First pass: extract from the RX mbuf queue as many mbufs as
+	 * they fit the available space, and put them in a temporary queue.
 	 * To avoid performing a per-mbuf division (mlen / nm_buf_len) to
 	 * to update avail, we do the update in a while loop that we
 	 * also use to set the RX slots, but without performing the copy. */
 	mbq_init(&tmpq);
-	mbq_lock(&kring->rx_queue);
+	if (tstamp) {
+		/* the mbuf timestamps, if any, come from the realtime clock */
+		now = nm_get_tstamp(kring->nkr_tsclock);
+		if (kring->nkr_tsclock == NR_TSTAMP_CLOCK(NR_TSTAMP_MONOTONIC))
+			realofs = nm_get_tstamp(NR_TSTAMP_CLOCK(
+					NR_TSTAMP_REALTIME)) - now;
+	}
 	for (n = 0;; n++) {
-		m = mbq_peek(&kring->rx_queue);
+		m = mbq_ring_peek(&kring->gen_rxq);
 		if (!m) {
 			/* No more packets from the driver. */
 			break;
@@ -1082,7 +1259,16 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 			break;
 		}
 
-		mbq_dequeue(&kring->rx_queue);
+		mbq_ring_consume(&kring->gen_rxq);
+
+		if (tstamp) {
+			ts = MBUF_TSTAMP(m);
+			if (ts == 0 || kring->nkr_tsclock ==
+					NR_TSTAMP_CLOCK(NR_TSTAMP_RAW))
+				ts = now;
+			else
+				ts -= realofs;
+		}
 
 		while (mlen) {
 			copy = nm_buf_len;
@@ -1094,15 +1280,16 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 
 			ring->slot[nm_i].len = copy;
 			ring->slot[nm_i].flags = (mlen ? NS_MOREFRAG : 0);
+			if (tstamp)
+				ring->slot[nm_i].ptr = ts;
 			nm_i = nm_next(nm_i, lim);
 		}
 
 		mbq_enqueue(&tmpq, m);
 	}
-	mbq_unlock(&kring->rx_queue);
 
 	/* Second pass: Drain the temporary queue, going over the used RX slots,
-	 * and perform the copy out of the RX queue lock. */
+	 * and perform the copy. */
 	nm_i = kring->nr_hwtail;
 
 	for (;;) {
@@ -1115,6 +1302,19 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 			break;
 		}
 
+#ifdef linux
+		if (skb_is_nonlinear(m)) {
+			if (generic_rx_copy_frags(na, ring, &nm_i, m)) {
+				m_freem(m);
+				mbq_purge(&tmpq);
+				mbq_fini(&tmpq);
+				return netmap_ring_reinit(kring);
+			}
+			m_freem(m);
+			continue;
+		}
+#endif /* linux */
+
 		do {
 			nmaddr = NMB(na, &ring->slot[nm_i]);
 			/* We only check the address here on generic rx rings. */
@@ -1140,6 +1340,8 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 	if (n) {
 		kring->nr_hwtail = nm_i;
 		IFRATE(rate_ctx.new.rxpkt += n);
+		if (tstamp)
+			kring->nr_kflags |= NKR_TSTAMPED;
 	}
 	kring->nr_kflags &= ~NKR_PENDINTR;
 
@@ -96,6 +96,12 @@
 #define NM_SELRECORD_T	struct thread
 #define	MBUF_LEN(m)	((m)->m_pkthdr.len)
 #define MBUF_TXQ(m)	((m)->m_pkthdr.flowid)
+#define MBUF_HASH(m)	((m)->m_pkthdr.flowid)
+#ifdef M_TSTMP
+#define MBUF_TSTAMP(m)	((m)->m_flags & M_TSTMP ? (m)->m_pkthdr.rcv_tstmp : 0)
+#else
+#define MBUF_TSTAMP(m)	0
+#endif
 #define MBUF_TRANSMIT(na, ifp, m)	((na)->if_transmit(ifp, m))
 #define	GEN_TX_MBUF_IFP(m)	((m)->m_pkthdr.rcvif)
 
@@ -104,6 +110,7 @@
 #include <machine/atomic.h>
 #define NM_ATOMIC_TEST_AND_SET(p)       (!atomic_cmpset_acq_int((p), 0, 1))
 #define NM_ATOMIC_CLEAR(p)              atomic_store_rel_int((p), 0)
+#define NM_ATOMIC_CMPSET32(p, o, n)	atomic_cmpset_32((p), (o), (n))
 
 #if __FreeBSD_version >= 1100030
 #define	WNA(_ifp)	(_ifp)->if_netmap
@@ -316,6 +323,44 @@ void nm_os_free(void *);
 void *nm_os_send_up(struct ifnet *, struct mbuf *m, struct mbuf *prev);
 
 int nm_os_mbuf_has_offld(struct mbuf *m);
+/*
+ * Resolve in software the offloadings requested for m (segmentation,
+ * checksums). Returns a chain of packets linked through m_nextpkt, or
+ * NULL if the OS cannot do it. In both cases m is consumed.
+ */
+struct mbuf *nm_os_mbuf_segment(struct mbuf *m);
+
+/* nanoseconds from a monotonic clock */
+uint64_t nm_os_get_ns(void);
+/* nanoseconds from the realtime clock, and the cycle counter */
+uint64_t nm_os_get_realtime_ns(void);
+uint64_t nm_os_get_cycles(void);
+
+/* time from the clock selected by NR_TSTAMP_CLOCK(), see NR_RX_TSTAMP.
+ * The monotonic clock is the one of nm_os_get_ns(), which also stamps
+ * the frames of the monitors (NR_MONITOR_TSTAMP) */
+static inline uint64_t
+nm_get_tstamp(u_int clock)
+{
+	switch (clock) {
+	case NR_TSTAMP_CLOCK(NR_TSTAMP_REALTIME):
+		return nm_os_get_realtime_ns();
+	case NR_TSTAMP_CLOCK(NR_TSTAMP_RAW):
+		return nm_os_get_cycles();
+	default:
+		return nm_os_get_ns();
+	}
+}
+
+#ifndef netmap_trace_sync
+/* tracepoints (ev is enter or exit) are only available on linux */
+#define netmap_trace_sync(ev, kring, error)	do {} while (0)
+#endif /* !netmap_trace_sync */
+
+/* the netmap_priv_d of another netmap file descriptor of the current
+ * process, or NULL. The file is held until nm_os_priv_put(cookie). */
+struct netmap_priv_d *nm_os_priv_get(int fd, void **cookie);
+void nm_os_priv_put(void *cookie);
 
 #include "netmap_mbq.h"
 
@@ -344,6 +389,22 @@ struct netmap_zmon_list {
 };
 #endif /* WITH_MONITOR */
 
+/*
+ * Counters of the syncs done on a kring on behalf of the system calls
+ * (see netmap_kring_sync()), returned by NIOCRINGSTATS. They are only
+ * updated while netmap_sync_stats is set. The syncs of a kring are
+ * serialized by nm_kr_tryget(), so no atomics are needed; the poll
+ * counters may lose an update if several threads poll the same ring.
+ */
+struct nm_kring_stats {
+	uint64_t	syncs;		/* nm_sync() calls */
+	uint64_t	slots;		/* slots sent (tx) or received (rx) */
+	uint64_t	sync_ns;	/* time spent in nm_sync() */
+	uint64_t	errors;		/* failed syncs and ring reinits */
+	uint64_t	poll_wait;	/* netmap_poll() left the caller waiting */
+	uint64_t	poll_ready;	/* netmap_poll() found the ring ready */
+};
+
 /*
  * private, kernel view of a ring. Keeps track of the status of
  * a ring across system calls.
@@ -393,9 +454,9 @@ struct netmap_zmon_list {
  * by nm_kr_(try)lock() which in turn uses nr_busy. This is all we need
  * for NIC rings, and for TX rings attached to the host stack.
  *
- * RX rings attached to the host stack use an mbq (rx_queue) on both
- * rxsync_from_host() and netmap_transmit(). The mbq is protected
- * by its internal lock.
+ * RX rings attached to the host stack use a lock-free mbq_ring
+ * (rx_queue) between netmap_transmit(), the producers, and
+ * rxsync_from_host(), the consumer, serialized as above.
  *
  * RX rings attached to the VALE switch are accessed by both senders
  * and receiver. They are protected through the q_lock on the RX ring.
@@ -426,6 +487,18 @@ struct netmap_kring {
 					 *  by ptnetmap host ports)
 					 */
 #define NKR_NOINTR      0x10            /* don't use interrupts on this ring */
+#define NKR_BUSYPOLL	0x20		/* all the users of this ring busy-poll
+					 * (NR_BUSY_POLL), no need to notify
+					 */
+#define NKR_SHMSYNC	0x40		/* (pipes) indices are exchanged through
+					 * the netmap_pipe_csb (NR_SHM_SYNC)
+					 */
+#define NKR_RXTSTAMP	0x80		/* stamp the new rx slots with
+					 * the nkr_tsclock (NR_RX_TSTAMP)
+					 */
+#define NKR_TSTAMPED	0x100		/* the last rxsync has stamped the
+					 * new slots itself
+					 */
 
 	uint32_t	nr_mode;
 	uint32_t	nr_pending_mode;
@@ -472,15 +545,25 @@ struct netmap_kring {
 	/* Support for adapters without native netmap support.
 	 * On tx rings we preallocate an array of tx buffers
 	 * (same size as the netmap ring), on rx rings we
-	 * store incoming mbufs in a queue that is drained by
-	 * a rxsync.
+	 * store incoming mbufs in a lock-free queue that is
+	 * drained by a rxsync.
 	 */
 	struct mbuf	**tx_pool;
 	struct mbuf	*tx_event;	/* TX event used as a notification */
 	NM_LOCK_T	tx_event_lock;	/* protects the tx_event mbuf */
-	struct mbq	rx_queue;       /* intercepted rx mbufs. */
+	struct mbq_ring	gen_rxq;	/* intercepted rx mbufs. */
+	struct mbq_ring	rx_queue;       /* mbufs for the host rx ring. */
 
 	uint32_t	users;		/* existing bindings for this ring */
+	uint32_t	bpoll_users;	/* users that asked for NR_BUSY_POLL */
+	uint32_t	tstamp_users;	/* users that asked for NR_RX_TSTAMP */
+	uint32_t	nkr_tsclock;	/* their NR_TSTAMP_CLOCK() */
+
+	struct nm_kring_stats stats;
+
+	/* set by netmap_notify(), cleared when netmap_poll() syncs
+	 * the ring, see nm_poll_needed() */
+	volatile uint32_t nkr_notified;
 
 	uint32_t	ring_id;	/* kring identifier */
 	enum txrx	tx;		/* kind of ring (tx or rx) */
@@ -504,6 +587,17 @@ struct netmap_kring {
 	struct netmap_kring *pipe;	/* if this is a pipe ring,
 					 * pointer to the other end
 					 */
+	/* (broadcast pipes, consumer rx rings) the tx slot aliased
+	 * by each rx slot, followed by the original rx buffers and by
+	 * the buffers delivered in each rx slot
+	 */
+	uint32_t	*pipe_bcast_map;
+	uint32_t	pipe_bcast_drops; /* slots not delivered (drop policy),
+					   * see NIOCRINGSTATS */
+	/* (fan-in pipes, slave rx ring) for each slot where a lease
+	 * starts, 1 + the end of the lease once its producer is done
+	 */
+	uint32_t	*pipe_fanin_done;
 #endif /* WITH_PIPES */
 
 #ifdef WITH_VALE
@@ -517,9 +611,16 @@ struct netmap_kring {
 	uint32_t n_monitors;	/* next unused entry in the monitor array */
 	uint32_t mon_pos[NR_TXRX]; /* index of this ring in the monitored ring array */
 	uint32_t mon_tail;  /* last seen slot on rx */
+	uint32_t mon_sample; /* (copy monitor rings) sampling counter,
+			      * or random state with NR_MONITOR_RANDOM */
+	struct nm_mon_filter *mon_filter; /* (copy monitor rings) the
+			      * filter, protected by q_lock */
 
 	/* circular list of zero-copy monitors */
 	struct netmap_zmon_list zmon_list[NR_TXRX];
+	uint32_t mon_producers; /* (zero-copy monitor rings) number of
+			      * lists this ring is linked into, i.e.,
+			      * of rings that may feed it */
 
 	/*
 	 * Monitors work by intercepting the sync and notify callbacks of the
@@ -683,13 +784,15 @@ struct netmap_adapter {
 
 	u_int num_rx_rings; /* number of adapter receive rings */
 	u_int num_tx_rings; /* number of adapter transmit rings */
+	u_int num_host_rx_rings; /* number of host receive rings */
+	u_int num_host_tx_rings; /* number of host transmit rings */
 
 	u_int num_tx_desc;  /* number of descriptor in each queue */
 	u_int num_rx_desc;
 
 	/* tx_rings and rx_rings are private but allocated
 	 * as a contiguous chunk of memory. Each array has
-	 * N+1 entries, for the adapter queues and for the host queue.
+	 * N+H entries, for the adapter queues and for the host queues.
 	 */
 	struct netmap_kring *tx_rings; /* array of TX rings. */
 	struct netmap_kring *rx_rings; /* array of RX rings. */
@@ -858,6 +961,29 @@ nma_set_nrings(struct netmap_adapter *na, enum txrx t, u_int v)
 		na->num_rx_rings = v;
 }
 
+static __inline u_int
+nma_get_host_nrings(struct netmap_adapter *na, enum txrx t)
+{
+	return (t == NR_TX ? na->num_host_tx_rings : na->num_host_rx_rings);
+}
+
+static __inline void
+nma_set_host_nrings(struct netmap_adapter *na, enum txrx t, u_int v)
+{
+	if (t == NR_TX)
+		na->num_host_tx_rings = v;
+	else
+		na->num_host_rx_rings = v;
+}
+
+/* all the krings of na in direction t, including the (possibly fake)
+ * host ones, which follow the hardware ones */
+static __inline u_int
+netmap_all_rings(struct netmap_adapter *na, enum txrx t)
+{
+	return nma_get_nrings(na, t) + nma_get_host_nrings(na, t);
+}
+
 static __inline struct netmap_kring*
 NMR(struct netmap_adapter *na, enum txrx t)
 {
@@ -917,6 +1043,10 @@ struct nm_generic_mit {
 	int mit_pending;
 	int mit_ring_idx;  /* index of the ring being mitigated */
 	struct netmap_adapter *mit_na;  /* backpointer */
+	u_int mit_interval; /* current period, in nanoseconds */
+	u_int mit_held;	/* packets held back in this period */
+	uint64_t mit_delivered;	/* notifications passed up */
+	uint64_t mit_suppressed; /* notifications filtered */
 };
 
 struct netmap_generic_adapter {	/* emulated device */
@@ -948,7 +1078,8 @@ struct netmap_generic_adapter {	/* emulated device */
 static __inline int
 netmap_real_rings(struct netmap_adapter *na, enum txrx t)
 {
-	return nma_get_nrings(na, t) + !!(na->na_flags & NAF_HOST_RINGS);
+	return nma_get_nrings(na, t) + ((na->na_flags & NAF_HOST_RINGS) ?
+		nma_get_host_nrings(na, t) : 0);
 }
 
 #ifdef WITH_VALE
@@ -1032,6 +1163,13 @@ struct netmap_pipe_adapter {
 	struct netmap_adapter *parent; /* adapter that owns the memory */
 	struct netmap_pipe_adapter *peer; /* the other end of the pipe */
 	int peer_ref;		/* 1 iff we are holding a ref to the peer */
+	int fanin;		/* NR_PIPE_FANIN: all the master tx rings
+				 * feed the single slave rx ring */
+	int bcast;		/* NR_PIPE_BCAST: the master tx ring
+				 * feeds all the slave rx rings */
+	int bcast_drop;		/* drop (not throttle) on lagging consumers */
+	u_int bcast_lag;	/* max slots held by a consumer (drop) */
+	uint32_t *bcast_refs;	/* (master) consumers holding each tx slot */
 	struct ifnet *parent_ifp;	/* maybe null */
 
 	u_int parent_slot; /* index in the parent pipe array */
@@ -1254,11 +1392,17 @@ nm_iszombie(struct netmap_adapter *na)
 static inline void
 nm_update_hostrings_mode(struct netmap_adapter *na)
 {
+	enum txrx t;
+	u_int i;
+
 	/* Process nr_mode and nr_pending_mode for host rings. */
-	na->tx_rings[na->num_tx_rings].nr_mode =
-		na->tx_rings[na->num_tx_rings].nr_pending_mode;
-	na->rx_rings[na->num_rx_rings].nr_mode =
-		na->rx_rings[na->num_rx_rings].nr_pending_mode;
+	for_rx_tx(t) {
+		for (i = nma_get_nrings(na, t); i < netmap_all_rings(na, t); i++) {
+			struct netmap_kring *kring = &NMR(na, t)[i];
+
+			kring->nr_mode = kring->nr_pending_mode;
+		}
+	}
 }
 
 /* set/clear native flags and if_transmit/netdev_ops */
@@ -1267,6 +1411,9 @@ nm_set_native_flags(struct netmap_adapter *na)
 {
 	struct ifnet *ifp = na->ifp;
 
+	/* The host rings may be bound by any user, one at a time. */
+	nm_update_hostrings_mode(na);
+
 	/* We do the setup for intercepting packets only if we are the
 	 * first user of this adapapter. */
 	if (na->active_fds > 0) {
@@ -1288,7 +1435,6 @@ nm_set_native_flags(struct netmap_adapter *na)
 	((struct netmap_hw_adapter *)na)->save_ethtool = ifp->ethtool_ops;
 	ifp->ethtool_ops = &((struct netmap_hw_adapter*)na)->nm_eto;
 #endif
-	nm_update_hostrings_mode(na);
 }
 
 static inline void
@@ -1296,14 +1442,14 @@ nm_clear_native_flags(struct netmap_adapter *na)
 {
 	struct ifnet *ifp = na->ifp;
 
+	nm_update_hostrings_mode(na);
+
 	/* We undo the setup for intercepting packets only if we are the
 	 * last user of this adapapter. */
 	if (na->active_fds > 0) {
 		return;
 	}
 
-	nm_update_hostrings_mode(na);
-
 #if defined(__FreeBSD__)
 	ifp->if_transmit = na->if_transmit;
 #elif defined(_WIN32)
@@ -1485,6 +1631,7 @@ int netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 int netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 		struct netmap_mem_d *nmd, int create);
 void netmap_monitor_stop(struct netmap_adapter *na);
+int netmap_monitor_config(struct netmap_priv_d *priv, struct nm_ifreq *ifr);
 #else
 #define netmap_get_monitor_na(nmr, _2, _3, _4) \
 	((nmr)->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX) ? EOPNOTSUPP : 0)
@@ -1567,10 +1714,21 @@ enum {                                  /* verbose flags */
 extern int netmap_txsync_retry;
 extern int netmap_flags;
 extern int netmap_generic_mit;
+extern int netmap_generic_mit_adaptive;
+extern int netmap_generic_mit_lo;
+extern int netmap_generic_mit_hi;
+extern int netmap_generic_mit_batch;
 extern int netmap_generic_ringsize;
 extern int netmap_generic_rings;
 extern int netmap_generic_txqdisc;
+extern int netmap_generic_txbatch;
+extern int netmap_generic_rxqlen;
+extern int netmap_host_rings;
+extern int netmap_sync_stats;
 extern int ptnetmap_tx_workers;
+extern int ptnetmap_adaptive;
+extern int ptnetmap_tx_batch;
+extern int netmap_kpoll_max;
 
 /*
  * NA returns a pointer to the struct netmap adapter from the ifp,
@@ -1856,6 +2014,8 @@ struct netmap_priv_d {
 	 */
 	NM_SELINFO_T *np_si[NR_TXRX];
 	struct thread	*np_td;		/* kqueue, just debugging */
+
+	struct nm_kctx	*np_kpoll;	/* polling thread (NR_KPOLL) */
 };
 
 struct netmap_priv_d *netmap_priv_new(void);
@@ -1881,6 +2041,8 @@ static inline int nm_kring_pending(struct netmap_priv_d *np)
 #ifdef WITH_PIPES
 int netmap_pipe_txsync(struct netmap_kring *txkring, int flags);
 int netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags);
+void netmap_pipe_shm_import(struct netmap_kring *kring);
+int netmap_pipe_pick_ring(struct netmap_priv_d *priv);
 #endif /* WITH_PIPES */
 
 #ifdef WITH_MONITOR
@@ -1890,6 +2052,9 @@ struct netmap_monitor_adapter {
 
 	struct netmap_priv_d priv;
 	uint32_t flags;
+	u_int snaplen;		/* copy at most this many bytes, 0 for all */
+	u_int sample_rate;	/* copy one frame every sample_rate, 0 for all */
+	struct nm_mon_filter *filter; /* installed with NIOCCONFIG */
 };
 
 #endif /* WITH_MONITOR */
@@ -1926,6 +2091,7 @@ struct nm_os_gen_arg {
 	u_int len;	/* packet length */
 	u_int ring_nr;	/* packet length */
 	u_int qevent;   /* in txqdisc mode, place an event on this mbuf */
+	u_int more;	/* more packets follow in the same txsync */
 };
 
 int nm_os_generic_xmit_frame(struct nm_os_gen_arg *);
@@ -1962,6 +2128,8 @@ void nm_os_mitigation_start(struct nm_generic_mit *mit);
 void nm_os_mitigation_restart(struct nm_generic_mit *mit);
 int nm_os_mitigation_active(struct nm_generic_mit *mit);
 void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
+/* called by the OS timer handler at the end of each period */
+void netmap_generic_mit_update(struct nm_generic_mit *mit);
 #else /* !WITH_GENERIC */
 #define generic_netmap_attach(ifp)	(EOPNOTSUPP)
 #define na_is_generic(na)		(0)
@@ -2101,6 +2269,9 @@ void nm_os_kctx_worker_wakeup(struct nm_kctx *nmk);
 void nm_os_kctx_send_irq(struct nm_kctx *);
 void nm_os_kctx_worker_setaff(struct nm_kctx *, int);
 u_int nm_os_ncpus(void);
+int nm_os_cpu_online(u_int cpu);
+/* 0 if the caller may start an NR_KPOLL thread, an errno otherwise */
+int nm_os_kpoll_allowed(void);
 
 #ifdef WITH_PTNETMAP_HOST
 /*
@@ -29,7 +29,11 @@
  */
 
 
-#ifdef linux
+#if defined(NETMAP_MBQ_USERSPACE)
+/* built by utils/mbq-bench.c, which provides the environment */
+#include "netmap_mbq.h"
+#else /* !NETMAP_MBQ_USERSPACE */
+#if defined(linux)
 #include "bsd_glue.h"
 #elif defined (_WIN32)
 #include "win_glue.h"
@@ -39,9 +43,17 @@
 #include <sys/mutex.h>
 #include <sys/systm.h>
 #include <sys/mbuf.h>
+#include <sys/selinfo.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>
+#include <machine/atomic.h>
 #endif  /* __FreeBSD__ */
 
-#include "netmap_mbq.h"
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>	/* nm_os_malloc(), NM_ATOMIC_CMPSET32() */
+#endif /* !NETMAP_MBQ_USERSPACE */
 
 
 static inline void __mbq_init(struct mbq *q)
@@ -164,3 +176,131 @@ void mbq_safe_fini(struct mbq *q)
 void mbq_fini(struct mbq *q)
 {
 }
+
+
+/* len is rounded up to a power of two */
+int mbq_ring_init(struct mbq_ring *q, unsigned int len)
+{
+    unsigned int n = 1, i;
+
+    while (n < len)
+        n <<= 1;
+    q->slot = nm_os_malloc(n * sizeof(q->slot[0]));
+    if (q->slot == NULL)
+        return ENOMEM;
+    q->head = q->tail = 0;
+    q->mask = n - 1;
+    /* not ready for the consumer in the first lap */
+    for (i = 0; i < n; i++)
+        q->slot[i].seq = i;
+    return 0;
+}
+
+
+void mbq_ring_fini(struct mbq_ring *q)
+{
+    if (q->slot == NULL)
+        return;
+    mbq_ring_purge(q);
+    nm_os_free(q->slot);
+    q->slot = NULL;
+}
+
+
+/*
+ * Producer side: append up to n mbufs, in order, and return how many
+ * fit in the queue. The caller owns the ones that did not.
+ */
+unsigned int mbq_ring_enqueue_batch(struct mbq_ring *q, struct mbuf **m,
+        unsigned int n)
+{
+    uint32_t t, i;
+    int32_t space;
+
+    for (;;) {
+        t = *(volatile uint32_t *)&q->tail;
+        space = (int32_t)(q->mask + 1 -
+                (t - *(volatile uint32_t *)&q->head));
+        if (space <= 0)
+            return 0;
+        if ((uint32_t)space < n)
+            n = space;
+        if (NM_ATOMIC_CMPSET32(&q->tail, t, t + n))
+            break;
+    }
+    for (i = 0; i < n; i++)
+        q->slot[(t + i) & q->mask].m = m[i];
+    wmb(); /* store the mbufs before publishing them */
+    for (i = 0; i < n; i++)
+        q->slot[(t + i) & q->mask].seq = t + i + 1;
+    return n;
+}
+
+
+/* producer side, returns ENOBUFS if the queue is full */
+int mbq_ring_enqueue(struct mbq_ring *q, struct mbuf *m)
+{
+    return mbq_ring_enqueue_batch(q, &m, 1) ? 0 : ENOBUFS;
+}
+
+
+/* consumer side, the mbuf at the head or NULL */
+struct mbuf *mbq_ring_peek(struct mbq_ring *q)
+{
+    struct mbq_ring_slot *s = &q->slot[q->head & q->mask];
+
+    if (*(volatile uint32_t *)&s->seq != q->head + 1)
+        return NULL;
+    rmb(); /* read the mbuf after the sequence number */
+    return s->m;
+}
+
+
+/* consumer side, release the slot returned by mbq_ring_peek() */
+void mbq_ring_consume(struct mbq_ring *q)
+{
+    q->slot[q->head & q->mask].m = NULL;
+    mb(); /* done with the slot before returning it to the producers */
+    q->head++;
+}
+
+
+/*
+ * Consumer side: remove up to n mbufs from the head, stopping at the
+ * first slot that has not been published yet, and return how many.
+ */
+unsigned int mbq_ring_dequeue_batch(struct mbq_ring *q, struct mbuf **m,
+        unsigned int n)
+{
+    uint32_t h = q->head, i;
+
+    for (i = 0; i < n; i++) {
+        if (*(volatile uint32_t *)&q->slot[(h + i) & q->mask].seq !=
+                h + i + 1)
+            break;
+    }
+    if (i == 0)
+        return 0;
+    n = i;
+    rmb(); /* read the mbufs after the sequence numbers */
+    for (i = 0; i < n; i++) {
+        struct mbq_ring_slot *s = &q->slot[(h + i) & q->mask];
+
+        m[i] = s->m;
+        s->m = NULL;
+    }
+    mb(); /* done with the slots before returning them to the producers */
+    q->head = h + n;
+    return n;
+}
+
+
+void mbq_ring_purge(struct mbq_ring *q)
+{
+    struct mbuf *m;
+
+    while ((m = mbq_ring_peek(q)) != NULL) {
+        mbq_ring_consume(q);
+        m_freem(m);
+    }
+}
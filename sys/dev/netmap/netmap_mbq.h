@@ -94,4 +94,41 @@ static inline unsigned int mbq_len(struct mbq *q)
     return q->count;
 }
 
+/*
+ * A bounded FIFO of mbufs without locks (mbq_ring_*), for any number
+ * of producers and a single consumer, which must be serialized by the
+ * caller. Producers reserve one or more slots with a compare-and-swap
+ * on the tail, and publish each of them by setting its sequence number
+ * to the index of the slot plus one. The consumer advances the head
+ * once it is done with the slots, which makes them available again.
+ */
+struct mbq_ring_slot {
+    uint32_t seq;
+    struct mbuf *m;
+};
+
+struct mbq_ring {
+    uint32_t head;      /* next slot to consume */
+    uint32_t mask;
+    uint32_t tail;      /* next slot to fill */
+    struct mbq_ring_slot *slot;
+};
+
+int mbq_ring_init(struct mbq_ring *q, unsigned int len);
+void mbq_ring_fini(struct mbq_ring *q);
+int mbq_ring_enqueue(struct mbq_ring *q, struct mbuf *m);
+unsigned int mbq_ring_enqueue_batch(struct mbq_ring *q, struct mbuf **m,
+        unsigned int n);
+struct mbuf *mbq_ring_peek(struct mbq_ring *q);
+void mbq_ring_consume(struct mbq_ring *q);
+unsigned int mbq_ring_dequeue_batch(struct mbq_ring *q, struct mbuf **m,
+        unsigned int n);
+void mbq_ring_purge(struct mbq_ring *q);
+
+/* approximate if there are concurrent producers */
+static inline unsigned int mbq_ring_len(struct mbq_ring *q)
+{
+    return *(volatile uint32_t *)&q->tail - *(volatile uint32_t *)&q->head;
+}
+
 #endif /* _NET_NETMAP_MBQ_H_ */
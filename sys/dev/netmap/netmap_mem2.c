@@ -1743,7 +1743,7 @@ netmap_free_rings(struct netmap_adapter *na)
 
 	for_rx_tx(t) {
 		u_int i;
-		for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+		for (i = 0; i < netmap_all_rings(na, t); i++) {
 			struct netmap_kring *kring = &NMR(na, t)[i];
 			struct netmap_ring *ring = kring->ring;
 
@@ -1755,7 +1755,7 @@ netmap_free_rings(struct netmap_adapter *na)
 			}
 			if (netmap_verbose)
 				D("deleting ring %s", kring->name);
-			if (i != nma_get_nrings(na, t) || na->na_flags & NAF_HOST_RINGS)
+			if (i < nma_get_nrings(na, t) || na->na_flags & NAF_HOST_RINGS)
 				netmap_free_bufs(na->nm_mem, ring->slot, kring->nkr_num_slots);
 			netmap_ring_free(na->nm_mem, ring);
 			kring->ring = NULL;
@@ -1780,7 +1780,7 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 	for_rx_tx(t) {
 		u_int i;
 
-		for (i = 0; i <= nma_get_nrings(na, t); i++) {
+		for (i = 0; i < netmap_all_rings(na, t); i++) {
 			struct netmap_kring *kring = &NMR(na, t)[i];
 			struct netmap_ring *ring = kring->ring;
 			u_int len, ndesc;
@@ -1819,7 +1819,7 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 			ND("%s h %d c %d t %d", kring->name,
 				ring->head, ring->cur, ring->tail);
 			ND("initializing slots for %s_ring", nm_txrx2str(txrx));
-			if (i != nma_get_nrings(na, t) || (na->na_flags & NAF_HOST_RINGS)) {
+			if (i < nma_get_nrings(na, t) || (na->na_flags & NAF_HOST_RINGS)) {
 				/* this is a real ring */
 				if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc)) {
 					D("Cannot allocate buffers for %s_ring", nm_txrx2str(t));
@@ -1878,7 +1878,7 @@ netmap_mem2_if_new(struct netmap_adapter *na, struct netmap_priv_d *priv)
 	ntot = 0;
 	for_rx_tx(t) {
 		/* account for the (eventually fake) host rings */
-		n[t] = nma_get_nrings(na, t) + 1;
+		n[t] = netmap_all_rings(na, t);
 		ntot += n[t];
 	}
 	/*
@@ -1898,6 +1898,8 @@ netmap_mem2_if_new(struct netmap_adapter *na, struct netmap_priv_d *priv)
 	/* initialize base fields -- override const */
 	*(u_int *)(uintptr_t)&nifp->ni_tx_rings = na->num_tx_rings;
 	*(u_int *)(uintptr_t)&nifp->ni_rx_rings = na->num_rx_rings;
+	*(u_int *)(uintptr_t)&nifp->ni_host_tx_rings = na->num_host_tx_rings;
+	*(u_int *)(uintptr_t)&nifp->ni_host_rx_rings = na->num_host_rx_rings;
 	strncpy(nifp->ni_name, na->name, (size_t)IFNAMSIZ);
 
 	/*
@@ -2336,20 +2338,20 @@ netmap_mem_pt_guest_rings_create(struct netmap_adapter *na)
 
 	/* point each kring to the corresponding backend ring */
 	nifp = (struct netmap_if *)((char *)ptnmd->nm_addr + ptif->nifp_offset);
-	for (i = 0; i <= na->num_tx_rings; i++) {
+	for (i = 0; i < netmap_all_rings(na, NR_TX); i++) {
 		struct netmap_kring *kring = na->tx_rings + i;
 		if (kring->ring)
 			continue;
 		kring->ring = (struct netmap_ring *)
 			((char *)nifp + nifp->ring_ofs[i]);
 	}
-	for (i = 0; i <= na->num_rx_rings; i++) {
+	for (i = 0; i < netmap_all_rings(na, NR_RX); i++) {
 		struct netmap_kring *kring = na->rx_rings + i;
 		if (kring->ring)
 			continue;
 		kring->ring = (struct netmap_ring *)
 			((char *)nifp +
-			 nifp->ring_ofs[i + na->num_tx_rings + 1]);
+			 nifp->ring_ofs[i + netmap_all_rings(na, NR_TX)]);
 	}
 
 	error = 0;
@@ -2367,7 +2369,7 @@ netmap_mem_pt_guest_rings_delete(struct netmap_adapter *na)
 
 	for_rx_tx(t) {
 		u_int i;
-		for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+		for (i = 0; i < netmap_all_rings(na, t); i++) {
 			struct netmap_kring *kring = &NMR(na, t)[i];
 
 			kring->ring = NULL;
@@ -68,6 +68,18 @@
  *
  * Several copy or zero-copy monitors may be active on any ring.
  *
+ * Copy monitors may also be asked to copy only the first bytes of each
+ * frame (snap length) and only a sample of the frames, either one every
+ * N or each one with probability 1/N (see NETMAP_MON_PARAMS()). Frames
+ * that are not sampled cost neither a copy nor a monitor slot.
+ *
+ * Finally, a filter can be installed on copy monitors (see struct
+ * netmap_mon_filter), which is evaluated before sampling and copying.
+ *
+ * Monitors count the frames they lose in their rings (see struct
+ * netmap_mon_stats) and, with NR_MONITOR_TSTAMP, record the time
+ * each frame was mirrored in the slot ptr field.
+ *
  */
 
 
@@ -127,6 +139,7 @@
  */
 
 static int netmap_zmon_reg(struct netmap_adapter *, int);
+static int netmap_monitor_reg(struct netmap_adapter *, int);
 static int
 nm_is_zmon(struct netmap_adapter *na)
 {
@@ -153,6 +166,7 @@ static int
 netmap_monitor_rxsync(struct netmap_kring *kring, int flags)
 {
         ND("%s %x", kring->name, flags);
+	wmb(); /* the released slots, before nr_hwcur */
 	kring->nr_hwcur = kring->rhead;
 	mb();
         return 0;
@@ -164,11 +178,15 @@ static int
 netmap_monitor_krings_create(struct netmap_adapter *na)
 {
 	int error = netmap_krings_create(na, 0);
+	u_int i;
+
 	if (error)
 		return error;
 	/* override the host rings callbacks */
-	na->tx_rings[na->num_tx_rings].nm_sync = netmap_monitor_txsync;
-	na->rx_rings[na->num_rx_rings].nm_sync = netmap_monitor_rxsync;
+	for (i = na->num_tx_rings; i < netmap_all_rings(na, NR_TX); i++)
+		na->tx_rings[i].nm_sync = netmap_monitor_txsync;
+	for (i = na->num_rx_rings; i < netmap_all_rings(na, NR_RX); i++)
+		na->rx_rings[i].nm_sync = netmap_monitor_rxsync;
 	return 0;
 }
 
@@ -186,6 +204,23 @@ nm_txrx2flag(enum txrx t)
 	return (t == NR_RX ? NR_MONITOR_RX : NR_MONITOR_TX);
 }
 
+/* the kring of the parent pna, in direction t, that is monitored by
+ * the rx kring i of the monitor na, or NULL. The hardware rings map
+ * one to one, and so do the host rings, which follow them
+ */
+static struct netmap_kring *
+nm_monitor_parent_kring(struct netmap_adapter *na,
+		struct netmap_adapter *pna, u_int i, enum txrx t)
+{
+	u_int nhw = nma_get_nrings(na, NR_RX);
+
+	if (i < nhw)
+		return (i < nma_get_nrings(pna, t)) ? &NMR(pna, t)[i] : NULL;
+	i -= nhw;
+	return (i < nma_get_host_nrings(pna, t)) ?
+		&NMR(pna, t)[nma_get_nrings(pna, t) + i] : NULL;
+}
+
 /* allocate the monitors array in the monitored kring */
 static int
 nm_monitor_alloc(struct netmap_kring *kring, u_int n)
@@ -389,7 +424,7 @@ netmap_monitor_stop(struct netmap_adapter *na)
 	for_rx_tx(t) {
 		u_int i;
 
-		for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+		for (i = 0; i < netmap_all_rings(na, t); i++) {
 			struct netmap_kring *kring = &NMR(na, t)[i];
 			struct netmap_kring *zkring;
 			u_int j;
@@ -455,20 +490,36 @@ netmap_monitor_reg_common(struct netmap_adapter *na, int onoff, int zmon)
 			return ENXIO;
 		}
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+			for (i = 0; i < netmap_all_rings(na, t); i++) {
 				mkring = &NMR(na, t)[i];
 				if (!nm_kring_pending_on(mkring))
 					continue;
 				mkring->nr_mode = NKR_NETMAP_ON;
 				if (t == NR_TX)
 					continue;
+				/* any odd value is a good seed for the
+				 * random sampling */
+				mkring->mon_sample = (mna->flags & NR_MONITOR_RANDOM) ?
+					(uint32_t)(uintptr_t)mkring | 1 : 0;
+				if (!zmon)
+					mkring->mon_filter = mna->filter;
+				memset(NETMAP_MON_STATS(mkring->ring), 0,
+					sizeof(struct netmap_mon_stats));
+				/* count the producers before linking, so that
+				 * netmap_zmon_parent_sync() never sees a
+				 * partial count */
+				mkring->mon_producers = 0;
+				for_rx_tx(s) {
+					if ((mna->flags & nm_txrx2flag(s)) &&
+					    nm_monitor_parent_kring(na, pna, i, s))
+						mkring->mon_producers++;
+				}
 				for_rx_tx(s) {
-					if (i > nma_get_nrings(pna, s))
+					if (!(mna->flags & nm_txrx2flag(s)))
 						continue;
-					if (mna->flags & nm_txrx2flag(s)) {
-						kring = &NMR(pna, s)[i];
+					kring = nm_monitor_parent_kring(na, pna, i, s);
+					if (kring != NULL)
 						netmap_monitor_add(mkring, kring, zmon);
-					}
 				}
 			}
 		}
@@ -477,13 +528,14 @@ netmap_monitor_reg_common(struct netmap_adapter *na, int onoff, int zmon)
 		if (na->active_fds == 0)
 			na->na_flags &= ~NAF_NETMAP_ON;
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+			for (i = 0; i < netmap_all_rings(na, t); i++) {
 				mkring = &NMR(na, t)[i];
 				if (!nm_kring_pending_off(mkring))
 					continue;
 				mkring->nr_mode = NKR_NETMAP_OFF;
 				if (t == NR_TX)
 					continue;
+				mkring->mon_filter = NULL;
 				/* we cannot access the parent krings if the parent
 				 * has left netmap mode. This is signaled by a NULL
 				 * pna pointer
@@ -491,12 +543,11 @@ netmap_monitor_reg_common(struct netmap_adapter *na, int onoff, int zmon)
 				if (pna == NULL)
 					continue;
 				for_rx_tx(s) {
-					if (i > nma_get_nrings(pna, s))
+					if (!(mna->flags & nm_txrx2flag(s)))
 						continue;
-					if (mna->flags & nm_txrx2flag(s)) {
-						kring = &NMR(pna, s)[i];
+					kring = nm_monitor_parent_kring(na, pna, i, s);
+					if (kring != NULL)
 						netmap_monitor_del(mkring, kring);
-					}
 				}
 			}
 		}
@@ -513,12 +564,27 @@ netmap_monitor_reg_common(struct netmap_adapter *na, int onoff, int zmon)
 /*
  * Common function for both zero-copy tx and rx nm_sync()
  * callbacks
+ *
+ * Zero-copy monitors form a pipeline: the first one receives the
+ * slots released by the monitored port, and each of the following
+ * ones receives the slots released by the previous monitor. A
+ * monitor ring linked in both the tx and the rx lists has two
+ * producers and needs its q_lock. A ring linked in only one list
+ * (mon_producers == 1) has a single producer, and the handoff is a
+ * single producer/single consumer queue that only relies on memory
+ * barriers. The count is fixed when the monitor registers; a stage
+ * that unregisters is unlinked from the pipeline (see
+ * netmap_monitor_del()), so that the previous stage feeds the next
+ * one directly, without changing the count of the next one.
  */
 static int
 netmap_zmon_parent_sync(struct netmap_kring *kring, int flags, enum txrx tx)
 {
 	struct netmap_kring *mkring = kring->zmon_list[tx].next;
 	struct netmap_ring *ring = kring->ring, *mring;
+	struct netmap_monitor_adapter *mna;
+	uint64_t ts = 0;
+	int spsc;
 	int error = 0;
 	int rel_slots, free_slots, busy, sent = 0;
 	u_int beg, end, i;
@@ -531,6 +597,8 @@ netmap_zmon_parent_sync(struct netmap_kring *kring, int flags, enum txrx tx)
 	}
 	mring = mkring->ring;
 	mlim = mkring->nkr_num_slots - 1;
+	mna = (struct netmap_monitor_adapter *)mkring->na;
+	spsc = (mkring->mon_producers == 1);
 
 	/* get the relased slots (rel_slots) */
 	if (tx == NR_TX) {
@@ -555,26 +623,29 @@ netmap_zmon_parent_sync(struct netmap_kring *kring, int flags, enum txrx tx)
 		goto out_rxsync;
 	}
 
-	/* we need to lock the monitor receive ring, since it
-	 * is the target of bot tx and rx traffic from the monitored
-	 * adapter
+	/* we need to lock the monitor receive ring if it is the
+	 * target of both tx and rx traffic
 	 */
-	mtx_lock(&mkring->q_lock);
+	if (!spsc)
+		mtx_lock(&mkring->q_lock);
 	/* get the free slots available on the monitor ring */
 	i = mkring->nr_hwtail;
 	busy = i - mkring->nr_hwcur;
+	rmb(); /* nr_hwcur, before the slots released by the consumer */
 	if (busy < 0)
 		busy += mkring->nkr_num_slots;
 	free_slots = mlim - busy;
 
-	if (!free_slots)
-		goto out;
-
-	/* swap min(free_slots, rel_slots) slots */
+	/* swap min(free_slots, rel_slots) slots, the oldest are lost */
 	if (free_slots < rel_slots) {
+		NETMAP_MON_STATS(mring)->drops += rel_slots - free_slots;
 		beg += (rel_slots - free_slots);
 		rel_slots = free_slots;
 	}
+	if (!rel_slots)
+		goto out;
+	if (mna->flags & NR_MONITOR_TSTAMP)
+		ts = nm_os_get_ns() << 16;
 	if (unlikely(beg >= kring->nkr_num_slots))
 		beg -= kring->nkr_num_slots;
 
@@ -592,6 +663,7 @@ netmap_zmon_parent_sync(struct netmap_kring *kring, int flags, enum txrx tx)
 		tmp = ms->len;
 		ms->len = s->len;
 		s->len = tmp;
+		ms->ptr = ts | ms->len;
 
 		s->flags |= NS_BUF_CHANGED;
 
@@ -599,13 +671,14 @@ netmap_zmon_parent_sync(struct netmap_kring *kring, int flags, enum txrx tx)
 		i = nm_next(i, mlim);
 
 	}
-	mb();
+	wmb(); /* the new slots, before nr_hwtail */
 	mkring->nr_hwtail = i;
 
 out:
-	mtx_unlock(&mkring->q_lock);
+	if (!spsc)
+		mtx_unlock(&mkring->q_lock);
 
-	if (sent) {
+	if (sent && !(mkring->nr_kflags & NKR_BUSYPOLL)) {
 		/* notify the new frames to the monitor */
 		mkring->nm_notify(mkring, 0);
 	}
@@ -655,19 +728,197 @@ netmap_zmon_dtor(struct netmap_adapter *na)
  ****************************************************************
  */
 
+/*
+ * Monitor filters are compiled into a list of terms where each term
+ * knows where to jump on a mismatch (the first term of the next
+ * alternative, or the end of the list), so that the evaluation is a
+ * single forward scan with no backtracking.
+ */
+struct nm_mon_fterm {
+	uint16_t off;
+	uint8_t size;
+	uint8_t neg;
+	uint8_t last;	/* last term of its alternative */
+	uint8_t fail;	/* next term on a mismatch */
+	uint32_t mask;
+	uint32_t lo;
+	uint32_t hi;
+};
+
+struct nm_mon_filter {
+	u_int n;
+	struct nm_mon_fterm t[NETMAP_MON_FILTER_MAXTERMS];
+};
+
+/* terms must lie within buffers of buf_size bytes */
+static int
+nm_mon_filter_compile(const struct netmap_mon_filter *uf, u_int buf_size,
+		struct nm_mon_filter **fp)
+{
+	struct nm_mon_filter *f;
+	u_int i, j, n = uf->nterms;
+
+	*fp = NULL;
+	if (n == 0)
+		return 0;
+	if (n > NETMAP_MON_FILTER_MAXTERMS)
+		return EINVAL;
+	for (i = 0; i < n; i++) {
+		const struct netmap_mon_term *ut = &uf->term[i];
+
+		if ((ut->size != 1 && ut->size != 2 && ut->size != 4) ||
+		    (u_int)ut->off + ut->size > buf_size ||
+		    (ut->flags & ~(NM_MONF_OR | NM_MONF_NOT)))
+			return EINVAL;
+	}
+	f = nm_os_malloc(sizeof(*f));
+	if (f == NULL)
+		return ENOMEM;
+	f->n = n;
+	for (i = 0; i < n; i = j) {
+		/* [i, j) is an alternative */
+		for (j = i + 1; j < n && !(uf->term[j].flags & NM_MONF_OR); j++)
+			;
+		for (; i < j; i++) {
+			const struct netmap_mon_term *ut = &uf->term[i];
+			struct nm_mon_fterm *t = &f->t[i];
+
+			t->off = ut->off;
+			t->size = ut->size;
+			t->neg = !!(ut->flags & NM_MONF_NOT);
+			t->mask = ut->mask;
+			t->lo = ut->lo;
+			t->hi = ut->hi;
+			t->last = (i == j - 1);
+			t->fail = j;
+		}
+	}
+	*fp = f;
+	return 0;
+}
+
+/* returns 1 iff the frame buf of length len passes the filter f */
+static int
+nm_mon_filter_match(const struct nm_mon_filter *f, const uint8_t *buf, u_int len)
+{
+	u_int i = 0;
+
+	while (i < f->n) {
+		const struct nm_mon_fterm *t = &f->t[i];
+		const uint8_t *p = buf + t->off;
+		uint32_t v;
+		int match;
+
+		if (t->off + t->size > len) {
+			match = 0;
+		} else {
+			switch (t->size) {
+			case 1:
+				v = p[0];
+				break;
+			case 2:
+				v = (p[0] << 8) | p[1];
+				break;
+			default:
+				v = ((uint32_t)p[0] << 24) | (p[1] << 16) |
+					(p[2] << 8) | p[3];
+				break;
+			}
+			v &= t->mask;
+			match = (v >= t->lo && v <= t->hi);
+		}
+		if (match != t->neg) {
+			if (t->last)
+				return 1;
+			i++;
+		} else {
+			i = t->fail;
+		}
+	}
+	return 0;
+}
+
+/* NIOCCONFIG on a copy monitor: install or remove the filter */
+int
+netmap_monitor_config(struct netmap_priv_d *priv, struct nm_ifreq *ifr)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_monitor_adapter *mna =
+		(struct netmap_monitor_adapter *)na;
+	struct nm_mon_filter *f, *old;
+	int error;
+	u_int i;
+
+	if (na == NULL || na->nm_register != netmap_monitor_reg)
+		return EOPNOTSUPP;
+
+	error = nm_mon_filter_compile(
+			(struct netmap_mon_filter *)ifr->data,
+			NETMAP_BUF_SIZE(na), &f);
+	if (error)
+		return error;
+
+	/* the copies are made under the monitor q_lock */
+	for (i = 0; i < netmap_all_rings(na, NR_RX); i++) {
+		struct netmap_kring *mkring = &NMR(na, NR_RX)[i];
+
+		mtx_lock(&mkring->q_lock);
+		mkring->mon_filter = f;
+		mtx_unlock(&mkring->q_lock);
+	}
+	old = mna->filter;
+	mna->filter = f;
+	if (old)
+		nm_os_free(old);
+	ND("%s: filter with %u terms", na->name, f ? f->n : 0);
+	return 0;
+}
+
+/* decide if the next frame must be copied to the sampling monitor mkring */
+static inline int
+nm_monitor_sample(struct netmap_monitor_adapter *mna, struct netmap_kring *mkring)
+{
+	if (mna->flags & NR_MONITOR_RANDOM) {
+		/* xorshift32, then scale to [0, sample_rate) */
+		uint32_t x = mkring->mon_sample;
+
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		mkring->mon_sample = x;
+		return (((uint64_t)x * mna->sample_rate) >> 32) == 0;
+	}
+	if (++mkring->mon_sample < mna->sample_rate)
+		return 0;
+	mkring->mon_sample = 0;
+	return 1;
+}
+
 static void
 netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_slots)
 {
+	uint64_t ts = 0;
 	u_int j;
 
 	for (j = 0; j < kring->n_monitors; j++) {
 		struct netmap_kring *mkring = kring->monitors[j];
+		struct netmap_monitor_adapter *mna =
+			(struct netmap_monitor_adapter *)mkring->na;
 		u_int i, mlim, beg;
-		int free_slots, busy, sent = 0, m;
+		int free_slots, busy, sent = 0, m, drops = 0;
 		u_int lim = kring->nkr_num_slots - 1;
 		struct netmap_ring *ring = kring->ring, *mring = mkring->ring;
 		u_int max_len = NETMAP_BUF_SIZE(mkring->na);
-
+		u_int buf_size = NETMAP_BUF_SIZE(kring->na);
+		int sampling = mna->sample_rate > 1;
+		struct nm_mon_filter *filter;
+
+		if (mna->snaplen && mna->snaplen < max_len)
+			max_len = mna->snaplen;
+		if ((mna->flags & NR_MONITOR_TSTAMP) && ts == 0) {
+			/* one timestamp for the whole batch */
+			ts = nm_os_get_ns() << 16;
+		}
 		mlim = mkring->nkr_num_slots - 1;
 
 		/* we need to lock the monitor receive ring, since it
@@ -682,42 +933,64 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 			busy += mkring->nkr_num_slots;
 		free_slots = mlim - busy;
 
-		if (!free_slots)
-			goto out;
-
-		/* copy min(free_slots, new_slots) slots */
+		/* copy min(free_slots, new_slots) slots. When sampling or
+		 * filtering we do not know in advance how many of the new
+		 * slots will be copied, so we copy them in order until the
+		 * monitor ring is full, and then only count the drops
+		 */
+		filter = mkring->mon_filter;
 		m = new_slots;
 		beg = first_new;
-		if (free_slots < m) {
-			beg += (m - free_slots);
+		if (free_slots < m && !sampling && !filter) {
+			drops = m - free_slots;
+			beg += drops;
 			if (beg >= kring->nkr_num_slots)
 				beg -= kring->nkr_num_slots;
 			m = free_slots;
 		}
 
-		for ( ; m; m--) {
+		for ( ; m; m--, beg = nm_next(beg, lim)) {
 			struct netmap_slot *s = &ring->slot[beg];
 			struct netmap_slot *ms = &mring->slot[i];
 			u_int copy_len = s->len;
-			char *src = NMB(kring->na, s),
-			     *dst = NMB(mkring->na, ms);
+			char *src, *dst;
+
+			src = NMB(kring->na, s);
+			/* s->len comes from userspace on tx rings */
+			if (filter && !nm_mon_filter_match(filter,
+					(uint8_t *)src, min((u_int)s->len, buf_size)))
+				continue;
+			if (sampling && !nm_monitor_sample(mna, mkring))
+				continue;
+			if (unlikely(sent == free_slots)) {
+				drops++;
+				continue;
+			}
 
+			dst = NMB(mkring->na, ms);
 			if (unlikely(copy_len > max_len)) {
-				RD(5, "%s->%s: truncating %d to %d", kring->name,
+				if (!mna->snaplen)
+					RD(5, "%s->%s: truncating %d to %d", kring->name,
 						mkring->name, copy_len, max_len);
 				copy_len = max_len;
 			}
 
 			memcpy(dst, src, copy_len);
 			ms->len = copy_len;
+			/* the original length, and the timestamp if any */
+			ms->ptr = ts | s->len;
 			sent++;
 
-			beg = nm_next(beg, lim);
 			i = nm_next(i, mlim);
 		}
-		mb();
-		mkring->nr_hwtail = i;
-	out:
+		if (drops) {
+			NETMAP_MON_STATS(mring)->drops += drops;
+			ND(5, "%s->%s: dropped %d", kring->name, mkring->name, drops);
+		}
+		if (sent) {
+			mb();
+			mkring->nr_hwtail = i;
+		}
 		mtx_unlock(&mkring->q_lock);
 
 		if (sent) {
@@ -821,6 +1094,10 @@ netmap_monitor_dtor(struct netmap_adapter *na)
 	struct netmap_adapter *pna = priv->np_na;
 
 	netmap_adapter_put(pna);
+	if (mna->filter) {
+		nm_os_free(mna->filter);
+		mna->filter = NULL;
+	}
 }
 
 
@@ -846,6 +1123,11 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 	}
 	/* this is a request for a monitor adapter */
 
+	if (zcopy && (nmr->spare2[0] || (nmr->nr_flags & NR_MONITOR_RANDOM))) {
+		D("snap length and sampling need a copy monitor");
+		return EINVAL;
+	}
+
 	ND("flags %x", nmr->nr_flags);
 
 	/* first, try to find the adapter that we want to monitor
@@ -854,7 +1136,9 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 	 * except other monitors.
 	 */
 	memcpy(&pnmr, nmr, sizeof(pnmr));
-	pnmr.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON);
+	pnmr.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON |
+			NR_MONITOR_RANDOM | NR_MONITOR_TSTAMP);
+	pnmr.spare2[0] = 0;
 	error = netmap_get_na(&pnmr, &pna, &ifp, nmd, create);
 	if (error) {
 		D("parent lookup failed: %d", error);
@@ -909,6 +1193,12 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 	mna->up.num_rx_rings = pna->num_rx_rings;
 	if (pna->num_tx_rings > pna->num_rx_rings)
 		mna->up.num_rx_rings = pna->num_tx_rings;
+	/* and the same for the host rings, which are final since the
+	 * parent is in netmap mode */
+	mna->up.num_host_tx_rings = 1;
+	mna->up.num_host_rx_rings = pna->num_host_rx_rings;
+	if (pna->num_host_tx_rings > pna->num_host_rx_rings)
+		mna->up.num_host_rx_rings = pna->num_host_tx_rings;
 	/* by default, the number of slots is the same as in
 	 * the parent rings, but the user may ask for a different
 	 * number
@@ -934,7 +1224,9 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 		mna->up.nm_mem = netmap_mem_private_new(
 				mna->up.num_tx_rings,
 				mna->up.num_tx_desc,
-				mna->up.num_rx_rings,
+				/* one host ring is already accounted for */
+				mna->up.num_rx_rings +
+				mna->up.num_host_rx_rings - 1,
 				mna->up.num_rx_desc,
 				0, /* extra bufs */
 				0, /* pipes */
@@ -950,7 +1242,11 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 	}
 
 	/* remember the traffic directions we have to monitor */
-	mna->flags = (nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON));
+	mna->flags = (nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX |
+				NR_ZCOPY_MON | NR_MONITOR_RANDOM |
+				NR_MONITOR_TSTAMP));
+	mna->snaplen = NETMAP_MON_SNAPLEN(nmr->spare2[0]);
+	mna->sample_rate = NETMAP_MON_RATE(nmr->spare2[0]);
 
 	*na = &mna->up;
 	netmap_adapter_get(*na);
@@ -75,6 +75,11 @@
 #ifdef WITH_PIPES
 
 #define NM_PIPE_MAXSLOTS	4096
+#define NM_PIPE_SWAP_BATCH	32	/* slots swapped per bulk copy */
+#define NM_PIPE_MAXFANIN	64	/* max producers of a fan-in pipe */
+#define NM_PIPE_DEFFANIN	4	/* default producers of a fan-in pipe */
+#define NM_PIPE_MAXBCAST	64	/* max consumers of a broadcast pipe */
+#define NM_PIPE_DEFBCAST	4	/* default consumers of a broadcast pipe */
 
 static int netmap_default_pipes = 0; /* ignored, kept for compatibility */
 SYSBEGIN(vars_pipes);
@@ -172,6 +177,29 @@ netmap_pipe_remove(struct netmap_adapter *parent, struct netmap_pipe_adapter *na
 	parent->na_pipes[n] = NULL;
 }
 
+static int netmap_pipe_reg(struct netmap_adapter *na, int onoff);
+
+/* Swap n contiguous slots between the rx and tx rings and report the
+ * buffer change on both sides. The slots are moved in bulk through a
+ * small buffer on the stack, which is much cheaper than swapping the
+ * slots one by one.
+ */
+static inline void
+nm_pipe_swap_slots(struct netmap_slot *rs, struct netmap_slot *ts, u_int n)
+{
+	struct netmap_slot tmp[NM_PIPE_SWAP_BATCH];
+	size_t len = n * sizeof(struct netmap_slot);
+	u_int i;
+
+	memcpy(tmp, rs, len);
+	memcpy(rs, ts, len);
+	memcpy(ts, tmp, len);
+	for (i = 0; i < n; i++) {
+		rs[i].flags |= NS_BUF_CHANGED;
+		ts[i].flags |= NS_BUF_CHANGED;
+	}
+}
+
 int
 netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 {
@@ -179,7 +207,8 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
         u_int limit; /* slots to transfer */
         u_int j, k, lim_tx = txkring->nkr_num_slots - 1,
                 lim_rx = rxkring->nkr_num_slots - 1;
-        int m, busy;
+        u_int rx_hwcur = rxkring->nr_hwcur;
+        int m, busy, shm = (txkring->nr_kflags & NKR_SHMSYNC);
 	struct netmap_ring *txring = txkring->ring, *rxring = rxkring->ring;
 
         ND("%p: %s %x -> %s", txkring, txkring->name, flags, rxkring->name);
@@ -188,12 +217,23 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 
         j = rxkring->nr_hwtail; /* RX */
         k = txkring->nr_hwcur;  /* TX */
+	if (shm) {
+		/* the rx indices are in the peer ring, and the
+		 * peer may have updated them without a syscall
+		 */
+		u_int h = rxring->head, t = rxring->tail;
+
+		if (h <= lim_rx && t <= lim_rx) {
+			rx_hwcur = h;
+			j = t;
+		}
+	}
         m = txkring->rhead - txkring->nr_hwcur; /* new slots */
         if (m < 0)
                 m += txkring->nkr_num_slots;
         limit = m;
         m = lim_rx; /* max avail space on destination */
-        busy = j - rxkring->nr_hwcur; /* busy slots */
+        busy = j - rx_hwcur; /* busy slots */
 	if (busy < 0)
 		busy += rxkring->nkr_num_slots;
 	m -= busy; /* subtract busy slots */
@@ -203,41 +243,404 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 
 	if (limit == 0) {
 		/* either the rxring is full, or nothing to send */
-		return 0;
+		goto notify;
 	}
 
-        while (limit-- > 0) {
-                struct netmap_slot *rs = &rxring->slot[j];
-                struct netmap_slot *ts = &txring->slot[k];
-                struct netmap_slot tmp;
-
-		__builtin_prefetch(ts + 1);
-
-                /* swap the slots and report the buffer change */
-                tmp = *rs;
-                *rs = *ts;
-		rs->flags |= NS_BUF_CHANGED;
-                *ts = tmp;
-		ts->flags |= NS_BUF_CHANGED;
-
-                j = nm_next(j, lim_rx);
-                k = nm_next(k, lim_tx);
+        while (limit > 0) {
+		/* swap a contiguous run of slots, stopping at the end
+		 * of either ring (wraparound) or at the batch size
+		 */
+		u_int n = limit;
+
+		if (n > NM_PIPE_SWAP_BATCH)
+			n = NM_PIPE_SWAP_BATCH;
+		if (n > lim_rx + 1 - j)
+			n = lim_rx + 1 - j;
+		if (n > lim_tx + 1 - k)
+			n = lim_tx + 1 - k;
+		nm_pipe_swap_slots(&rxring->slot[j], &txring->slot[k], n);
+
+		j = (j + n > lim_rx) ? 0 : j + n;
+		k = (k + n > lim_tx) ? 0 : k + n;
+		limit -= n;
         }
 
         mb(); /* make sure the slots are updated before publishing them */
         rxkring->nr_hwtail = j;
         txkring->nr_hwcur = k;
         txkring->nr_hwtail = nm_prev(k, lim_tx);
+	if (shm) {
+		rxring->tail = j;
+		NETMAP_PIPE_CSB(txring)->hwcur = k;
+	}
 
         ND(2, "after: hwcur %d hwtail %d cur %d head %d tail %d j %d", txkring->nr_hwcur, txkring->nr_hwtail,
                 txkring->rcur, txkring->rhead, txkring->rtail, j);
 
-        mb(); /* make sure rxkring->nr_hwtail is updated before notifying */
-        rxkring->nm_notify(rxkring, 0);
+	if (!shm && !(rxkring->nr_kflags & NKR_BUSYPOLL)) {
+		mb(); /* make sure rxkring->nr_hwtail is updated before notifying */
+		rxkring->nm_notify(rxkring, 0);
+	}
+notify:
+	if (shm) {
+		/* the receiver only sleeps after asking for a kick */
+		mb(); /* paired with the one after need_kick is set */
+		if (NETMAP_PIPE_CSB(rxring)->need_kick)
+			rxkring->nm_notify(rxkring, 0);
+	}
+
+	return 0;
+}
+
+/* txsync for the producers of a fan-in pipe. Several tx rings feed
+ * the same rx ring concurrently, each under its own kring lock.
+ * A producer first reserves a range of rx slots by advancing
+ * nkr_hwlease of the rx kring with a compare-and-swap, and then
+ * moves its slots there without any lock. Leases may complete out
+ * of order, so a producer then marks its own lease as done in
+ * pipe_fanin_done[] and advances nr_hwtail over all the done leases
+ * that follow it, under the q_lock of the rx kring. A producer never
+ * waits for the others: if an earlier lease is still being filled,
+ * its owner will publish ours too. This keeps the order within each
+ * producer, and the lock only covers a few index updates.
+ */
+static int
+netmap_pipe_fanin_txsync(struct netmap_kring *txkring, int flags)
+{
+	struct netmap_kring *rxkring = txkring->pipe;
+	u_int lim_tx = txkring->nkr_num_slots - 1,
+		lim_rx = rxkring->nkr_num_slots - 1;
+	struct netmap_ring *txring = txkring->ring, *rxring = rxkring->ring;
+	uint32_t *done = rxkring->pipe_fanin_done;
+	u_int start, end, j, k, n, limit, old_tail;
+	int m, busy;
+
+	k = txkring->nr_hwcur;
+	m = txkring->rhead - k; /* new slots */
+	if (m < 0)
+		m += txkring->nkr_num_slots;
+	if (m == 0)
+		return 0;
+
+	/* reserve [start, end) in the shared rx ring */
+	do {
+		start = rxkring->nkr_hwlease;
+		busy = start - rxkring->nr_hwcur; /* busy or leased slots */
+		if (busy < 0)
+			busy += rxkring->nkr_num_slots;
+		n = lim_rx - busy;
+		if (n > (u_int)m)
+			n = m;
+		if (n == 0) {
+			/* the rxring is full */
+			return 0;
+		}
+		end = start + n;
+		if (end > lim_rx)
+			end -= lim_rx + 1;
+	} while (!NM_ATOMIC_CMPSET32(&rxkring->nkr_hwlease, start, end));
+
+	ND(2, "%s: leased [%u, %u) in %s", txkring->name, start, end,
+		rxkring->name);
+
+	for (j = start, limit = n; limit > 0; ) {
+		u_int r = limit;
+
+		if (r > NM_PIPE_SWAP_BATCH)
+			r = NM_PIPE_SWAP_BATCH;
+		if (r > lim_rx + 1 - j)
+			r = lim_rx + 1 - j;
+		if (r > lim_tx + 1 - k)
+			r = lim_tx + 1 - k;
+		nm_pipe_swap_slots(&rxring->slot[j], &txring->slot[k], r);
+
+		j = (j + r > lim_rx) ? 0 : j + r;
+		k = (k + r > lim_tx) ? 0 : k + r;
+		limit -= r;
+	}
+
+	/* publish our lease and the done ones after it, if the ones
+	 * before it have been published */
+	wmb(); /* make sure the slots are updated before publishing them */
+	mtx_lock(&rxkring->q_lock);
+	done[start] = end + 1;
+	old_tail = j = rxkring->nr_hwtail;
+	while (done[j] != 0) {
+		u_int next = done[j] - 1;
+
+		done[j] = 0;
+		j = next;
+	}
+	rxkring->nr_hwtail = j;
+	mtx_unlock(&rxkring->q_lock);
+	txkring->nr_hwcur = k;
+	txkring->nr_hwtail = nm_prev(k, lim_tx);
+
+	if (j != old_tail && !(rxkring->nr_kflags & NKR_BUSYPOLL)) {
+		mb(); /* make sure rxkring->nr_hwtail is updated before notifying */
+		rxkring->nm_notify(rxkring, 0);
+	}
+
+	return 0;
+}
+
+/* Broadcast pipes.
+ *
+ * The master tx ring feeds all the slave rx rings bound by a consumer.
+ * No payload is copied: each consumer rx slot gets the buffer of the
+ * tx slot, and bcast_refs[] in the master counts the consumers that
+ * still hold each tx slot. pipe_bcast_map[] of a consumer remembers
+ * which tx slot each of its rx slots aliases, and also keeps the
+ * original buffers of the rx ring, which are put back when the
+ * consumer unbinds, and the buffer delivered in each rx slot, which
+ * is put back if the consumer swapped it out. The tx slots are returned to the producer (by
+ * advancing nr_hwtail) in order, as soon as their count drops to 0.
+ *
+ * Only the producer writes the counts of the slots it is sending,
+ * before publishing them, while the consumers decrement the counts
+ * of the slots they release with a compare-and-swap.
+ */
+
+/* is this consumer rx kring receiving from the broadcast ? */
+static inline int
+nm_pipe_bcast_active(struct netmap_kring *kring)
+{
+	return kring->pipe_bcast_map != NULL &&
+		kring->nr_mode == NKR_NETMAP_ON;
+}
+
+static inline void
+nm_pipe_bcast_unref(uint32_t *refs, u_int k)
+{
+	uint32_t r;
+
+	do {
+		r = *(volatile uint32_t *)&refs[k];
+	} while (!NM_ATOMIC_CMPSET32(&refs[k], r, r - 1));
+}
+
+/* return to the producer the tx slots that nobody holds anymore */
+static void
+netmap_pipe_bcast_reclaim(struct netmap_kring *txkring, uint32_t *refs)
+{
+	u_int lim = txkring->nkr_num_slots - 1;
+	u_int j = nm_next(txkring->nr_hwtail, lim);
+
+	while (j != txkring->nr_hwcur &&
+	       *(volatile uint32_t *)&refs[j] == 0) {
+		txkring->nr_hwtail = j;
+		j = nm_next(j, lim);
+	}
+}
+
+static int
+netmap_pipe_bcast_txsync(struct netmap_kring *txkring, int flags)
+{
+	struct netmap_pipe_adapter *mna =
+		(struct netmap_pipe_adapter *)txkring->na;
+	struct netmap_adapter *sna = &mna->peer->up;
+	struct netmap_ring *txring = txkring->ring;
+	struct netmap_kring *rxkring;
+	uint32_t *refs = mna->bcast_refs;
+	u_int lim_tx = txkring->nkr_num_slots - 1;
+	u_int i, n, k = txkring->nr_hwcur, nrx = nma_get_nrings(sna, NR_RX);
+	int m;
+
+	m = txkring->rhead - k; /* new slots */
+	if (m < 0)
+		m += txkring->nkr_num_slots;
+	n = m;
+	if (!mna->bcast_drop) {
+		/* throttle, never send more than the slowest
+		 * consumer can take */
+		for (i = 0; i < nrx; i++) {
+			int busy;
+
+			rxkring = &NMR(sna, NR_RX)[i];
+			if (!nm_pipe_bcast_active(rxkring))
+				continue;
+			busy = rxkring->nr_hwtail - rxkring->nr_hwcur;
+
+			if (busy < 0)
+				busy += rxkring->nkr_num_slots;
+			if (n > rxkring->nkr_num_slots - 1 - busy)
+				n = rxkring->nkr_num_slots - 1 - busy;
+		}
+	}
+	if (n == 0)
+		goto reclaim;
+
+	/* all the counts must be set before any consumer can see
+	 * the slots, so fill all the rx rings first (the new tail is
+	 * parked in nkr_hwlease, which pipes do not use otherwise)
+	 * and publish them in a second pass.
+	 */
+	for (i = 0; i < nrx; i++) {
+		struct netmap_ring *rxring;
+		u_int lim_rx, j, kk = k, d = n;
+		int busy;
+
+		rxkring = &NMR(sna, NR_RX)[i];
+		if (!nm_pipe_bcast_active(rxkring))
+			continue;
+		rxring = rxkring->ring;
+		lim_rx = rxkring->nkr_num_slots - 1;
+		j = rxkring->nr_hwtail;
+		busy = j - rxkring->nr_hwcur;
+
+		if (busy < 0)
+			busy += rxkring->nkr_num_slots;
+		if (d > lim_rx - busy)
+			d = lim_rx - busy;
+		if (mna->bcast_lag) {
+			d = ((u_int)busy >= mna->bcast_lag) ? 0 :
+				((d > mna->bcast_lag - busy) ?
+				 mna->bcast_lag - busy : d);
+		}
+		if (d < n) {
+			rxkring->pipe_bcast_drops += n - d;
+			RD(5, "%s: dropped %u slots", rxkring->name, n - d);
+		}
+		while (d-- > 0) {
+			struct netmap_slot *rs = &rxring->slot[j],
+				*ts = &txring->slot[kk];
+
+			rs->buf_idx = ts->buf_idx;
+			rs->len = ts->len;
+			rs->ptr = ts->ptr;
+			rs->flags = ts->flags | NS_BUF_CHANGED;
+			rxkring->pipe_bcast_map[j] = kk;
+			rxkring->pipe_bcast_map[2 * (lim_rx + 1) + j] =
+				rs->buf_idx;
+			refs[kk]++;
+			j = nm_next(j, lim_rx);
+			kk = nm_next(kk, lim_tx);
+		}
+		rxkring->nkr_hwlease = j; /* published below */
+	}
+
+	mb(); /* make sure the slots are updated before publishing them */
+	for (i = 0; i < nrx; i++) {
+		rxkring = &NMR(sna, NR_RX)[i];
+		if (nm_pipe_bcast_active(rxkring))
+			rxkring->nr_hwtail = rxkring->nkr_hwlease;
+	}
+	txkring->nr_hwcur = (k + n > lim_tx) ? k + n - lim_tx - 1 : k + n;
+
+	mb(); /* make sure nr_hwtail is updated before notifying */
+	for (i = 0; i < nrx; i++) {
+		rxkring = &NMR(sna, NR_RX)[i];
+		if (nm_pipe_bcast_active(rxkring) &&
+		    !(rxkring->nr_kflags & NKR_BUSYPOLL))
+			rxkring->nm_notify(rxkring, 0);
+	}
+reclaim:
+	netmap_pipe_bcast_reclaim(txkring, refs);
+	return 0;
+}
+
+/* rxsync for the consumers of a broadcast pipe */
+static int
+netmap_pipe_bcast_rxsync(struct netmap_kring *rxkring, int flags)
+{
+	struct netmap_kring *txkring = rxkring->pipe;
+	struct netmap_pipe_adapter *mna =
+		(struct netmap_pipe_adapter *)txkring->na;
+	struct netmap_ring *ring = rxkring->ring;
+	uint32_t *map = rxkring->pipe_bcast_map;
+	u_int j = rxkring->nr_hwcur, n = rxkring->nkr_num_slots, lim = n - 1;
+
+	if (j == rxkring->rhead)
+		return 0;
+	mb(); /* paired with the first mb() in txsync */
+	for (; j != rxkring->rhead; j = nm_next(j, lim)) {
+		struct netmap_slot *slot = &ring->slot[j];
+
+		if (unlikely(slot->buf_idx != map[2 * n + j])) {
+			/* the buffer still belongs to the producer */
+			RD(5, "%s: slot %u swapped (%u instead of %u), repaired",
+				rxkring->name, j, slot->buf_idx, map[2 * n + j]);
+			slot->buf_idx = map[2 * n + j];
+			slot->flags |= NS_BUF_CHANGED;
+		}
+		nm_pipe_bcast_unref(mna->bcast_refs, map[j]);
+	}
+	rxkring->nr_hwcur = j;
+	/* the producer reclaims the slots on its next txsync */
+	mb();
+	if (!(txkring->nr_kflags & NKR_BUSYPOLL))
+		txkring->nm_notify(txkring, 0);
+	return 0;
+}
+
+/* Attach (onoff == 1) or detach a consumer rx kring of a broadcast
+ * pipe. On detach the producer must be stopped: the slots still held
+ * by the consumer are released and the original buffers are put
+ * back in the rx ring.
+ */
+static int
+netmap_pipe_bcast_map(struct netmap_kring *kring, int onoff)
+{
+	struct netmap_pipe_adapter *mna =
+		(struct netmap_pipe_adapter *)kring->pipe->na;
+	struct netmap_ring *ring = kring->ring;
+	u_int j, n = kring->nkr_num_slots, lim = n - 1;
+	uint32_t *map;
+
+	if (onoff) {
+		map = nm_os_malloc(3 * n * sizeof(*map));
+		if (map == NULL)
+			return ENOMEM;
+		for (j = 0; j < n; j++)
+			map[n + j] = ring->slot[j].buf_idx;
+		kring->nr_hwtail = kring->nr_hwcur;
+		kring->pipe_bcast_drops = 0;
+		mb(); /* make sure the map is ready before the producer sees it */
+		kring->pipe_bcast_map = map;
+		return 0;
+	}
 
+	map = kring->pipe_bcast_map;
+	if (map == NULL)
+		return 0;
+	for (j = kring->nr_hwcur; j != kring->nr_hwtail; j = nm_next(j, lim))
+		nm_pipe_bcast_unref(mna->bcast_refs, map[j]);
+	for (j = 0; j < n; j++) {
+		ring->slot[j].buf_idx = map[n + j];
+		ring->slot[j].flags |= NS_BUF_CHANGED;
+	}
+	kring->nr_hwcur = kring->nr_hwtail;
+	kring->rhead = kring->rcur = kring->rtail = kring->nr_hwtail;
+	ring->head = ring->cur = ring->tail = kring->nr_hwtail;
+	if (kring->pipe_bcast_drops)
+		D("%s: %u slots dropped", kring->name, kring->pipe_bcast_drops);
+	kring->pipe_bcast_map = NULL;
+	nm_os_free(map);
 	return 0;
 }
 
+/* notify the sender(s) that some slots have been released */
+static void
+netmap_pipe_notify_tx(struct netmap_kring *txkring)
+{
+	struct netmap_adapter *na = txkring->na;
+	u_int i;
+
+	if (!((struct netmap_pipe_adapter *)na)->fanin) {
+		if (!(txkring->nr_kflags & NKR_BUSYPOLL))
+			txkring->nm_notify(txkring, 0);
+		return;
+	}
+	/* all the active producers of a fan-in share our rx ring */
+	for (i = 0; i < nma_get_nrings(na, NR_TX); i++) {
+		struct netmap_kring *kring = &NMR(na, NR_TX)[i];
+
+		if (kring->nr_mode == NKR_NETMAP_ON &&
+		    !(kring->nr_kflags & NKR_BUSYPOLL))
+			kring->nm_notify(kring, 0);
+	}
+}
+
 int
 netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
 {
@@ -250,14 +653,107 @@ netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
                 rxkring->rcur, rxkring->rhead, rxkring->rtail);
         mb(); /* paired with the first mb() in txsync */
 
-	if (oldhwcur != rxkring->nr_hwcur) {
-		/* we have released some slots, notify the other end */
+	if (rxkring->nr_kflags & NKR_SHMSYNC) {
+		/* the sender reads our head directly, and only
+		 * sleeps after asking for a kick */
+		if (NETMAP_PIPE_CSB(txkring->ring)->need_kick)
+			txkring->nm_notify(txkring, 0);
+	} else if (oldhwcur != rxkring->nr_hwcur) {
+		/* we have released some slots, notify the other end
+		 * (unless it busy-polls and will see them anyway) */
 		mb(); /* make sure nr_hwcur is updated before notifying */
-		txkring->nm_notify(txkring, 0);
+		netmap_pipe_notify_tx(txkring);
 	}
         return 0;
 }
 
+/* Import the ring indices of a NR_SHM_SYNC pipe ring, which the
+ * endpoints may have moved without entering the kernel. This is
+ * called by the sync prologues before validating head and cur.
+ * For tx rings hwcur comes from the control block, for rx rings
+ * it is the consumer head. The tail is always the one in the ring.
+ * Out of range values are ignored and left to the prologue checks.
+ */
+void
+netmap_pipe_shm_import(struct netmap_kring *kring)
+{
+	struct netmap_ring *ring = kring->ring;
+	u_int lim = kring->nkr_num_slots - 1;
+	u_int hwcur, hwtail;
+
+	hwtail = ring->tail;
+	hwcur = (kring->tx == NR_TX) ?
+		NETMAP_PIPE_CSB(ring)->hwcur : ring->head;
+	if (hwcur > lim || hwtail > lim) {
+		RD(5, "%s: bad indices hwcur %u hwtail %u", kring->name,
+			hwcur, hwtail);
+		return;
+	}
+	kring->nr_hwcur = hwcur;
+	kring->nr_hwtail = kring->rtail = hwtail;
+	if (kring->tx == NR_TX)
+		kring->rhead = kring->rcur = hwcur;
+}
+
+/* Bind a producer of a fan-in pipe to the first tx ring of the master
+ * that is not in use (or a consumer of a broadcast pipe to the first
+ * free rx ring of the slave), and to no ring in the other direction.
+ * Nothing to do for other adapters. Called by netmap_krings_get(),
+ * when the krings exist.
+ */
+int
+netmap_pipe_pick_ring(struct netmap_priv_d *priv)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_pipe_adapter *pna = (struct netmap_pipe_adapter *)na;
+	enum txrx t;
+	u_int i;
+
+	if (na->nm_register != netmap_pipe_reg)
+		return 0;
+	if (pna->fanin && pna->role == NR_REG_PIPE_MASTER)
+		t = NR_TX;
+	else if (pna->bcast && pna->role == NR_REG_PIPE_SLAVE)
+		t = NR_RX;
+	else
+		return 0;
+
+	for (i = 0; i < nma_get_nrings(na, t); i++) {
+		if (NMR(na, t)[i].users == 0) {
+			enum txrx r = nm_txrx_swap(t);
+
+			priv->np_qfirst[t] = i;
+			priv->np_qlast[t] = i + 1;
+			priv->np_qfirst[r] = priv->np_qlast[r] = 0;
+			ND("%s: bound to %s ring %u", na->name, nm_txrx2str(t), i);
+			return 0;
+		}
+	}
+	D("%s: all the %u %s rings are in use", na->name, i, nm_txrx2str(t));
+	return EBUSY;
+}
+
+/* Initialize the control blocks of a pair of pipe rings. The peer
+ * offset is always refreshed (the rings may have been reallocated),
+ * hwcur only when the ring has just been created.
+ */
+static void
+netmap_pipe_csb_init(struct netmap_kring *kring, int fresh)
+{
+	struct netmap_ring *ring = kring->ring, *pring = kring->pipe->ring;
+	struct netmap_pipe_csb *csb;
+
+	if (ring == NULL || pring == NULL)
+		return;
+	csb = NETMAP_PIPE_CSB(ring);
+	csb->peer_ofs = (char *)pring - (char *)ring;
+	NETMAP_PIPE_CSB(pring)->peer_ofs = (char *)ring - (char *)pring;
+	if (fresh) {
+		csb->hwcur = kring->nr_hwcur;
+		csb->need_kick = 0;
+	}
+}
+
 /* Pipe endpoints are created and destroyed together, so that endopoints do not
  * have to check for the existence of their peer at each ?xsync.
  *
@@ -328,24 +824,67 @@ netmap_pipe_krings_create(struct netmap_adapter *na)
 		if (error)
 			goto del_krings1;
 
-		/* cross link the krings */
+		/* cross link the krings. In a fan-in pipe all the
+		 * master tx rings are linked to the only slave rx ring,
+		 * which is linked back to the first of them (and the
+		 * other way round in a broadcast pipe).
+		 */
 		for_rx_tx(t) {
 			enum txrx r = nm_txrx_swap(t); /* swap NR_TX <-> NR_RX */
-			for (i = 0; i < nma_get_nrings(na, t); i++) {
-				NMR(na, t)[i].pipe = NMR(ona, r) + i;
-				NMR(ona, r)[i].pipe = NMR(na, t) + i;
-			}
+			u_int n = nma_get_nrings(na, t),
+			      on = nma_get_nrings(ona, r);
+
+			for (i = 0; i < n; i++)
+				NMR(na, t)[i].pipe = NMR(ona, r) + (i < on ? i : 0);
+			for (i = 0; i < on; i++)
+				NMR(ona, r)[i].pipe = NMR(na, t) + (i < n ? i : 0);
 		}
 
+		if (pna->fanin) {
+			/* the completed leases of the slave rx ring */
+			struct netmap_kring *kring = NMR(pna->role ==
+				NR_REG_PIPE_SLAVE ? na : ona, NR_RX);
+
+			kring->pipe_fanin_done = nm_os_malloc(
+				kring->nkr_num_slots *
+				sizeof(*kring->pipe_fanin_done));
+			if (kring->pipe_fanin_done == NULL) {
+				error = ENOMEM;
+				goto del_krings2;
+			}
+		}
 	}
 	return 0;
 
+del_krings2:
+	netmap_krings_delete(ona);
 del_krings1:
 	netmap_krings_delete(na);
 err:
 	return error;
 }
 
+/* In a fan-in pipe the slave rx ring is the peer of several master
+ * tx rings (and vice versa in a broadcast pipe): it is still needed
+ * if any of them, other than kring, is still active.
+ */
+static int
+nm_pipe_peer_shared(struct netmap_kring *kring)
+{
+	struct netmap_adapter *na = kring->na;
+	enum txrx t = kring->tx;
+	u_int i;
+
+	for (i = 0; i < nma_get_nrings(na, t); i++) {
+		struct netmap_kring *k = &NMR(na, t)[i];
+
+		if (k != kring && k->pipe == kring->pipe &&
+		    k->nr_mode == NKR_NETMAP_ON && !nm_kring_pending_off(k))
+			return 1;
+	}
+	return 0;
+}
+
 /* netmap_pipe_reg.
  *
  * There are two cases on registration (onoff==1)
@@ -385,6 +924,7 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 	struct netmap_pipe_adapter *pna =
 		(struct netmap_pipe_adapter *)na;
 	struct netmap_adapter *ona = &pna->peer->up;
+	int bcast_rx = pna->bcast && pna->role == NR_REG_PIPE_SLAVE;
 	int i, error = 0;
 	enum txrx t;
 
@@ -406,6 +946,22 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 		if (error)
 			return error;
 
+		if (bcast_rx) {
+			for (i = 0; i < nma_get_nrings(na, NR_RX); i++) {
+				struct netmap_kring *kring = &NMR(na, NR_RX)[i];
+
+				if (!nm_kring_pending_on(kring))
+					continue;
+				error = netmap_pipe_bcast_map(kring, 1);
+				if (error) {
+					while (i-- > 0)
+						netmap_pipe_bcast_map(
+							&NMR(na, NR_RX)[i], 0);
+					return error;
+				}
+			}
+		}
+
 		/* In case of no error we put our rings in netmap mode */
 		for_rx_tx(t) {
 			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
@@ -413,29 +969,49 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 
 				if (nm_kring_pending_on(kring)) {
 					kring->nr_mode = NKR_NETMAP_ON;
+					if (kring->pipe) {
+						netmap_pipe_csb_init(kring, 1);
+						netmap_pipe_csb_init(kring->pipe,
+							kring->pipe->users == 0);
+					}
 				}
 			}
 		}
 		if (na->active_fds == 0)
 			na->na_flags |= NAF_NETMAP_ON;
 	} else {
+		struct netmap_kring *ptx = NULL;
+
 		if (na->active_fds == 0)
 			na->na_flags &= ~NAF_NETMAP_ON;
+		if (bcast_rx) {
+			/* keep the producer out while we take
+			 * our slots back */
+			ptx = NMR(ona, NR_TX);
+			if (ptx->nkr_stopped)
+				ptx = NULL; /* already stopped */
+			else
+				nm_kr_stop(ptx, NM_KR_LOCKED);
+		}
 		for_rx_tx(t) {
 			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
 				struct netmap_kring *kring = &NMR(na, t)[i];
 
 				if (nm_kring_pending_off(kring)) {
 					kring->nr_mode = NKR_NETMAP_OFF;
+					if (bcast_rx && t == NR_RX)
+						netmap_pipe_bcast_map(kring, 0);
 					/* mark the peer ring as no longer needed by us
 					 * (it may still be kept if sombody else is using it)
 					 */
-					if (kring->pipe) {
+					if (kring->pipe && !nm_pipe_peer_shared(kring)) {
 						kring->pipe->nr_kflags &= ~NKR_NEEDRING;
 					}
 				}
 			}
 		}
+		if (ptx)
+			nm_kr_start(ptx);
 		/* delete all the peer rings that are no longer needed */
 		netmap_mem_rings_delete(ona);
 	}
@@ -495,8 +1071,17 @@ netmap_pipe_krings_delete(struct netmap_adapter *na)
 	}
 	/* case 1) above */
 	ND("%p: case 1, deleting everything", na);
-	netmap_krings_delete(na); /* also zeroes tx_rings etc. */
 	ona = &pna->peer->up;
+	if (pna->fanin) {
+		struct netmap_kring *kring = NMR(pna->role ==
+			NR_REG_PIPE_SLAVE ? na : ona, NR_RX);
+
+		if (kring != NULL && kring->pipe_fanin_done != NULL) {
+			nm_os_free(kring->pipe_fanin_done);
+			kring->pipe_fanin_done = NULL;
+		}
+	}
+	netmap_krings_delete(na); /* also zeroes tx_rings etc. */
 	if (ona->tx_rings == NULL) {
 		/* already deleted, we must be on an
                  * cleanup-after-error path */
@@ -517,8 +1102,13 @@ netmap_pipe_dtor(struct netmap_adapter *na)
 		pna->peer_ref = 0;
 		netmap_adapter_put(&pna->peer->up);
 	}
-	if (pna->role == NR_REG_PIPE_MASTER)
+	if (pna->role == NR_REG_PIPE_MASTER) {
 		netmap_pipe_remove(pna->parent, pna);
+		if (pna->bcast_refs) {
+			nm_os_free(pna->bcast_refs);
+			pna->bcast_refs = NULL;
+		}
+	}
 	if (pna->parent_ifp)
 		if_rele(pna->parent_ifp);
 	netmap_adapter_put(pna->parent);
@@ -535,6 +1125,8 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 	struct ifnet *ifp = NULL;
 	u_int pipe_id;
 	int role = nmr->nr_flags & NR_REG_MASK;
+	int fanin = !!(nmr->nr_flags & NR_PIPE_FANIN);
+	int bcast = !!(nmr->nr_flags & NR_PIPE_BCAST);
 	int error, retries = 0;
 
 	ND("flags %x", nmr->nr_flags);
@@ -544,6 +1136,14 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 		return 0;
 	}
 	role = nmr->nr_flags & NR_REG_MASK;
+	if ((fanin || bcast) && (nmr->nr_flags & NR_SHM_SYNC)) {
+		ND("NR_SHM_SYNC not supported on fan-in and broadcast pipes");
+		return EINVAL;
+	}
+	if (fanin && bcast) {
+		ND("a pipe cannot be both fan-in and broadcast");
+		return EINVAL;
+	}
 
 	/* first, try to find the parent adapter */
 	bzero(&pnmr, sizeof(pnmr));
@@ -584,6 +1184,11 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 	pipe_id = nmr->nr_ringid & NETMAP_RING_MASK;
 	mna = netmap_pipe_find(pna, pipe_id);
 	if (mna) {
+		if (mna->fanin != fanin || mna->bcast != bcast) {
+			ND("pipe %d fan-in/broadcast mismatch", pipe_id);
+			error = EINVAL;
+			goto put_out;
+		}
 		if (mna->role == role) {
 			ND("found %d directly at %d", pipe_id, mna->parent_slot);
 			req = mna;
@@ -617,8 +1222,16 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 	mna->role = NR_REG_PIPE_MASTER;
 	mna->parent = pna;
 	mna->parent_ifp = ifp;
+	mna->fanin = fanin;
+	mna->bcast = bcast;
+	if (bcast && nmr->spare2[0]) {
+		/* NETMAP_PIPE_BCAST_DROP(lag) */
+		mna->bcast_drop = 1;
+		mna->bcast_lag = nmr->spare2[0] - 1;
+	}
 
-	mna->up.nm_txsync = netmap_pipe_txsync;
+	mna->up.nm_txsync = fanin ? netmap_pipe_fanin_txsync :
+		(bcast ? netmap_pipe_bcast_txsync : netmap_pipe_txsync);
 	mna->up.nm_rxsync = netmap_pipe_rxsync;
 	mna->up.nm_register = netmap_pipe_reg;
 	mna->up.nm_dtor = netmap_pipe_dtor;
@@ -629,6 +1242,12 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 	mna->up.na_lut = pna->na_lut;
 
 	mna->up.num_tx_rings = 1;
+	if (fanin) {
+		/* one tx ring per producer */
+		mna->up.num_tx_rings = nmr->nr_tx_rings;
+		nm_bound_var(&mna->up.num_tx_rings, NM_PIPE_DEFFANIN,
+				1, NM_PIPE_MAXFANIN, NULL);
+	}
 	mna->up.num_rx_rings = 1;
 	mna->up.num_tx_desc = nmr->nr_tx_slots;
 	nm_bound_var(&mna->up.num_tx_desc, pna->num_tx_desc,
@@ -636,6 +1255,14 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 	mna->up.num_rx_desc = nmr->nr_rx_slots;
 	nm_bound_var(&mna->up.num_rx_desc, pna->num_rx_desc,
 			1, NM_PIPE_MAXSLOTS, NULL);
+	if (bcast) {
+		mna->bcast_refs = nm_os_malloc(mna->up.num_tx_desc *
+				sizeof(*mna->bcast_refs));
+		if (mna->bcast_refs == NULL) {
+			error = ENOMEM;
+			goto free_mna;
+		}
+	}
 	error = netmap_attach_common(&mna->up);
 	if (error)
 		goto free_mna;
@@ -655,6 +1282,17 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 	sna->up.nm_mem = netmap_mem_get(mna->up.nm_mem);
 	snprintf(sna->up.name, sizeof(sna->up.name), "%s}%d", pna->name, pipe_id);
 	sna->role = NR_REG_PIPE_SLAVE;
+	sna->bcast_refs = NULL; /* owned by the master */
+	/* the slave has a single ring in each direction,
+	 * except for the consumers of a broadcast pipe */
+	sna->up.num_tx_rings = 1;
+	sna->up.nm_txsync = netmap_pipe_txsync;
+	if (bcast) {
+		sna->up.num_rx_rings = nmr->nr_rx_rings;
+		nm_bound_var(&sna->up.num_rx_rings, NM_PIPE_DEFBCAST,
+				1, NM_PIPE_MAXBCAST, NULL);
+		sna->up.nm_rxsync = netmap_pipe_bcast_rxsync;
+	}
 	error = netmap_attach_common(&sna->up);
 	if (error)
 		goto free_sna;
@@ -699,6 +1337,8 @@ free_sna:
 unregister_mna:
 	netmap_pipe_remove(pna, mna);
 free_mna:
+	if (mna->bcast_refs)
+		nm_os_free(mna->bcast_refs);
 	nm_os_free(mna);
 put_out:
 	netmap_unget_na(pna, ifp);
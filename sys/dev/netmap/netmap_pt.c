@@ -40,13 +40,16 @@
 #include <net/if.h>
 #include <net/if_var.h>
 #include <machine/bus.h>
+#include <sys/proc.h>
 
 //#define usleep_range(_1, _2)
 #define usleep_range(_1, _2) \
 	pause_sbt("ptnetmap-sleep", SBT_1US * _1, SBT_1US * 1, C_ABSOLUTE)
+#define ptnetmap_yield()	kern_yield(PRI_UNCHANGED)
 
 #elif defined(linux)
 #include <bsd_glue.h>
+#define ptnetmap_yield()	cond_resched()
 #endif
 
 #include <net/netmap.h>
@@ -59,10 +62,16 @@
 /* RX cycle without receive any packets */
 #define PTN_RX_DRY_CYCLES_MAX	10
 
-/* Limit Batch TX to half ring.
- * Currently disabled, since it does not manage NS_MOREFRAG, which
- * results in random drops in the VALE txsync. */
-//#define PTN_TX_BATCH_LIM(_n)	((_n >> 1))
+/* Bounds of the adaptive polling budget, see ptnetmap_adapt_wakeup() */
+#define PTN_POLL_MIN		1
+#define PTN_POLL_MAX		64
+/* Woken up again within this time: we should have polled longer */
+#define PTN_POLL_GAP_NS		50000
+/* Weight of the new sample in the average batch is 1/8 */
+#define PTN_AVG_SHIFT		3
+
+/* Default TX batch limit: half ring, see ptnetmap_tx_batch_cut() */
+#define PTN_TX_BATCH_LIM(_n)	((_n >> 1))
 
 //#define BUSY_WAIT
 
@@ -73,105 +82,37 @@
 #define DBG(x)
 #endif
 
-
-#undef RATE
-//#define RATE  /* Enables communication statistics. */
-#ifdef RATE
-#define IFRATE(x) x
-struct rate_batch_stats {
-    unsigned long sync;
-    unsigned long sync_dry;
-    unsigned long pkt;
-};
-
-struct rate_stats {
-    unsigned long gtxk;     /* Guest --> Host Tx kicks. */
-    unsigned long grxk;     /* Guest --> Host Rx kicks. */
-    unsigned long htxk;     /* Host --> Guest Tx kicks. */
-    unsigned long hrxk;     /* Host --> Guest Rx Kicks. */
-    unsigned long btxwu;    /* Backend Tx wake-up. */
-    unsigned long brxwu;    /* Backend Rx wake-up. */
-    struct rate_batch_stats txbs;
-    struct rate_batch_stats rxbs;
-};
-
-struct rate_context {
-    struct timer_list timer;
-    struct rate_stats new;
-    struct rate_stats old;
+/*
+ * Adaptive notification policy of a ring.
+ *
+ * The worker polls the CSB (TX) or the backend (RX) for poll_budget
+ * idle cycles before going to sleep. The budget doubles when the worker
+ * is woken up again shortly after going to sleep, as a few more cycles
+ * would have saved the kick and the wakeup, and halves when the ring
+ * stays idle for much longer.
+ * Interrupts to the guest are postponed while the slots gathered since
+ * the last one are fewer than the average batch, as more are likely to
+ * come in the same activation. The worker always interrupts the guest,
+ * if needed, before going to sleep.
+ */
+struct ptnetmap_adapt {
+    struct ptnetmap_ring_stats stats;
+    uint32_t batch_ewma;	/* slots per sync, << PTN_AVG_SHIFT */
+    uint64_t last_sleep;	/* when the worker went to sleep, in ns */
+    /* bumped atomically by nm_pt_host_notify(), which does not run in
+     * the worker context, and folded into stats.backend_wakeups by
+     * the worker */
+    volatile uint32_t backend_notifies;
+    uint32_t backend_seen;
 };
 
-#define RATE_PERIOD  2
-static void
-rate_callback(unsigned long arg)
-{
-    struct rate_context * ctx = (struct rate_context *)arg;
-    struct rate_stats cur = ctx->new;
-    struct rate_batch_stats *txbs = &cur.txbs;
-    struct rate_batch_stats *rxbs = &cur.rxbs;
-    struct rate_batch_stats *txbs_old = &ctx->old.txbs;
-    struct rate_batch_stats *rxbs_old = &ctx->old.rxbs;
-    uint64_t tx_batch, rx_batch;
-    unsigned long txpkts, rxpkts;
-    unsigned long gtxk, grxk;
-    int r;
-
-    txpkts = txbs->pkt - txbs_old->pkt;
-    rxpkts = rxbs->pkt - rxbs_old->pkt;
-
-    tx_batch = ((txbs->sync - txbs_old->sync) > 0) ?
-	       txpkts / (txbs->sync - txbs_old->sync): 0;
-    rx_batch = ((rxbs->sync - rxbs_old->sync) > 0) ?
-	       rxpkts / (rxbs->sync - rxbs_old->sync): 0;
-
-    /* Fix-up gtxk and grxk estimates. */
-    gtxk = (cur.gtxk - ctx->old.gtxk) - (cur.btxwu - ctx->old.btxwu);
-    grxk = (cur.grxk - ctx->old.grxk) - (cur.brxwu - ctx->old.brxwu);
-
-    printk("txpkts  = %lu Hz\n", txpkts/RATE_PERIOD);
-    printk("gtxk    = %lu Hz\n", gtxk/RATE_PERIOD);
-    printk("htxk    = %lu Hz\n", (cur.htxk - ctx->old.htxk)/RATE_PERIOD);
-    printk("btxw    = %lu Hz\n", (cur.btxwu - ctx->old.btxwu)/RATE_PERIOD);
-    printk("rxpkts  = %lu Hz\n", rxpkts/RATE_PERIOD);
-    printk("grxk    = %lu Hz\n", grxk/RATE_PERIOD);
-    printk("hrxk    = %lu Hz\n", (cur.hrxk - ctx->old.hrxk)/RATE_PERIOD);
-    printk("brxw    = %lu Hz\n", (cur.brxwu - ctx->old.brxwu)/RATE_PERIOD);
-    printk("txbatch = %llu avg\n", tx_batch);
-    printk("rxbatch = %llu avg\n", rx_batch);
-    printk("\n");
-
-    ctx->old = cur;
-    r = mod_timer(&ctx->timer, jiffies +
-            msecs_to_jiffies(RATE_PERIOD * 1000));
-    if (unlikely(r))
-        D("[ptnetmap] Error: mod_timer()\n");
-}
-
-static void
-rate_batch_stats_update(struct rate_batch_stats *bf, uint32_t pre_tail,
-		        uint32_t act_tail, uint32_t num_slots)
-{
-    int n = (int)act_tail - pre_tail;
-
-    if (n) {
-        if (n < 0)
-            n += num_slots;
-
-        bf->sync++;
-        bf->pkt += n;
-    } else {
-        bf->sync_dry++;
-    }
-}
-
-#else /* !RATE */
-#define IFRATE(x)
-#endif /* RATE */
-
 struct ptnetmap_state {
     /* Kthreads. */
     struct nm_kctx **kctxs;
 
+    /* Per-ring policy state and counters, in the order of the kctxs. */
+    struct ptnetmap_adapt *adapt;
+
     /* Shared memory with the guest (TX/RX) */
     struct ptnet_ring __user *ptrings;
 
@@ -179,8 +120,6 @@ struct ptnetmap_state {
 
     /* Netmap adapter wrapping the backend. */
     struct netmap_pt_host_adapter *pth_na;
-
-    IFRATE(struct rate_context rate_ctx;)
 };
 
 static inline void
@@ -193,6 +132,130 @@ ptnetmap_kring_dump(const char *title, const struct netmap_kring *kring)
 		kring->ring->head, kring->ring->cur, kring->ring->tail);
 }
 
+/* A worker starts to serve the ring, possibly adapt its budget. */
+static inline void
+ptnetmap_adapt_wakeup(struct ptnetmap_adapt *ad, uint32_t fixed_budget)
+{
+    uint32_t budget = ad->stats.poll_budget;
+    uint32_t notifies = ad->backend_notifies;
+    uint64_t gap;
+
+    ad->stats.wakeups++;
+    ad->stats.backend_wakeups += notifies - ad->backend_seen;
+    ad->backend_seen = notifies;
+    if (!ptnetmap_adaptive || ad->last_sleep == 0) {
+        ad->stats.poll_budget = fixed_budget;
+        return;
+    }
+    gap = nm_os_get_ns() - ad->last_sleep;
+    if (gap < PTN_POLL_GAP_NS) {
+        budget <<= 1;
+    } else if (gap > 16 * PTN_POLL_GAP_NS) {
+        budget >>= 1;
+    }
+    if (budget < PTN_POLL_MIN)
+        budget = PTN_POLL_MIN;
+    if (budget > PTN_POLL_MAX)
+        budget = PTN_POLL_MAX;
+    ad->stats.poll_budget = budget;
+}
+
+/* The backend asks for a wakeup, called from nm_pt_host_notify(). */
+static inline void
+ptnetmap_adapt_notify(struct ptnetmap_adapt *ad)
+{
+    uint32_t old;
+
+    do {
+        old = ad->backend_notifies;
+    } while (!NM_ATOMIC_CMPSET32(&ad->backend_notifies, old, old + 1));
+}
+
+/* The worker is done with the ring. */
+static inline void
+ptnetmap_adapt_sleep(struct ptnetmap_adapt *ad)
+{
+    ad->last_sleep = ptnetmap_adaptive ? nm_os_get_ns() : 0;
+}
+
+/* Account a sync that moved n slots. */
+static inline void
+ptnetmap_adapt_sync(struct ptnetmap_adapt *ad, uint32_t n)
+{
+    unsigned int b;
+
+    ad->stats.syncs++;
+    if (n == 0) {
+        ad->stats.syncs_dry++;
+        return;
+    }
+    ad->stats.slots += n;
+    for (b = 0; b < PTNETMAP_BATCH_BUCKETS - 1 && (n >> (b + 1)); b++)
+        ;
+    ad->stats.batch_hist[b]++;
+    ad->batch_ewma = (ad->batch_ewma * ((1 << PTN_AVG_SHIFT) - 1) +
+        (n << PTN_AVG_SHIFT)) >> PTN_AVG_SHIFT;
+    ad->stats.batch_avg = ad->batch_ewma >> PTN_AVG_SHIFT;
+}
+
+/* Should the guest be interrupted now for the 'pending' new slots? */
+static inline bool
+ptnetmap_adapt_intr(struct ptnetmap_adapt *ad, uint32_t pending,
+                    uint32_t num_slots)
+{
+    uint32_t thresh = ad->stats.batch_avg;
+
+    if (!ptnetmap_adaptive)
+        return true;
+    if (thresh > (num_slots >> 1))
+        thresh = num_slots >> 1;
+    if (pending >= thresh)
+        return true;
+    ad->stats.intrs_coalesced++;
+    return false;
+}
+
+/* Resolve a TX batch limit requested by the user, see netmap_virt.h */
+static inline uint32_t
+ptnetmap_tx_batch_lim(uint32_t lim, uint32_t num_slots)
+{
+    if (lim == 0)
+        lim = ptnetmap_tx_batch;
+    if (lim == 0)
+        lim = PTN_TX_BATCH_LIM(num_slots);
+    if (lim > num_slots)
+        lim = num_slots;
+    return lim;
+}
+
+/*
+ * Returns the head to be passed to the backend txsync, so that at most
+ * lim of the slots from hwcur to head are sent. The cut must not fall
+ * inside a packet, since the VALE txsync drops the fragments it is
+ * given without the last one: we go back to the end of the previous
+ * packet or, if the first one is longer than lim, forward to its end.
+ */
+static inline uint32_t
+ptnetmap_tx_batch_cut(struct netmap_kring *kring, uint32_t head, uint32_t lim)
+{
+    struct netmap_slot *slot = kring->ring->slot;
+    uint32_t lim1 = kring->nkr_num_slots - 1;
+    uint32_t cut, j;
+
+    cut = kring->nr_hwcur + lim;
+    if (cut > lim1)
+        cut -= kring->nkr_num_slots;
+    for (j = cut; j != kring->nr_hwcur; j = nm_prev(j, lim1)) {
+        if (!(slot[nm_prev(j, lim1)].flags & NS_MOREFRAG))
+            return j;
+    }
+    for (j = nm_next(cut, lim1); j != head; j = nm_next(j, lim1)) {
+        if (!(slot[nm_prev(j, lim1)].flags & NS_MOREFRAG))
+            return j;
+    }
+    return head;
+}
+
 /*
  * TX functions to set/get and to handle host/guest kick.
  */
@@ -233,11 +296,11 @@ ptnetmap_tx_handler(void *data, int is_kthread)
     struct ptnetmap_state *ptns = pth_na->ptns;
     struct ptnet_ring __user *ptring;
     struct netmap_ring shadow_ring; /* shadow copy of the netmap_ring */
-    bool more_txspace = false;
+    bool more_txspace = false, cut;
     struct nm_kctx *kth;
-    uint32_t num_slots;
+    struct ptnetmap_adapt *ad;
+    uint32_t num_slots, pending = 0, idle;
     int batch;
-    IFRATE(uint32_t pre_tail);
 
     if (unlikely(!ptns)) {
         D("ERROR ptnetmap state is NULL");
@@ -254,12 +317,11 @@ ptnetmap_tx_handler(void *data, int is_kthread)
         return;
     }
 
-    /* This is a guess, to be fixed in the rate callback. */
-    IFRATE(ptns->rate_ctx.new.gtxk++);
-
     /* Get TX ptring pointer from the CSB. */
     ptring = ptns->ptrings + kring->ring_id;
     kth = ptns->kctxs[kring->ring_id];
+    ad = &ptns->adapt[kring->ring_id];
+    ptnetmap_adapt_wakeup(ad, PTN_POLL_MIN);
 
     num_slots = kring->nkr_num_slots;
     shadow_ring.head = kring->rhead;
@@ -277,18 +339,22 @@ ptnetmap_tx_handler(void *data, int is_kthread)
         if (batch < 0)
             batch += num_slots;
 
-#ifdef PTN_TX_BATCH_LIM
-        if (batch > PTN_TX_BATCH_LIM(num_slots)) {
-            uint32_t head_lim = kring->nr_hwcur + PTN_TX_BATCH_LIM(num_slots);
+        cut = false;
+        if ((uint32_t)batch > ad->stats.batch_lim) {
+            uint32_t head_lim = ptnetmap_tx_batch_cut(kring,
+                                    shadow_ring.head, ad->stats.batch_lim);
 
-            if (head_lim >= num_slots)
-                head_lim -= num_slots;
             ND(1, "batch: %d head: %d head_lim: %d", batch, shadow_ring.head,
 						     head_lim);
-            shadow_ring.head = head_lim;
-	    batch = PTN_TX_BATCH_LIM(num_slots);
+            if (head_lim != shadow_ring.head) {
+                shadow_ring.head = shadow_ring.cur = head_lim;
+                batch = head_lim - kring->nr_hwcur;
+                if (batch < 0)
+                    batch += num_slots;
+                ad->stats.batch_cuts++;
+                cut = true;
+            }
         }
-#endif /* PTN_TX_BATCH_LIM */
 
         if (nm_kr_txspace(kring) <= (num_slots >> 1)) {
             shadow_ring.flags |= NAF_FORCE_RECLAIM;
@@ -307,7 +373,6 @@ ptnetmap_tx_handler(void *data, int is_kthread)
             ptnetmap_kring_dump("pre txsync", kring);
 	}
 
-        IFRATE(pre_tail = kring->rtail);
         if (unlikely(kring->nm_sync(kring, shadow_ring.flags))) {
             /* Reenable notifications. */
             ptring_kick_enable(ptring, 1);
@@ -322,32 +387,51 @@ ptnetmap_tx_handler(void *data, int is_kthread)
          */
         ptnetmap_host_write_kring_csb(ptring, kring->nr_hwcur,
 				      kring->nr_hwtail);
+        ptnetmap_adapt_sync(ad, batch);
         if (kring->rtail != kring->nr_hwtail) {
 	    /* Some more room available in the parent adapter. */
+	    int freed = kring->nr_hwtail - kring->rtail;
+
+	    if (freed < 0)
+		freed += num_slots;
+	    pending += freed;
 	    kring->rtail = kring->nr_hwtail;
 	    more_txspace = true;
         }
 
-        IFRATE(rate_batch_stats_update(&ptns->rate_ctx.new.txbs, pre_tail,
-				       kring->rtail, num_slots));
-
         if (unlikely(netmap_verbose & NM_VERB_TXSYNC)) {
             ptnetmap_kring_dump("post txsync", kring);
 	}
 
 #ifndef BUSY_WAIT
         /* Interrupt the guest if needed. */
-        if (more_txspace && ptring_intr_enabled(ptring) && is_kthread) {
+        if (more_txspace && ptring_intr_enabled(ptring) && is_kthread &&
+                ptnetmap_adapt_intr(ad, pending, num_slots)) {
             /* Disable guest kick to avoid sending unnecessary kicks */
             ptring_intr_enable(ptring, 0);
             nm_os_kctx_send_irq(kth);
-            IFRATE(ptns->rate_ctx.new.htxk++);
+            ad->stats.intrs++;
             more_txspace = false;
+            pending = 0;
         }
 #endif
+        /* Let the other workers on this CPU run between two pieces of
+         * a long burst. */
+        if (cut && is_kthread) {
+            ptnetmap_yield();
+        }
         /* Read CSB to see if there is more work to do. */
         ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
 #ifndef BUSY_WAIT
+        /* Poll the CSB for a while before asking for kicks. */
+        for (idle = 1; is_kthread && shadow_ring.head == kring->rhead &&
+                idle < ad->stats.poll_budget; idle++) {
+            usleep_range(1,1);
+            ad->stats.poll_cycles++;
+            ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
+            if (shadow_ring.head != kring->rhead)
+                ad->stats.poll_hits++;
+        }
         if (shadow_ring.head == kring->rhead) {
             /*
              * No more packets to transmit. We enable notifications and
@@ -359,6 +443,7 @@ ptnetmap_tx_handler(void *data, int is_kthread)
             }
             /* Reenable notifications. */
             ptring_kick_enable(ptring, 1);
+            ad->stats.kicks_enabled++;
             /* Doublecheck. */
             ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
             if (shadow_ring.head != kring->rhead) {
@@ -388,8 +473,9 @@ ptnetmap_tx_handler(void *data, int is_kthread)
     if (more_txspace && ptring_intr_enabled(ptring) && is_kthread) {
         ptring_intr_enable(ptring, 0);
         nm_os_kctx_send_irq(kth);
-        IFRATE(ptns->rate_ctx.new.htxk++);
+        ad->stats.intrs++;
     }
+    ptnetmap_adapt_sleep(ad);
 }
 
 /* Called on backend nm_notify when there is no worker thread. */
@@ -415,7 +501,7 @@ ptnetmap_tx_nothread_notify(void *data)
 	 * unless we switch address space to the one of the guest. For now
 	 * we unconditionally inject an interrupt. */
         nm_os_kctx_send_irq(ptns->kctxs[kring->ring_id]);
-        IFRATE(ptns->rate_ctx.new.htxk++);
+        ptns->adapt[kring->ring_id].stats.intrs++;
         ND(1, "%s interrupt", kring->name);
 }
 
@@ -443,10 +529,10 @@ ptnetmap_rx_handler(void *data, int is_kthread)
     struct ptnet_ring __user *ptring;
     struct netmap_ring shadow_ring; /* shadow copy of the netmap_ring */
     struct nm_kctx *kth;
-    uint32_t num_slots;
+    struct ptnetmap_adapt *ad;
+    uint32_t num_slots, pending = 0;
     int dry_cycles = 0;
     bool some_recvd = false;
-    IFRATE(uint32_t pre_tail);
 
     if (unlikely(!ptns || !ptns->pth_na)) {
         D("ERROR ptnetmap state %p, ptnetmap host adapter %p", ptns,
@@ -464,12 +550,11 @@ ptnetmap_rx_handler(void *data, int is_kthread)
 	return;
     }
 
-    /* This is a guess, to be fixed in the rate callback. */
-    IFRATE(ptns->rate_ctx.new.grxk++);
-
     /* Get RX ptring pointer from the CSB. */
     ptring = ptns->ptrings + (pth_na->up.num_tx_rings + kring->ring_id);
     kth = ptns->kctxs[pth_na->up.num_tx_rings + kring->ring_id];
+    ad = &ptns->adapt[pth_na->up.num_tx_rings + kring->ring_id];
+    ptnetmap_adapt_wakeup(ad, PTN_RX_DRY_CYCLES_MAX);
 
     num_slots = kring->nkr_num_slots;
     shadow_ring.head = kring->rhead;
@@ -496,7 +581,6 @@ ptnetmap_rx_handler(void *data, int is_kthread)
             ptnetmap_kring_dump("pre rxsync", kring);
 	}
 
-        IFRATE(pre_tail = kring->rtail);
         if (unlikely(kring->nm_sync(kring, shadow_ring.flags))) {
             /* Reenable notifications. */
             ptring_kick_enable(ptring, 1);
@@ -510,28 +594,37 @@ ptnetmap_rx_handler(void *data, int is_kthread)
 	hwtail = NM_ACCESS_ONCE(kring->nr_hwtail);
         ptnetmap_host_write_kring_csb(ptring, kring->nr_hwcur, hwtail);
         if (kring->rtail != hwtail) {
+	    int recvd = hwtail - kring->rtail;
+
+	    if (recvd < 0)
+		recvd += num_slots;
+	    ptnetmap_adapt_sync(ad, recvd);
+	    pending += recvd;
+	    if (dry_cycles)
+		ad->stats.poll_hits++;
 	    kring->rtail = hwtail;
             some_recvd = true;
             dry_cycles = 0;
         } else {
+	    ptnetmap_adapt_sync(ad, 0);
+	    ad->stats.poll_cycles++;
             dry_cycles++;
         }
 
-        IFRATE(rate_batch_stats_update(&ptns->rate_ctx.new.rxbs, pre_tail,
-	                               kring->rtail, num_slots));
-
         if (unlikely(netmap_verbose & NM_VERB_RXSYNC)) {
             ptnetmap_kring_dump("post rxsync", kring);
 	}
 
 #ifndef BUSY_WAIT
 	/* Interrupt the guest if needed. */
-        if (some_recvd && ptring_intr_enabled(ptring)) {
+        if (some_recvd && ptring_intr_enabled(ptring) &&
+                ptnetmap_adapt_intr(ad, pending, num_slots)) {
             /* Disable guest kick to avoid sending unnecessary kicks */
             ptring_intr_enable(ptring, 0);
             nm_os_kctx_send_irq(kth);
-            IFRATE(ptns->rate_ctx.new.hrxk++);
+            ad->stats.intrs++;
             some_recvd = false;
+            pending = 0;
         }
 #endif
         /* Read CSB to see if there is more work to do. */
@@ -546,6 +639,7 @@ ptnetmap_rx_handler(void *data, int is_kthread)
             usleep_range(1,1);
             /* Reenable notifications. */
             ptring_kick_enable(ptring, 1);
+            ad->stats.kicks_enabled++;
             /* Doublecheck. */
             ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
             if (!ptnetmap_norxslots(kring, shadow_ring.head)) {
@@ -559,7 +653,7 @@ ptnetmap_rx_handler(void *data, int is_kthread)
 
 	hwtail = NM_ACCESS_ONCE(kring->nr_hwtail);
         if (unlikely(hwtail == kring->rhead ||
-		     dry_cycles >= PTN_RX_DRY_CYCLES_MAX)) {
+		     (uint32_t)dry_cycles >= ad->stats.poll_budget)) {
 	    /* No more packets to be read from the backend. We stop and
 	     * wait for a notification from the backend (netmap_rx_irq). */
             ND(1, "nr_hwtail: %d rhead: %d dry_cycles: %d",
@@ -579,8 +673,9 @@ ptnetmap_rx_handler(void *data, int is_kthread)
     if (some_recvd && ptring_intr_enabled(ptring)) {
         ptring_intr_enable(ptring, 0);
         nm_os_kctx_send_irq(kth);
-        IFRATE(ptns->rate_ctx.new.hrxk++);
+        ad->stats.intrs++;
     }
+    ptnetmap_adapt_sleep(ad);
 }
 
 #ifdef NETMAP_PT_DEBUG
@@ -829,13 +924,19 @@ ptnetmap_create(struct netmap_pt_host_adapter *pth_na,
         return EOPNOTSUPP;
     }
 
-    ptns = nm_os_malloc(sizeof(*ptns) + num_rings * sizeof(*ptns->kctxs));
+    ptns = nm_os_malloc(sizeof(*ptns) + num_rings * (sizeof(*ptns->adapt) +
+                        sizeof(*ptns->kctxs)));
     if (!ptns) {
         return ENOMEM;
     }
 
-    ptns->kctxs = (struct nm_kctx **)(ptns + 1);
+    ptns->adapt = (struct ptnetmap_adapt *)(ptns + 1);
+    ptns->kctxs = (struct nm_kctx **)(ptns->adapt + num_rings);
     ptns->stopped = true;
+    for (i = 0; i < pth_na->up.num_tx_rings; i++) {
+        ptns->adapt[i].stats.batch_lim = ptnetmap_tx_batch_lim(0,
+                                pth_na->up.tx_rings[i].nkr_num_slots);
+    }
 
     /* Cross-link data structures. */
     pth_na->ptns = ptns;
@@ -880,14 +981,6 @@ ptnetmap_create(struct netmap_pt_host_adapter *pth_na,
         pth_na->up.tx_rings[i].nm_notify = nm_pt_host_notify;
     }
 
-#ifdef RATE
-    memset(&ptns->rate_ctx, 0, sizeof(ptns->rate_ctx));
-    setup_timer(&ptns->rate_ctx.timer, &rate_callback,
-            (unsigned long)&ptns->rate_ctx);
-    if (mod_timer(&ptns->rate_ctx.timer, jiffies + msecs_to_jiffies(1500)))
-        D("[ptn] Error: mod_timer()\n");
-#endif
-
     DBG(D("[%s] ptnetmap configuration DONE", pth_na->up.name));
 
     return 0;
@@ -936,8 +1029,6 @@ ptnetmap_delete(struct netmap_pt_host_adapter *pth_na)
 	ptns->kctxs[i] = NULL;
     }
 
-    IFRATE(del_timer(&ptns->rate_ctx.timer));
-
     nm_os_free(ptns);
 
     pth_na->ptns = NULL;
@@ -945,6 +1036,71 @@ ptnetmap_delete(struct netmap_pt_host_adapter *pth_na)
     DBG(D("[%s] ptnetmap deleted", pth_na->up.name));
 }
 
+/* Copy the per-ring counters to the buffer pointed by nr_arg1. */
+static int
+ptnetmap_stats_get(struct netmap_pt_host_adapter *pth_na, struct nmreq *nmr)
+{
+    struct ptnetmap_state *ptns = pth_na->ptns;
+    uintptr_t *pp = (uintptr_t *)&nmr->nr_arg1;
+    struct ptnetmap_stats __user *ups = (struct ptnetmap_stats *)(*pp);
+    struct ptnetmap_stats ps;
+    unsigned int num_rings, k, len;
+    char __user *entries = (char *)(ups + 1);
+
+    if (!ptns) {
+        return ENXIO;
+    }
+    if (copyin(ups, &ps, sizeof(ps))) {
+        return EFAULT;
+    }
+    if (ps.entry_size == 0) {
+        ps.entry_size = sizeof(struct ptnetmap_ring_stats);
+    }
+    /* Userspace may know fewer or more counters than we do. */
+    len = min(ps.entry_size, (uint32_t)sizeof(struct ptnetmap_ring_stats));
+    num_rings = pth_na->up.num_tx_rings + pth_na->up.num_rx_rings;
+    for (k = 0; k < num_rings && k < ps.num_rings; k++) {
+        if (copyout(&ptns->adapt[k].stats, entries + k * ps.entry_size,
+                    len)) {
+            return EFAULT;
+        }
+    }
+    ps.num_rings = num_rings;
+    ps.entry_size = sizeof(struct ptnetmap_ring_stats);
+    if (copyout(&ps, ups, sizeof(ps))) {
+        return EFAULT;
+    }
+
+    return 0;
+}
+
+/* Set the TX batch limit of one or all the TX rings, see netmap_virt.h */
+static int
+ptnetmap_batch_lim_set(struct netmap_pt_host_adapter *pth_na,
+                       struct nmreq *nmr)
+{
+    struct ptnetmap_state *ptns = pth_na->ptns;
+    unsigned int first = 0, last = pth_na->up.num_tx_rings, k;
+
+    if (!ptns) {
+        return ENXIO;
+    }
+    if ((nmr->nr_flags & NR_REG_MASK) == NR_REG_ONE_NIC) {
+        first = nmr->nr_ringid & NETMAP_RING_MASK;
+        if (first >= last) {
+            D("ERROR invalid tx ring %u", first);
+            return EINVAL;
+        }
+        last = first + 1;
+    }
+    for (k = first; k < last; k++) {
+        ptns->adapt[k].stats.batch_lim = ptnetmap_tx_batch_lim(nmr->nr_arg3,
+                                pth_na->up.tx_rings[k].nkr_num_slots);
+    }
+
+    return 0;
+}
+
 /*
  * Called by netmap_ioctl().
  * Operation is indicated in nmr->nr_cmd.
@@ -998,6 +1154,14 @@ ptnetmap_ctl(struct nmreq *nmr, struct netmap_adapter *na)
         ptnetmap_delete(pth_na);
         break;
 
+    case NETMAP_PT_HOST_STATS:
+        error = ptnetmap_stats_get(pth_na, nmr);
+        break;
+
+    case NETMAP_PT_HOST_BATCH_LIM:
+        error = ptnetmap_batch_lim_set(pth_na, nmr);
+        break;
+
     default:
         D("ERROR invalid cmd (nmr->nr_cmd) (0x%x)", cmd);
         error = EINVAL;
@@ -1034,12 +1198,11 @@ nm_pt_host_notify(struct netmap_kring *kring, int flags)
 	/* Notify kthreads (wake up if needed) */
 	if (kring->tx == NR_TX) {
 		ND(1, "TX backend irq");
-		IFRATE(ptns->rate_ctx.new.btxwu++);
 	} else {
 		k += pth_na->up.num_tx_rings;
 		ND(1, "RX backend irq");
-		IFRATE(ptns->rate_ctx.new.brxwu++);
 	}
+	ptnetmap_adapt_notify(&ptns->adapt[k]);
 	nm_os_kctx_worker_wakeup(ptns->kctxs[k]);
 
 	return NM_IRQ_COMPLETED;
@@ -1089,6 +1252,9 @@ nm_pt_host_krings_create(struct netmap_adapter *na)
 
     DBG(D("%s", pth_na->up.name));
 
+    /* the guest sees a single host ring pair */
+    parent->num_host_tx_rings = parent->num_host_rx_rings = 1;
+
     /* create the parent krings */
     error = parent->nm_krings_create(parent);
     if (error) {
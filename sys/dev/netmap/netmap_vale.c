@@ -2582,7 +2582,9 @@ netmap_bwrap_krings_create(struct netmap_adapter *na)
 	if (error)
 		return error;
 
-	/* also create the hwna krings */
+	/* also create the hwna krings, with a single host ring pair
+	 * that is cross-linked with the one of the bwrap */
+	hwna->num_host_tx_rings = hwna->num_host_rx_rings = 1;
 	error = hwna->nm_krings_create(hwna);
 	if (error) {
 		goto err_del_vp_rings;
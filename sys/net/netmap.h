@@ -324,6 +324,61 @@ struct netmap_ring {
 	 */
 
 
+/*
+ * Control block of a pipe ring bound with NR_SHM_SYNC, stored in
+ * the sem[] area of the netmap_ring. The two ends of the pipe live
+ * in the same memory region, so each side can reach the peer ring
+ * and move the slots without a system call:
+ *
+ *  - the producer swaps the slots from [hwcur, head) of its tx ring
+ *    into the peer rx ring, then advances the peer rx 'tail', its
+ *    own 'hwcur' and 'tail';
+ *  - the consumer releases rx slots by advancing 'head', which the
+ *    producer reads as the rx hwcur.
+ *
+ * A side that wants to sleep sets need_kick in its own ring and
+ * then calls poll(); the other side checks the peer need_kick after
+ * each update and, if set, issues a NIOC*SYNC so that the kernel
+ * wakes the sleeper up. See nm_pipe_shm_txsync() in netmap_user.h.
+ */
+struct netmap_pipe_csb {
+	int64_t		peer_ofs;	/* (k) offset of the peer ring */
+	uint32_t	hwcur;		/* (tx) first slot not moved yet */
+	uint32_t	need_kick;	/* owner sleeping, must be woken up */
+};
+
+#define NETMAP_PIPE_CSB(ring)	\
+	((struct netmap_pipe_csb *)(void *)(ring)->sem)
+
+/*
+ * Counters of a monitor rx ring, stored in the sem[] area of the
+ * netmap_ring and updated by the kernel. They are reset when the
+ * ring is bound.
+ */
+struct netmap_mon_stats {
+	uint64_t	drops;	/* frames lost because the ring was full */
+};
+
+#define NETMAP_MON_STATS(ring)	\
+	((struct netmap_mon_stats *)(void *)(ring)->sem)
+
+/*
+ * Notification counters of a rx ring of an emulated (generic) adapter,
+ * stored in the sem[] area of the netmap_ring. The kernel counts them
+ * privately and publishes them at every rxsync and at the end of each
+ * mitigation period. They are reset when the adapter is activated.
+ */
+struct netmap_gen_stats {
+	uint64_t	irq_delivered;	/* notifications passed up */
+	uint64_t	irq_suppressed;	/* notifications filtered by mitigation */
+	uint32_t	mit_interval;	/* current mitigation period (ns) */
+	uint32_t	spare1;
+};
+
+#define NETMAP_GEN_STATS(ring)	\
+	((struct netmap_gen_stats *)(void *)(ring)->sem)
+
+
 /*
  * Netmap representation of an interface and its queue(s).
  * This is initialized by the kernel when binding a file
@@ -352,12 +407,19 @@ struct netmap_if {
 	const uint32_t	ni_rx_rings;	/* number of HW rx rings */
 
 	uint32_t	ni_bufs_head;	/* head index for extra bufs */
-	uint32_t	ni_spare1[5];
+	/* Number of host tx and rx rings. There is at least one pair,
+	 * possibly fake; older kernels leave these fields to 0 and
+	 * have exactly one pair (see NETMAP_HOST_TX_RINGS() in
+	 * netmap_user.h).
+	 */
+	const uint32_t	ni_host_tx_rings;
+	const uint32_t	ni_host_rx_rings;
+	uint32_t	ni_spare1[3];
 	/*
 	 * The following array contains the offset of each netmap ring
 	 * from this structure, in the following order:
-	 * NIC tx rings (ni_tx_rings); host tx ring (1); extra tx rings;
-	 * NIC rx rings (ni_rx_rings); host tx ring (1); extra rx rings.
+	 * NIC tx rings (ni_tx_rings); host tx rings (ni_host_tx_rings);
+	 * NIC rx rings (ni_rx_rings); host rx rings (ni_host_rx_rings).
 	 *
 	 * The area is filled up by the kernel on NIOCREGIF,
 	 * and then only read by userspace code.
@@ -454,6 +516,13 @@ struct netmap_if {
  *
  * nr_arg3 (in/out)	number of extra buffers to be allocated.
  *
+ * spare2[0] (in)	copy monitors only: snap length and sampling rate,
+ *		see NETMAP_MON_PARAMS() below.
+ *		With NR_KPOLL: the CPU of the polling thread, see
+ *		NETMAP_KPOLL_CPU() below.
+ *		Broadcast pipes: the policy for lagging consumers,
+ *		see NR_PIPE_BCAST below.
+ *
  *
  *
  * nr_cmd (in)	if non-zero indicates a special command:
@@ -526,6 +595,8 @@ struct nmreq {
 #define NETMAP_BDG_POLLING_OFF	11	/* delete polling kthread */
 #define NETMAP_VNET_HDR_GET	12      /* get the port virtio-net-hdr length */
 #define NETMAP_POOLS_INFO_GET	13	/* get memory allocator pools info */
+#define NETMAP_PT_HOST_STATS	14	/* get ptnetmap per-ring counters */
+#define NETMAP_PT_HOST_BATCH_LIM 15	/* set ptnetmap tx batch limit */
 	uint16_t	nr_arg1;	/* reserve extra rings in NIOCREGIF */
 #define NETMAP_BDG_HOST		1	/* attach the host stack on ATTACH */
 
@@ -544,11 +615,33 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
 	NR_REG_ONE_NIC	= 4,
 	NR_REG_PIPE_MASTER = 5,
 	NR_REG_PIPE_SLAVE = 6,
+	NR_REG_ONE_SW	= 7,	/* one host ring pair, index in nr_ringid */
 };
 /* monitor uses the NR_REG to select the rings to monitor */
 #define NR_MONITOR_TX	0x100
 #define NR_MONITOR_RX	0x200
 #define NR_ZCOPY_MON	0x400
+/* Copy monitors can be asked to copy only the first snaplen bytes of
+ * each frame (0 means the whole frame) and only one frame every rate
+ * (0 or 1 means all of them), by passing NETMAP_MON_PARAMS(snaplen, rate)
+ * in spare2[0] to NIOCREGIF. The length of the copy is in the slot len,
+ * the original length of the frame is always in the slot ptr field
+ * (see NETMAP_MON_ORIGLEN()).
+ * With NR_MONITOR_RANDOM each frame is copied with probability 1/rate,
+ * instead of exactly one every rate.
+ */
+#define NETMAP_MON_PARAMS(snaplen, rate) \
+	((uint32_t)(((rate) & 0xffff) << 16) | ((snaplen) & 0xffff))
+#define NETMAP_MON_SNAPLEN(p)	((p) & 0xffff)
+#define NETMAP_MON_RATE(p)	(((p) >> 16) & 0xffff)
+/* The slot ptr field of all monitors holds the original length of the
+ * frame in the low 16 bits and, with NR_MONITOR_TSTAMP, the time the
+ * frame was mirrored in the upper 48 bits, in nanoseconds from a
+ * monotonic clock, modulo 2^48 (that is, it wraps every 78 hours;
+ * differences between timestamps are still exact).
+ */
+#define NETMAP_MON_ORIGLEN(slot)	((uint16_t)((slot)->ptr & 0xffff))
+#define NETMAP_MON_TSTAMP(slot)		((uint64_t)(slot)->ptr >> 16)
 /* request exclusive access to the selected rings */
 #define NR_EXCLUSIVE	0x800
 /* request ptnetmap host support */
@@ -562,6 +655,64 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
  * to use those headers. If the flag is set, the application can use the
  * NETMAP_VNET_HDR_GET command to figure out the header length. */
 #define NR_ACCEPT_VNET_HDR	0x8000
+/* The application busy-waits on the bound rings and never sleeps on them,
+ * so the other end does not need to wake it up. Currently honored by
+ * netmap pipes, which then skip the notification towards this endpoint. */
+#define NR_BUSY_POLL		0x10000
+/* Pipes only: both endpoints exchange the ring indices through the
+ * netmap_pipe_csb in the rings, and enter the kernel only to sleep
+ * or to wake up the peer. Must be requested by both endpoints. */
+#define NR_SHM_SYNC		0x20000
+/* Pipes only: create or bind a fan-in pipe. The master endpoint has
+ * several tx rings (nr_tx_rings when the pipe is created), all feeding
+ * the single rx ring of the slave. Each binding of the master gets a
+ * free tx ring, returned in nr_arg1 by NIOCREGIF, so that several
+ * producers can be drained by one consumer with a single rxsync. */
+#define NR_PIPE_FANIN		0x40000
+/* Pipes only: create or bind a broadcast pipe, the dual of the above.
+ * The slave endpoint has several rx rings (nr_rx_rings when the pipe
+ * is created) and each binding of the slave gets a free one, returned
+ * in nr_arg1. Every slot sent on the master tx ring is delivered to
+ * all the bound consumers without copies, and its buffer is returned
+ * to the producer only when all of them have released it. Consumers
+ * must not swap the buffers out of their rx slots: a swapped slot is
+ * given back its buffer when released, and the swapped in buffer is
+ * lost. The policy for lagging consumers is chosen by spare2[0] when
+ * the pipe is created: 0 throttles the producer to the slowest
+ * consumer, NETMAP_PIPE_BCAST_DROP(lag) instead stops delivering to
+ * the consumers that hold more than lag slots (0 means the whole
+ * ring), and counts the drops in nrs_drops (see NIOCRINGSTATS). */
+#define NR_PIPE_BCAST		0x80000
+#define NETMAP_PIPE_BCAST_DROP(lag)	((uint32_t)(lag) + 1)
+/* copy monitors: sample randomly, see NETMAP_MON_PARAMS() */
+#define NR_MONITOR_RANDOM	0x100000
+/* monitors: timestamp the mirrored frames, see NETMAP_MON_TSTAMP() */
+#define NR_MONITOR_TSTAMP	0x200000
+/* Attach a kernel thread to the binding, which spins on the bound rings
+ * and runs txsync when the application advances head, and rxsync
+ * continuously. The application then only reads and writes the rings,
+ * without any system call. The thread is pinned to the CPU passed as
+ * NETMAP_KPOLL_CPU(cpu) in spare2[0] (0 means no affinity), which
+ * must be an online CPU. Requires privileges (CAP_NET_ADMIN on Linux),
+ * and at most dev.netmap.kpoll_max threads may run (0 means one per
+ * CPU), otherwise NIOCREGIF fails with EBUSY. Not available for
+ * monitors and broadcast pipes. */
+#define NR_KPOLL		0x400000
+#define NETMAP_KPOLL_CPU(cpu)	((uint32_t)(cpu) + 1)
+/* Record in the ptr field of each rx slot the time the packet was
+ * received (see NETMAP_RX_TSTAMP()), in nanoseconds from the clock
+ * selected with one of the NR_TSTAMP_* values below, or in cycles for
+ * NR_TSTAMP_RAW. The time is taken once per rxsync, for all the new
+ * slots, unless the adapter knows better: the emulated adapter uses
+ * the timestamps of the mbufs, when the OS provides them. All the
+ * users of a ring must select the same clock. Not available for
+ * monitors, which use the ptr field for their own purposes. */
+#define NR_RX_TSTAMP		0x800000
+#define NR_TSTAMP_MONOTONIC	0x0000000
+#define NR_TSTAMP_REALTIME	0x1000000
+#define NR_TSTAMP_RAW		0x2000000	/* cycle counter (e.g. TSC) */
+#define NR_TSTAMP_CLOCK(flags)	(((flags) >> 24) & 0x3)
+#define NETMAP_RX_TSTAMP(slot)	((uint64_t)(slot)->ptr)
 
 #define	NM_BDG_NAME		"vale"	/* prefix for bridge port name */
 
@@ -618,6 +769,8 @@ typedef struct _POLL_REQUEST_DATA {
 #define NIOCTXSYNC	_IO('i', 148) /* sync tx queues */
 #define NIOCRXSYNC	_IO('i', 149) /* sync rx queues */
 #define NIOCCONFIG	_IOWR('i',150, struct nm_ifreq) /* for ext. modules */
+#define NIOCSYNCV	_IOWR('i', 151, struct nmreq_syncv) /* sync many fds */
+#define NIOCRINGSTATS	_IOWR('i', 152, struct nmreq_ring_stats) /* counters */
 #endif /* !NIOCREGIF */
 
 
@@ -645,4 +798,92 @@ struct nm_ifreq {
 	char data[NM_IFRDATA_LEN];
 };
 
+/*
+ * Packet filter for copy monitors, installed (or removed, with no
+ * terms) by ioctl(fd, NIOCCONFIG, req) on a file descriptor bound to
+ * the monitor, with the filter in req.data. Only the frames that match
+ * are copied to the monitor rings.
+ *
+ * Each term extracts the size bytes at offset off in the frame, in
+ * network byte order, and matches if (field & mask) is in [lo, hi].
+ * Consecutive terms are and-ed, and a term with NM_MONF_OR starts a new
+ * alternative, so that the filter is an or of ands. A term never
+ * matches if the frame is too short. Filters with terms that do not
+ * fit in a netmap buffer are rejected with EINVAL. E.g., IPv4 over
+ * VLAN 10 is
+ *	{ 14, 2, 0, 0x0fff, 10, 10 }, { 16, 2, 0, 0xffff, 0x0800, 0x0800 }
+ */
+#define NETMAP_MON_FILTER_MAXTERMS	15
+struct netmap_mon_term {
+	uint16_t	off;
+	uint8_t		size;	/* 1, 2 or 4 */
+	uint8_t		flags;
+#define NM_MONF_OR	0x1	/* this term starts a new alternative */
+#define NM_MONF_NOT	0x2	/* negate the match of this term */
+	uint32_t	mask;
+	uint32_t	lo;
+	uint32_t	hi;
+};
+
+struct netmap_mon_filter {
+	uint16_t	nterms;
+	uint16_t	spare1;
+	uint32_t	spare2;
+	struct netmap_mon_term term[NETMAP_MON_FILTER_MAXTERMS];
+};
+
+/*
+ * Vectored sync. ioctl(fd, NIOCSYNCV, req) runs txsync and/or rxsync,
+ * as NIOCTXSYNC and NIOCRXSYNC would, on each entry of the array at
+ * req.nsv_entries, in order. An entry refers to the rings bound to
+ * another netmap file descriptor of the same process (ns_fd), or to
+ * the ones of fd itself if ns_fd is -1. Only the rings between ns_first
+ * and ns_last (inclusive) that are bound to the descriptor are synced,
+ * 0 and NETMAP_SYNC_ALLRINGS select all of them.
+ * The ioctl fails only if the array cannot be accessed; the outcome of
+ * each entry is returned in its ns_error (an errno value, or 0).
+ */
+#define NETMAP_SYNCV_MAX	1024	/* entries per ioctl */
+struct nmreq_sync {
+	int32_t		ns_fd;		/* netmap fd, or -1 */
+	uint16_t	ns_flags;
+#define NETMAP_SYNC_TX		0x1
+#define NETMAP_SYNC_RX		0x2
+	uint16_t	ns_spare;
+	uint16_t	ns_first;	/* first ring to sync */
+	uint16_t	ns_last;	/* last ring to sync */
+#define NETMAP_SYNC_ALLRINGS	0xffff
+	int32_t		ns_error;	/* (out) errno for this entry */
+};
+
+struct nmreq_syncv {
+	uint64_t	nsv_entries;	/* pointer to struct nmreq_sync[] */
+	uint32_t	nsv_count;	/* number of entries */
+	uint32_t	nsv_spare;
+};
+
+/*
+ * Sync counters of a ring of the port bound to fd, returned by
+ * ioctl(fd, NIOCRINGSTATS, req). The ring is selected by nrs_dir
+ * (NETMAP_SYNC_TX or NETMAP_SYNC_RX) and nrs_ring, numbered as in
+ * the netmap_if (host rings follow the hardware ones).
+ * The counters are cumulative over all the users of the ring, and are
+ * only updated while the dev.netmap.sync_stats sysctl is set. They
+ * count the syncs requested by the system calls (ioctl, poll, NR_KPOLL).
+ * nrs_drops is always updated, and counts the slots that the producer
+ * of a broadcast pipe could not deliver to this consumer rx ring since
+ * it was bound (see NR_PIPE_BCAST).
+ */
+struct nmreq_ring_stats {
+	uint16_t	nrs_dir;	/* (in) NETMAP_SYNC_TX or _RX */
+	uint16_t	nrs_ring;	/* (in) ring index */
+	uint32_t	nrs_drops;	/* slots not delivered to the ring */
+	uint64_t	nrs_syncs;	/* txsync or rxsync calls */
+	uint64_t	nrs_slots;	/* slots sent or received */
+	uint64_t	nrs_sync_ns;	/* time spent in the syncs */
+	uint64_t	nrs_errors;	/* failed syncs and ring reinits */
+	uint64_t	nrs_poll_wait;	/* poll() found nothing to do */
+	uint64_t	nrs_poll_ready;	/* poll() found the ring ready */
+};
+
 #endif /* _NET_NETMAP_H_ */
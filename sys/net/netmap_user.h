@@ -108,8 +108,15 @@
 #define NETMAP_TXRING(nifp, index) _NETMAP_OFFSET(struct netmap_ring *, \
 	nifp, (nifp)->ring_ofs[index] )
 
+/* number of host rings, older kernels report 0 for a single pair */
+#define NETMAP_HOST_TX_RINGS(nifp)	\
+	((nifp)->ni_host_tx_rings ? (nifp)->ni_host_tx_rings : 1)
+#define NETMAP_HOST_RX_RINGS(nifp)	\
+	((nifp)->ni_host_rx_rings ? (nifp)->ni_host_rx_rings : 1)
+
 #define NETMAP_RXRING(nifp, index) _NETMAP_OFFSET(struct netmap_ring *,	\
-	nifp, (nifp)->ring_ofs[index + (nifp)->ni_tx_rings + 1] )
+	nifp, (nifp)->ring_ofs[index + (nifp)->ni_tx_rings +		\
+		NETMAP_HOST_TX_RINGS(nifp)] )
 
 #define NETMAP_BUF(ring, index)				\
 	((char *)(ring) + (ring)->buf_ofs + ((index)*(ring)->nr_buf_size))
@@ -147,6 +154,77 @@ nm_ring_space(struct netmap_ring *ring)
 }
 
 
+/*
+ * Support for pipes bound with NR_SHM_SYNC (flag 's' in nm_open).
+ * The producer fills its tx ring as usual and then calls
+ * nm_pipe_shm_txsync() instead of NIOCTXSYNC; the consumer advances
+ * head/cur on its rx ring and then calls nm_pipe_shm_rxsync()
+ * instead of NIOCRXSYNC. Both return 1 if the other end is sleeping,
+ * in which case the caller must issue the corresponding ioctl() to
+ * wake it up. To sleep, a side calls nm_pipe_shm_need_kick(ring, 1),
+ * checks the ring again and only then poll()s, clearing the request
+ * with nm_pipe_shm_need_kick(ring, 0) when done.
+ * An endpoint must not be used by more than one thread at a time.
+ */
+static inline struct netmap_ring *
+nm_pipe_peer_ring(struct netmap_ring *ring)
+{
+	return _NETMAP_OFFSET(struct netmap_ring *, ring,
+			NETMAP_PIPE_CSB(ring)->peer_ofs);
+}
+
+static inline int
+nm_pipe_shm_txsync(struct netmap_ring *ring)
+{
+	struct netmap_pipe_csb *csb = NETMAP_PIPE_CSB(ring);
+	struct netmap_ring *rxring = nm_pipe_peer_ring(ring);
+	uint32_t k = csb->hwcur, j = rxring->tail;
+	int m, busy, limit;
+
+	m = ring->head - k; /* new slots */
+	if (m < 0)
+		m += ring->num_slots;
+	limit = m;
+	busy = j - *(volatile uint32_t *)&rxring->head;
+	if (busy < 0)
+		busy += rxring->num_slots;
+	m = rxring->num_slots - 1 - busy; /* free slots in the peer */
+	if (m < limit)
+		limit = m;
+
+	while (limit-- > 0) {
+		struct netmap_slot tmp = rxring->slot[j];
+
+		rxring->slot[j] = ring->slot[k];
+		rxring->slot[j].flags |= NS_BUF_CHANGED;
+		ring->slot[k] = tmp;
+		ring->slot[k].flags |= NS_BUF_CHANGED;
+		j = nm_ring_next(rxring, j);
+		k = nm_ring_next(ring, k);
+	}
+	__sync_synchronize(); /* slots before indices */
+	rxring->tail = j;
+	csb->hwcur = k;
+	ring->tail = (k == 0 ? ring->num_slots : k) - 1;
+	__sync_synchronize(); /* indices before need_kick */
+	return NETMAP_PIPE_CSB(rxring)->need_kick;
+}
+
+static inline int
+nm_pipe_shm_rxsync(struct netmap_ring *ring)
+{
+	__sync_synchronize(); /* head before need_kick */
+	return NETMAP_PIPE_CSB(nm_pipe_peer_ring(ring))->need_kick;
+}
+
+static inline void
+nm_pipe_shm_need_kick(struct netmap_ring *ring, int on)
+{
+	NETMAP_PIPE_CSB(ring)->need_kick = on;
+	__sync_synchronize();
+}
+
+
 #ifdef NETMAP_WITH_LIBS
 /*
  * Support for simple I/O libraries.
@@ -308,7 +386,8 @@ typedef void (*nm_cb_t)(u_char *, const struct nm_pkthdr *, const u_char *d);
  *
  * ifname	(netmap:foo or vale:foo) is the port name
  *		a suffix can indicate the follwing:
- *		^		bind the host (sw) ring pair
+ *		^		bind the host (sw) ring pairs
+ *		^NN		bind individual host ring pair
  *		*		bind host and NIC ring pairs
  *		-NN		bind individual NIC ring pair
  *		{NN		bind master side of pipe NN
@@ -321,6 +400,13 @@ typedef void (*nm_cb_t)(u_char *, const struct nm_pkthdr *, const u_char *d);
  *		r		monitor rx side (copy monitor)
  *		R		bind only RX ring(s)
  *		T		bind only TX ring(s)
+ *		b		busy-poll, no wakeups needed (pipes)
+ *		s		pipe indices in shared memory (NR_SHM_SYNC)
+ *		f		fan-in pipe, {NN binds one producer ring
+ *		c		broadcast pipe, }NN binds one consumer ring
+ *		k		kernel polling thread (NR_KPOLL)
+ *		S		rx slot timestamps (NR_RX_TSTAMP), with the
+ *				clock from req (monotonic by default)
  *
  * req		provides the initial values of nmreq before parsing ifname.
  *		Remember that the ifname parsing will override the ring
@@ -670,7 +756,12 @@ nm_parse(const char *ifname, struct nm_desc *d, char *err)
 		switch (p_state) {
 		case P_START:
 			switch (*port) {
-			case '^': /* only SW ring */
+			case '^': /* only SW ring(s) */
+				if (port[1] >= '0' && port[1] <= '9') {
+					nr_flags = NR_REG_ONE_SW;
+					p_state = P_GETNUM;
+					break;
+				}
 				nr_flags = NR_REG_SW;
 				p_state = P_RNGSFXOK;
 				break;
@@ -752,6 +843,24 @@ nm_parse(const char *ifname, struct nm_desc *d, char *err)
 			case 'T':
 				nr_flags |= NR_TX_RINGS_ONLY;
 				break;
+			case 'b':
+				nr_flags |= NR_BUSY_POLL;
+				break;
+			case 's':
+				nr_flags |= NR_SHM_SYNC;
+				break;
+			case 'f':
+				nr_flags |= NR_PIPE_FANIN;
+				break;
+			case 'c':
+				nr_flags |= NR_PIPE_BCAST;
+				break;
+			case 'k':
+				nr_flags |= NR_KPOLL;
+				break;
+			case 'S':
+				nr_flags |= NR_RX_TSTAMP;
+				break;
 			default:
 				snprintf(errmsg, MAXERRMSG, "unrecognized flag: '%c'", *port);
 				goto fail;
@@ -907,6 +1016,22 @@ nm_open(const char *ifname, const struct nmreq *req,
 		/* XXX check validity */
 		d->first_tx_ring = d->last_tx_ring =
 		d->first_rx_ring = d->last_rx_ring = d->req.nr_ringid & NETMAP_RING_MASK;
+	} else if (nr_reg == NR_REG_ONE_SW) {
+		/* adjusted below if there are fewer host rings */
+		d->first_tx_ring = d->last_tx_ring = d->req.nr_tx_rings +
+			(d->req.nr_ringid & NETMAP_RING_MASK);
+		d->first_rx_ring = d->last_rx_ring = d->req.nr_rx_rings +
+			(d->req.nr_ringid & NETMAP_RING_MASK);
+	} else if (nr_reg == NR_REG_PIPE_MASTER &&
+			(d->req.nr_flags & NR_PIPE_FANIN)) {
+		/* fan-in producer, only the assigned tx ring */
+		d->first_tx_ring = d->last_tx_ring = d->req.nr_arg1;
+		d->first_rx_ring = d->last_rx_ring = 0;
+	} else if (nr_reg == NR_REG_PIPE_SLAVE &&
+			(d->req.nr_flags & NR_PIPE_BCAST)) {
+		/* broadcast consumer, only the assigned rx ring */
+		d->first_tx_ring = d->last_tx_ring = 0;
+		d->first_rx_ring = d->last_rx_ring = d->req.nr_arg1;
 	} else { /* pipes */
 		d->first_tx_ring = d->last_tx_ring = 0;
 		d->first_rx_ring = d->last_rx_ring = 0;
@@ -998,7 +1123,27 @@ nm_mmap(struct nm_desc *d, const struct nm_desc *parent)
 	}
 	{
 		struct netmap_if *nifp = NETMAP_IF(d->mem, d->req.nr_offset);
-		struct netmap_ring *r = NETMAP_RXRING(nifp, d->first_rx_ring);
+		u_int nr_reg = d->req.nr_flags & NR_REG_MASK;
+		struct netmap_ring *r;
+
+		/* the number of host rings is only known from the nifp */
+		if (nr_reg == NR_REG_SW || nr_reg == NR_REG_NIC_SW) {
+			d->last_tx_ring = d->req.nr_tx_rings +
+				NETMAP_HOST_TX_RINGS(nifp) - 1;
+			d->last_rx_ring = d->req.nr_rx_rings +
+				NETMAP_HOST_RX_RINGS(nifp) - 1;
+		} else if (nr_reg == NR_REG_ONE_SW) {
+			/* as the kernel does, use the first one if not enough */
+			if (d->first_tx_ring >= d->req.nr_tx_rings +
+					NETMAP_HOST_TX_RINGS(nifp))
+				d->first_tx_ring = d->last_tx_ring =
+					d->req.nr_tx_rings;
+			if (d->first_rx_ring >= d->req.nr_rx_rings +
+					NETMAP_HOST_RX_RINGS(nifp))
+				d->first_rx_ring = d->last_rx_ring =
+					d->req.nr_rx_rings;
+		}
+		r = NETMAP_RXRING(nifp, d->first_rx_ring);
 		if ((void *)r == (void *)nifp) {
 			/* the descriptor is open for TX only */
 			r = NETMAP_TXRING(nifp, d->first_tx_ring);
@@ -108,6 +108,61 @@ struct ptnetmap_cfgentry_bhyve {
 	} ioctl_data;
 };
 
+/*
+ * Per-ring counters of the ptnetmap host worker, read with NIOCREGIF
+ * and nr_cmd = NETMAP_PT_HOST_STATS on the ptnetmap host port.
+ * nr_arg1 (see nmreq_pointer_put()) points to a struct ptnetmap_stats
+ * followed by room for num_rings entries of entry_size bytes (0 for
+ * sizeof(struct ptnetmap_ring_stats)), tx rings first. On return
+ * num_rings is the number of rings of the port, and entry_size the
+ * size of the entries known to the kernel; only the common part of
+ * each entry is copied.
+ * The counters are always updated and never reset, so rates can be
+ * computed by reading them periodically. The kicks received from the
+ * guest are about wakeups - backend_wakeups, since a kick and a
+ * backend notification may be served by the same wakeup.
+ */
+#define PTNETMAP_BATCH_BUCKETS	8
+
+struct ptnetmap_ring_stats {
+	uint64_t syncs;		/* syncs done by the worker */
+	uint64_t slots;		/* slots moved by those syncs */
+	uint64_t syncs_dry;	/* syncs that moved no slots */
+	/* syncs that moved [2^i, 2^(i+1)) slots, the last bucket
+	 * also counts the larger ones */
+	uint64_t batch_hist[PTNETMAP_BATCH_BUCKETS];
+	uint64_t wakeups;	/* activations of the worker */
+	uint64_t backend_wakeups; /* activations asked by the backend */
+	uint64_t poll_cycles;	/* idle cycles spent polling the CSB */
+	uint64_t poll_hits;	/* work found while polling */
+	uint64_t kicks_enabled;	/* times the worker asked for guest kicks */
+	uint64_t intrs;		/* interrupts sent to the guest */
+	uint64_t intrs_coalesced; /* interrupts postponed */
+	uint64_t batch_cuts;	/* tx batches cut to batch_lim */
+	uint32_t poll_budget;	/* current idle cycles before sleeping */
+	uint32_t batch_avg;	/* current average slots per sync */
+	uint32_t batch_lim;	/* max slots per tx sync, see below */
+	uint32_t pad;
+};
+
+struct ptnetmap_stats {
+	uint32_t num_rings;
+	uint32_t entry_size;
+	/* struct ptnetmap_ring_stats entries follow */
+};
+
+/*
+ * The tx worker passes at most batch_lim slots to each txsync of the
+ * backend, so that a large guest burst does not hold the backend (e.g.
+ * a VALE switch) and the CPU for too long. Packets are never split, so
+ * a cut may fall earlier, or later for a packet longer than the limit.
+ * The limit is set with NIOCREGIF and nr_cmd = NETMAP_PT_HOST_BATCH_LIM,
+ * to nr_arg3 slots, on the tx ring in nr_ringid if nr_flags is
+ * NR_REG_ONE_NIC, or on all of them. 0 selects the default (the
+ * dev.netmap.ptnetmap_tx_batch sysctl, or half the ring if that is 0),
+ * the ring size or more disables the limit.
+ */
+
 /*
  * Structure filled-in by the kernel when asked for allocator info
  * through NETMAP_POOLS_INFO_GET. Used by hypervisors supporting
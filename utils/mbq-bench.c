@@ -0,0 +1,274 @@
+/*
+ * Micro-benchmark for the mbuf queues of the netmap module.
+ *
+ * Builds sys/dev/netmap/netmap_mbq.c in userspace and moves fake mbufs
+ * from one or more producer threads to a single consumer thread,
+ * through one of two queues:
+ *
+ *   lock	the spinlock protected mbq, with mbq_safe_enqueue() and
+ *		mbq_safe_dequeue(), as netmap_transmit() used to do;
+ *   ring	the lock-free mbq_ring, with mbq_ring_enqueue_batch() and
+ *		mbq_ring_dequeue_batch(), BATCH mbufs at a time.
+ *
+ * The consumer checks that the mbufs of each producer come out in
+ * order, and the number of times the producers found the queue full
+ * is reported. Threads yield the CPU when they cannot make progress.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <net/netmap.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+
+/* the kernel environment needed by netmap_mbq.c */
+struct mbuf {
+	struct mbuf *m_nextpkt;
+	uint32_t m_src;
+	uint32_t m_seq;
+};
+
+struct mtx {
+	pthread_spinlock_t l;
+};
+typedef struct mtx safe_spinlock_t;
+typedef struct mtx win_spinlock_t;
+
+#define mtx_init(m, a, b, c)	pthread_spin_init(&(m)->l, PTHREAD_PROCESS_PRIVATE)
+#define mtx_destroy(m)		pthread_spin_destroy(&(m)->l)
+#define mtx_lock_spin(m)	pthread_spin_lock(&(m)->l)
+#define mtx_unlock_spin(m)	pthread_spin_unlock(&(m)->l)
+#define m_freem(m)		(void)(m)
+#define mb()			__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define rmb()			__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define wmb()			__atomic_thread_fence(__ATOMIC_RELEASE)
+#define NM_ATOMIC_CMPSET32(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+
+void *nm_os_malloc(size_t size)
+{
+	return calloc(1, size);
+}
+
+void nm_os_free(void *p)
+{
+	free(p);
+}
+
+#define NETMAP_MBQ_USERSPACE
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#include <dev/netmap/netmap_mbq.c>
+#pragma GCC diagnostic warning "-Wunused-parameter"
+
+#define MB_MAXPROD	16
+#define MB_MAXBATCH	256
+
+static void usage()
+{
+	D("mbq-bench [-m lock|ring] [-p PRODUCERS] [-b BATCH] [-q QLEN] "
+	  "[-n PACKETS]");
+}
+
+struct mb_args {
+	int ring;
+	unsigned int batch;
+	unsigned int qlen;
+	unsigned long npkts;	/* per producer */
+	struct mbq q;
+	struct mbq_ring r;
+};
+
+struct mb_prod {
+	struct mb_args *a;
+	uint32_t id;
+	struct mbuf *pool;
+	unsigned int poolsize;
+	unsigned long full;
+	pthread_t th;
+};
+
+static void *
+mb_producer(void *arg)
+{
+	struct mb_prod *p = arg;
+	struct mb_args *a = p->a;
+	struct mbuf *batch[MB_MAXBATCH];
+	unsigned long sent = 0;
+	unsigned int i, n, k;
+
+	while (sent < a->npkts) {
+		n = a->batch;
+		if (n > a->npkts - sent)
+			n = a->npkts - sent;
+		/* the pool is larger than the queue, so these mbufs
+		 * have already been consumed */
+		for (i = 0; i < n; i++) {
+			struct mbuf *m = &p->pool[(sent + i) % p->poolsize];
+
+			m->m_src = p->id;
+			m->m_seq = sent + i;
+			batch[i] = m;
+		}
+		for (k = 0; k < n; ) {
+			if (a->ring) {
+				i = mbq_ring_enqueue_batch(&a->r, batch + k, n - k);
+			} else if (mbq_len(&a->q) < a->qlen) {
+				mbq_safe_enqueue(&a->q, batch[k]);
+				i = 1;
+			} else {
+				i = 0;
+			}
+			if (i == 0) {
+				p->full++;
+				sched_yield();
+			}
+			k += i;
+		}
+		sent += n;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct mb_args a;
+	struct mb_prod prod[MB_MAXPROD];
+	uint32_t next[MB_MAXPROD];
+	struct mbuf *batch[MB_MAXBATCH];
+	struct timeval t1, t2;
+	unsigned long udiff, got = 0, total, errors = 0, full = 0;
+	unsigned int nprod = 1, i, n;
+	const char *mode = "ring";
+	int ch;
+
+	memset(&a, 0, sizeof(a));
+	a.batch = 32;
+	a.qlen = 1024;
+	a.npkts = 10000000;
+
+	while ( (ch = getopt(argc, argv, "m:p:b:q:n:") ) != -1) {
+		switch(ch) {
+		default:
+			D("bad option %c %s", ch, optarg);
+			usage();
+			return -1;
+
+		case 'm':
+			mode = optarg;
+			break;
+
+		case 'p':
+			nprod = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'b':
+			a.batch = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'q':
+			a.qlen = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			a.npkts = strtoul(optarg, NULL, 10);
+			break;
+		}
+	}
+	if (!strcmp(mode, "ring")) {
+		a.ring = 1;
+	} else if (strcmp(mode, "lock")) {
+		usage();
+		return -1;
+	}
+	if (nprod < 1 || nprod > MB_MAXPROD || a.qlen == 0) {
+		usage();
+		return -1;
+	}
+	if (a.batch == 0)
+		a.batch = 1;
+	if (a.batch > MB_MAXBATCH)
+		a.batch = MB_MAXBATCH;
+
+	if (a.ring) {
+		if (mbq_ring_init(&a.r, a.qlen)) {
+			D("cannot allocate the queue");
+			return -1;
+		}
+		a.qlen = a.r.mask + 1;
+	} else {
+		mbq_safe_init(&a.q);
+	}
+
+	memset(prod, 0, sizeof(prod));
+	for (i = 0; i < nprod; i++) {
+		prod[i].a = &a;
+		prod[i].id = i;
+		/* mbq_safe_enqueue() may overshoot the queue length by one
+		 * mbuf per producer */
+		prod[i].poolsize = 2 * a.qlen + MB_MAXPROD + MB_MAXBATCH;
+		prod[i].pool = calloc(prod[i].poolsize, sizeof(struct mbuf));
+		if (prod[i].pool == NULL) {
+			D("cannot allocate the mbufs");
+			return -1;
+		}
+		next[i] = 0;
+	}
+
+	total = a.npkts * nprod;
+	gettimeofday(&t1, NULL);
+	for (i = 0; i < nprod; i++)
+		pthread_create(&prod[i].th, NULL, mb_producer, &prod[i]);
+
+	/* the consumer */
+	while (got < total) {
+		if (a.ring) {
+			n = mbq_ring_dequeue_batch(&a.r, batch, a.batch);
+		} else {
+			for (n = 0; n < a.batch; n++) {
+				batch[n] = mbq_safe_dequeue(&a.q);
+				if (batch[n] == NULL)
+					break;
+			}
+		}
+		if (n == 0) {
+			sched_yield();
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			struct mbuf *m = batch[i];
+
+			if (m->m_seq != next[m->m_src])
+				errors++;
+			next[m->m_src] = m->m_seq + 1;
+		}
+		got += n;
+	}
+	gettimeofday(&t2, NULL);
+	for (i = 0; i < nprod; i++) {
+		pthread_join(prod[i].th, NULL);
+		full += prod[i].full;
+		free(prod[i].pool);
+	}
+	udiff = (t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_usec - t1.tv_usec);
+	if (udiff == 0)
+		udiff = 1;
+
+	D("%s %u producers batch %u qlen %u: %lu mbufs in %lu us, %.3f Mpps",
+		mode, nprod, a.batch, a.qlen, got, udiff,
+		(double)got / (double)udiff);
+	D("queue full %lu times, %lu out of order", full, errors);
+
+	if (a.ring) {
+		mbq_ring_fini(&a.r);
+	} else {
+		mbq_safe_fini(&a.q);
+	}
+
+	return errors ? 1 : 0;
+}
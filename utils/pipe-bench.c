@@ -0,0 +1,303 @@
+/*
+ * Throughput/latency benchmark for netmap pipes.
+ *
+ * Opens both ends of a pipe ({N and }N) of the given parent port and
+ * moves packets between them from two threads, in one of two patterns:
+ *
+ *   stream	the master side transmits batches as fast as possible,
+ *		the slave side receives and discards them;
+ *   pingpong	the master side transmits a batch and waits for it to
+ *		come back, the slave side reflects everything it receives.
+ *
+ * With -B both ends bind with NR_BUSY_POLL and spin on NIOC*SYNC
+ * instead of sleeping in poll(), so the pipe skips the wakeups.
+ * With -S both ends bind with NR_SHM_SYNC and move the slots without
+ * system calls, entering the kernel only to sleep or to wake up
+ * the other end.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <net/netmap.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+
+static void usage()
+{
+	D("pipe-bench [-i PARENT_IFNAME] [-p PIPE_ID] [-m stream|pingpong] "
+	  "[-b BATCH] [-n PACKETS] [-l LEN] [-B] [-S]");
+}
+
+struct pb_args {
+	struct nm_desc *nmd;
+	int busy;
+	int shm;
+	unsigned int batch;
+	unsigned int len;
+	unsigned long npkts;
+	unsigned long done;
+	int pingpong;
+};
+
+static volatile int stop = 0;
+
+/* push the queued packets to the other end */
+static void
+pb_txsync(struct pb_args *a)
+{
+	struct netmap_ring *ring = NETMAP_TXRING(a->nmd->nifp, 0);
+
+	if (!a->shm) {
+		ioctl(a->nmd->fd, NIOCTXSYNC, NULL);
+	} else if (nm_pipe_shm_txsync(ring)) {
+		ioctl(a->nmd->fd, NIOCTXSYNC, NULL); /* kick the peer */
+	}
+}
+
+/* return the released packets to the other end */
+static void
+pb_rxsync(struct pb_args *a)
+{
+	struct netmap_ring *ring = NETMAP_RXRING(a->nmd->nifp, 0);
+
+	if (!a->shm) {
+		ioctl(a->nmd->fd, NIOCRXSYNC, NULL);
+	} else if (nm_pipe_shm_rxsync(ring)) {
+		ioctl(a->nmd->fd, NIOCRXSYNC, NULL); /* kick the peer */
+	}
+}
+
+/* wait for room on the tx ring or packets on the rx ring */
+static void
+pb_wait(struct pb_args *a, int tx)
+{
+	struct netmap_ring *ring = tx ? NETMAP_TXRING(a->nmd->nifp, 0) :
+		NETMAP_RXRING(a->nmd->nifp, 0);
+	struct pollfd pfd;
+
+	if (a->busy) {
+		if (tx)
+			pb_txsync(a);
+		else if (!a->shm)
+			pb_rxsync(a);
+		return;
+	}
+	if (a->shm) {
+		/* ask for a kick, then check again before sleeping */
+		nm_pipe_shm_need_kick(ring, 1);
+		if (tx)
+			pb_txsync(a);
+		if (nm_ring_space(ring)) {
+			nm_pipe_shm_need_kick(ring, 0);
+			return;
+		}
+	}
+	pfd.fd = a->nmd->fd;
+	pfd.events = tx ? POLLOUT : POLLIN;
+	poll(&pfd, 1, 1000);
+	if (a->shm)
+		nm_pipe_shm_need_kick(ring, 0);
+}
+
+/* queue up to n packets on the tx ring, return how many */
+static unsigned int
+pb_send(struct pb_args *a, unsigned int n)
+{
+	struct netmap_ring *ring = NETMAP_TXRING(a->nmd->nifp, 0);
+	unsigned int head = ring->head, m = nm_ring_space(ring);
+
+	if (m > n)
+		m = n;
+	n = m;
+	while (m-- > 0) {
+		ring->slot[head].len = a->len;
+		head = nm_ring_next(ring, head);
+	}
+	ring->head = ring->cur = head;
+	return n;
+}
+
+/* release all the packets on the rx ring, return how many */
+static unsigned int
+pb_recv(struct pb_args *a)
+{
+	struct netmap_ring *ring = NETMAP_RXRING(a->nmd->nifp, 0);
+	unsigned int n = nm_ring_space(ring);
+
+	ring->head = ring->cur = ring->tail;
+	if (n && a->shm)
+		pb_rxsync(a); /* otherwise done by the next wait */
+	return n;
+}
+
+/* master side: source of the stream, or initiator of the ping-pong */
+static void *
+pb_master(void *arg)
+{
+	struct pb_args *a = arg;
+
+	while (!stop && a->done < a->npkts) {
+		unsigned int want = a->batch, sent = 0, got = 0;
+
+		if (a->npkts - a->done < want)
+			want = a->npkts - a->done;
+		while (!stop && sent < want) {
+			sent += pb_send(a, want - sent);
+			pb_txsync(a);
+			if (sent < want)
+				pb_wait(a, 1);
+		}
+		if (a->pingpong) {
+			while (!stop && got < sent) {
+				pb_wait(a, 0);
+				got += pb_recv(a);
+			}
+		}
+		a->done += sent;
+	}
+	stop = 1;
+	return NULL;
+}
+
+/* slave side: sink of the stream, or reflector of the ping-pong */
+static void *
+pb_slave(void *arg)
+{
+	struct pb_args *a = arg;
+
+	while (!stop) {
+		unsigned int got, sent = 0;
+
+		pb_wait(a, 0);
+		got = pb_recv(a);
+		a->done += got;
+		if (!a->pingpong || got == 0)
+			continue;
+		while (!stop && sent < got) {
+			sent += pb_send(a, got - sent);
+			pb_txsync(a);
+			if (sent < got)
+				pb_wait(a, 1);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *parent = "vale0:pb";
+	const char *mode = "stream";
+	char name[64], sfx[4];
+	struct pb_args ma, sa;
+	pthread_t mth, sth;
+	struct timeval t1, t2;
+	unsigned long udiff;
+	unsigned int pipe_id = 0;
+	int ch;
+
+	memset(&ma, 0, sizeof(ma));
+	ma.batch = 32;
+	ma.len = 60;
+	ma.npkts = 10000000;
+
+	while ( (ch = getopt(argc, argv, "i:p:m:b:n:l:BS") ) != -1) {
+		switch(ch) {
+		default:
+			D("bad option %c %s", ch, optarg);
+			usage();
+			return -1;
+
+		case 'i':
+			parent = optarg;
+			break;
+
+		case 'p':
+			pipe_id = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'm':
+			mode = optarg;
+			break;
+
+		case 'b':
+			ma.batch = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			ma.npkts = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'l':
+			ma.len = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'B':
+			ma.busy = 1;
+			break;
+
+		case 'S':
+			ma.shm = 1;
+			break;
+		}
+	}
+	if (!strcmp(mode, "pingpong")) {
+		ma.pingpong = 1;
+	} else if (strcmp(mode, "stream")) {
+		usage();
+		return -1;
+	}
+	if (ma.batch == 0)
+		ma.batch = 1;
+
+	snprintf(sfx, sizeof(sfx), "%s%s%s", (ma.busy || ma.shm) ? "/" : "",
+			ma.busy ? "b" : "", ma.shm ? "s" : "");
+	snprintf(name, sizeof(name), "%s{%u%s", parent, pipe_id, sfx);
+	ma.nmd = nm_open(name, NULL, 0, NULL);
+	if (!ma.nmd) {
+		D("Could not open %s [%s]", name, strerror(errno));
+		return -1;
+	}
+	/* a ping-pong batch must fit in the rings, or the two sides
+	 * would block on each other */
+	if (ma.pingpong && ma.batch >= NETMAP_TXRING(ma.nmd->nifp, 0)->num_slots)
+		ma.batch = NETMAP_TXRING(ma.nmd->nifp, 0)->num_slots - 1;
+	sa = ma;
+	sa.nmd = NULL;
+
+	snprintf(name, sizeof(name), "%s}%u%s", parent, pipe_id, sfx);
+	sa.nmd = nm_open(name, NULL, NM_OPEN_NO_MMAP, ma.nmd);
+	if (!sa.nmd) {
+		D("Could not open %s [%s]", name, strerror(errno));
+		nm_close(ma.nmd);
+		return -1;
+	}
+
+	gettimeofday(&t1, NULL);
+	pthread_create(&sth, NULL, pb_slave, &sa);
+	pthread_create(&mth, NULL, pb_master, &ma);
+	pthread_join(mth, NULL);
+	pthread_join(sth, NULL);
+	gettimeofday(&t2, NULL);
+	udiff = (t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_usec - t1.tv_usec);
+	if (udiff == 0)
+		udiff = 1;
+
+	D("%s batch %u len %u%s%s: %lu pkts in %lu us, %.3f Mpps",
+		mode, ma.batch, ma.len, ma.busy ? " busy-poll" : "",
+		ma.shm ? " shm-sync" : "",
+		ma.done, udiff, (double)ma.done / (double)udiff);
+	if (ma.pingpong && ma.done)
+		D("avg round trip %.1f ns per batch",
+			(double)udiff * 1000 * ma.batch / (double)ma.done);
+
+	nm_close(sa.nmd);
+	nm_close(ma.nmd);
+
+	return 0;
+}
@@ -0,0 +1,574 @@
+/*
+ * Userspace stand-in for a ptnetmap guest, to exercise the ptnetmap
+ * host workers without a VM. Linux only, as it uses eventfds for the
+ * kicks and the interrupts, like QEMU does.
+ *
+ * Binds PORT in ptnetmap host mode, allocates the CSB (one struct
+ * ptnet_ring per ring) in its own memory and passes it to the kernel
+ * with NETMAP_PT_HOST_CREATE. Then one thread per ring plays the guest
+ * driver, following the CSB protocol of netmap_pt_guest_txsync() and
+ * netmap_pt_guest_rxsync():
+ *
+ *   tx	the guests queue batches of packets on all the tx rings,
+ *	kicking the host when host_need_kick is set;
+ *   rx	a source thread transmits on another port of the same VALE
+ *	switch, and the guests release the packets they receive;
+ *   lat	the guest of tx ring 0 sends bursts as in tx mode, while
+ *	the ones of the other tx rings send a packet at a time and
+ *	measure how long the host takes to consume it.
+ *
+ * With -R 0 the traffic goes as fast as possible (busy guest), a low
+ * rate gives a mostly idle one. -f sends packets of several slots
+ * (NS_MOREFRAG), -L sets the tx batch limit of the host workers
+ * (NETMAP_PT_HOST_BATCH_LIM) and -c pins all of them to one CPU, to
+ * see how the rings share it. The policy of the workers can also be
+ * switched with the ptnetmap_adaptive module parameter.
+ *
+ * At the end the throughput of each guest is printed, with the
+ * fairness index of the tx rings in tx mode and the latency of the
+ * probes in lat mode, followed by the counters of the host workers
+ * (NETMAP_PT_HOST_STATS).
+ */
+#define _GNU_SOURCE	/* sched_setaffinity() */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <net/netmap.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+#include <net/netmap_virt.h>
+
+#define PS_MAXRINGS	64
+
+static void usage()
+{
+	D("ptnet-standin [-i PORT] [-s SOURCE_PORT] [-m tx|rx|lat] "
+	  "[-r RINGS] [-b BATCH] [-R PPS] [-P PROBE_PPS] [-f FRAGS] "
+	  "[-L BATCH_LIM] [-c CPU] [-d SECONDS] [-l LEN]");
+}
+
+static volatile int stop = 0;
+
+/* a guest ring and its thread */
+struct ps_guest {
+	int tx;
+	int probe;		/* one packet at a time, measure latency */
+	unsigned int id;	/* index in the CSB */
+	struct ptnet_ring *ptr;
+	struct netmap_ring *ring;
+	int kickfd;
+	int irqfd;
+	unsigned int batch;	/* slots per round */
+	unsigned int frags;	/* slots per packet */
+	unsigned long rate;	/* packets per second, 0 for no limit */
+
+	unsigned long pkts;
+	unsigned long kicks;
+	unsigned long intrs;
+	uint64_t lat_sum;	/* probes, in ns */
+	uint64_t lat_min;
+	uint64_t lat_max;
+	pthread_t th;
+};
+
+struct ps_source {
+	const char *name;
+	unsigned int batch;
+	unsigned int len;
+	unsigned long rate;
+	unsigned long sent;
+};
+
+static uint64_t
+ps_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* wait until 'done' packets are due at 'rate' pps since 't0' */
+static void
+ps_pace(uint64_t t0, unsigned long done, unsigned long rate)
+{
+	uint64_t due;
+
+	if (rate == 0)
+		return;
+	due = t0 + done * 1000000000ULL / rate;
+	while (!stop && ps_now_ns() < due)
+		usleep(10);
+}
+
+static uint32_t
+ps_ring_next_n(struct netmap_ring *ring, uint32_t i, unsigned int n)
+{
+	i += n;
+	return i >= ring->num_slots ? i - ring->num_slots : i;
+}
+
+/* the guest side of the CSB, see ptnetmap_guest_write_kring_csb() */
+static void
+ps_csb_write(struct ptnet_ring *ptr, uint32_t cur, uint32_t head)
+{
+	ptr->cur = cur;
+	__sync_synchronize();
+	ptr->head = head;
+}
+
+/* returns hwtail, see ptnetmap_guest_read_kring_csb() */
+static uint32_t
+ps_csb_read(struct ptnet_ring *ptr)
+{
+	uint32_t hwtail = *(volatile uint32_t *)&ptr->hwtail;
+
+	__sync_synchronize();
+	return hwtail;
+}
+
+/* kick the host worker if it asked for it */
+static int
+ps_kick(struct ptnet_ring *ptr, int fd)
+{
+	uint64_t one = 1;
+
+	__sync_synchronize();
+	if (!*(volatile uint32_t *)&ptr->host_need_kick)
+		return 0;
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		D("kick failed [%s]", strerror(errno));
+	return 1;
+}
+
+/* ask for an interrupt, double check hwtail, then sleep */
+static void
+ps_wait(struct ps_guest *g, uint32_t hwtail)
+{
+	struct pollfd pfd;
+	uint64_t v;
+
+	g->ptr->guest_need_kick = 1;
+	__sync_synchronize();
+	if (ps_csb_read(g->ptr) == hwtail) {
+		pfd.fd = g->irqfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0 &&
+				read(g->irqfd, &v, sizeof(v)) == sizeof(v))
+			g->intrs++;
+	}
+	g->ptr->guest_need_kick = 0;
+}
+
+static void *
+ps_guest_body(void *arg)
+{
+	struct ps_guest *g = arg;
+	struct netmap_ring *ring = g->ring;
+	uint32_t head = g->ptr->head;
+	uint64_t t0 = ps_now_ns();
+	unsigned int i;
+
+	while (!stop) {
+		uint32_t hwtail = ps_csb_read(g->ptr);
+		int avail = hwtail - head;
+		uint64_t t;
+
+		if (avail < 0)
+			avail += ring->num_slots;
+		if (g->tx) {
+			/* avail is the free space, see nm_kr_txempty();
+			 * only send whole packets */
+			if ((unsigned int)avail > g->batch)
+				avail = g->batch;
+			avail -= avail % g->frags;
+		}
+		if (avail == 0) {
+			ps_wait(g, hwtail);
+			continue;
+		}
+		if (g->tx) {
+			for (i = 0; i < (unsigned int)avail; i++) {
+				ring->slot[ps_ring_next_n(ring, head, i)].flags =
+					(i + 1) % g->frags ? NS_MOREFRAG : 0;
+			}
+		}
+		/* queue the packets (tx) or release them (rx) */
+		head = ps_ring_next_n(ring, head, avail);
+		g->pkts += g->tx ? avail / g->frags : (unsigned int)avail;
+		ps_csb_write(g->ptr, head, head);
+		g->kicks += ps_kick(g->ptr, g->kickfd);
+		if (g->probe) {
+			/* wait for the host to consume the packet */
+			t = ps_now_ns();
+			while (!stop && *(volatile uint32_t *)&g->ptr->hwcur
+					!= head)
+				sched_yield();
+			t = ps_now_ns() - t;
+			g->lat_sum += t;
+			if (g->lat_min == 0 || t < g->lat_min)
+				g->lat_min = t;
+			if (t > g->lat_max)
+				g->lat_max = t;
+		}
+		if (g->tx)
+			ps_pace(t0, g->pkts, g->rate);
+	}
+	return NULL;
+}
+
+/* feed the rx side through another port of the switch */
+static void *
+ps_source_body(void *arg)
+{
+	struct ps_source *s = arg;
+	struct nm_desc *d;
+	struct netmap_ring *ring;
+	uint64_t t0;
+	unsigned int i;
+
+	d = nm_open(s->name, NULL, 0, NULL);
+	if (!d) {
+		D("Could not open %s [%s]", s->name, strerror(errno));
+		stop = 1;
+		return NULL;
+	}
+	ring = NETMAP_TXRING(d->nifp, d->first_tx_ring);
+	/* broadcast frames, so that the switch floods them */
+	for (i = 0; i < ring->num_slots; i++) {
+		char *buf = NETMAP_BUF(ring, ring->slot[i].buf_idx);
+
+		memset(buf, 0xff, 6);
+		memset(buf + 6, 0x02, 6);
+		ring->slot[i].len = s->len;
+	}
+	t0 = ps_now_ns();
+	while (!stop) {
+		unsigned int n = nm_ring_space(ring);
+
+		if (n > s->batch)
+			n = s->batch;
+		ring->head = ring->cur = ps_ring_next_n(ring, ring->head, n);
+		s->sent += n;
+		ioctl(d->fd, NIOCTXSYNC, NULL);
+		ps_pace(t0, s->sent, s->rate);
+	}
+	nm_close(d);
+	return NULL;
+}
+
+/* pin the host workers of this process (nmkth:PID:*) to one CPU */
+static int
+ps_pin_workers(int cpu)
+{
+	char prefix[32], path[300], comm[32];
+	struct dirent *de;
+	cpu_set_t cpuset;
+	DIR *dir;
+	FILE *f;
+	int n = 0;
+
+	snprintf(prefix, sizeof(prefix), "nmkth:%d:", getpid());
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	dir = opendir("/proc");
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/comm", de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(comm, sizeof(comm), f) &&
+				!strncmp(comm, prefix, strlen(prefix)) &&
+				!sched_setaffinity(atoi(de->d_name),
+					sizeof(cpuset), &cpuset))
+			n++;
+		fclose(f);
+	}
+	closedir(dir);
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	const char *port = "vale0:pt", *mode = "tx";
+	struct ps_source src;
+	struct ps_guest guests[PS_MAXRINGS], *g;
+	struct nmreq req;
+	struct ptnetmap_cfg *cfg;
+	struct ptnetmap_cfgentry_qemu *entries;
+	struct ptnet_ring *csb;
+	struct {
+		struct ptnetmap_stats h;
+		struct ptnetmap_ring_stats r[PS_MAXRINGS];
+	} st;
+	struct netmap_if *nifp;
+	pthread_t sth;
+	void *mem;
+	uint64_t t0, t1;
+	unsigned long duration = 5, probe_rate = 10000;
+	unsigned int num_rings, num_guests, k, i, rings = 0, batch = 32;
+	unsigned int len = 60, frags = 1, batch_lim = 0;
+	double sum = 0, sum2 = 0;
+	int fd, ch, tx, lat = 0, cpu = -1;
+
+	memset(&src, 0, sizeof(src));
+	src.name = "vale0:ptsrc";
+
+	while ( (ch = getopt(argc, argv, "i:s:m:r:b:R:P:f:L:c:d:l:") ) != -1) {
+		switch(ch) {
+		default:
+			D("bad option %c %s", ch, optarg);
+			usage();
+			return -1;
+
+		case 'i':
+			port = optarg;
+			break;
+
+		case 's':
+			src.name = optarg;
+			break;
+
+		case 'm':
+			mode = optarg;
+			break;
+
+		case 'r':
+			rings = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'R':
+			src.rate = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'P':
+			probe_rate = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'f':
+			frags = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'L':
+			batch_lim = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+
+		case 'd':
+			duration = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'l':
+			len = strtoul(optarg, NULL, 10);
+			break;
+		}
+	}
+	if (!strcmp(mode, "tx")) {
+		tx = 1;
+	} else if (!strcmp(mode, "rx")) {
+		tx = 0;
+	} else if (!strcmp(mode, "lat")) {
+		tx = lat = 1;
+	} else {
+		usage();
+		return -1;
+	}
+	if (frags == 0)
+		frags = 1;
+	if (batch < frags)
+		batch = frags;
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		D("Could not open /dev/netmap [%s]", strerror(errno));
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.nr_version = NETMAP_API;
+	strncpy(req.nr_name, port, sizeof(req.nr_name) - 1);
+	req.nr_flags = NR_REG_ALL_NIC | NR_PTNETMAP_HOST;
+	/* only used when a VALE port is created */
+	req.nr_tx_rings = req.nr_rx_rings = rings;
+	if (ioctl(fd, NIOCREGIF, &req)) {
+		D("NIOCREGIF %s failed [%s]", port, strerror(errno));
+		return -1;
+	}
+	mem = mmap(NULL, req.nr_memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (mem == MAP_FAILED) {
+		D("mmap failed [%s]", strerror(errno));
+		return -1;
+	}
+	nifp = NETMAP_IF(mem, req.nr_offset);
+	num_rings = req.nr_tx_rings + req.nr_rx_rings;
+	if (num_rings > PS_MAXRINGS) {
+		D("too many rings (%u)", num_rings);
+		return -1;
+	}
+
+	/* what the ptnet driver does before the guest opens the port */
+	csb = calloc(num_rings, sizeof(*csb));
+	cfg = calloc(1, sizeof(*cfg) + num_rings * sizeof(*entries));
+	if (!csb || !cfg) {
+		D("out of memory");
+		return -1;
+	}
+	entries = (struct ptnetmap_cfgentry_qemu *)(cfg + 1);
+	for (k = 0; k < num_rings; k++) {
+		csb[k].host_need_kick = 1;
+		csb[k].guest_need_kick = (k >= req.nr_tx_rings);
+		entries[k].ioeventfd = eventfd(0, 0);
+		entries[k].irqfd = eventfd(0, EFD_NONBLOCK);
+	}
+	cfg->cfgtype = PTNETMAP_CFGTYPE_QEMU;
+	cfg->entry_size = sizeof(*entries);
+	cfg->num_rings = num_rings;
+	cfg->ptrings = csb;
+
+	req.nr_cmd = NETMAP_PT_HOST_CREATE;
+	nmreq_pointer_put(&req, cfg);
+	if (ioctl(fd, NIOCREGIF, &req)) {
+		D("NETMAP_PT_HOST_CREATE failed [%s]", strerror(errno));
+		return -1;
+	}
+	if (batch_lim) {
+		req.nr_cmd = NETMAP_PT_HOST_BATCH_LIM;
+		req.nr_arg3 = batch_lim;
+		if (ioctl(fd, NIOCREGIF, &req))
+			D("NETMAP_PT_HOST_BATCH_LIM failed [%s]",
+				strerror(errno));
+	}
+	if (cpu >= 0)
+		D("%d workers pinned to CPU %d", ps_pin_workers(cpu), cpu);
+
+	/* one guest per ring in the chosen direction */
+	memset(guests, 0, sizeof(guests));
+	num_guests = tx ? req.nr_tx_rings : req.nr_rx_rings;
+	for (k = 0; k < num_guests; k++) {
+		g = &guests[k];
+		g->tx = tx;
+		g->probe = lat && k > 0;
+		g->id = tx ? k : req.nr_tx_rings + k;
+		g->ptr = &csb[g->id];
+		g->kickfd = entries[g->id].ioeventfd;
+		g->irqfd = entries[g->id].irqfd;
+		g->ring = tx ? NETMAP_TXRING(nifp, k) : NETMAP_RXRING(nifp, k);
+		g->frags = frags;
+		g->batch = g->probe ? frags : batch;
+		g->rate = g->probe ? probe_rate : src.rate;
+		for (i = 0; i < g->ring->num_slots; i++)
+			g->ring->slot[i].len = len;
+	}
+
+	if (!tx) {
+		src.batch = batch;
+		src.len = len;
+		pthread_create(&sth, NULL, ps_source_body, &src);
+	}
+	t0 = ps_now_ns();
+	for (k = 0; k < num_guests; k++)
+		pthread_create(&guests[k].th, NULL, ps_guest_body, &guests[k]);
+	sleep(duration);
+	stop = 1;
+	for (k = 0; k < num_guests; k++)
+		pthread_join(guests[k].th, NULL);
+	t1 = ps_now_ns();
+	if (!tx)
+		pthread_join(sth, NULL);
+
+	for (k = 0; k < num_guests; k++) {
+		double mpps;
+
+		g = &guests[k];
+		mpps = (double)g->pkts * 1000 / (double)(t1 - t0);
+		D("%s ring %u: %lu pkts, %.3f Mpps, %lu kicks, %lu interrupts",
+		  g->tx ? "tx" : "rx", k, g->pkts, mpps, g->kicks, g->intrs);
+		if (g->probe) {
+			D("    latency avg %.1f min %.1f max %.1f us",
+			  g->pkts ? (double)g->lat_sum / g->pkts / 1000 : 0,
+			  (double)g->lat_min / 1000, (double)g->lat_max / 1000);
+		} else {
+			sum += mpps;
+			sum2 += mpps * mpps;
+		}
+	}
+	if (tx && !lat && num_guests > 1 && sum2 > 0) {
+		/* Jain's index: 1 when all rings get the same share */
+		D("fairness index %.3f", sum * sum / (num_guests * sum2));
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.h.num_rings = PS_MAXRINGS;
+	st.h.entry_size = sizeof(st.r[0]);
+	req.nr_cmd = NETMAP_PT_HOST_STATS;
+	nmreq_pointer_put(&req, &st);
+	if (ioctl(fd, NIOCREGIF, &req)) {
+		D("NETMAP_PT_HOST_STATS failed [%s]", strerror(errno));
+	} else {
+		for (k = 0; k < num_guests; k++) {
+			struct ptnetmap_ring_stats *r = &st.r[guests[k].id];
+			char hist[128];
+			int n = 0;
+
+			for (i = 0; i < PTNETMAP_BATCH_BUCKETS; i++) {
+				n += snprintf(hist + n, sizeof(hist) - n,
+					" %llu",
+					(unsigned long long)r->batch_hist[i]);
+			}
+			D("host ring %u: %llu wakeups (%llu from the backend), "
+			  "%llu syncs (%llu dry) %llu slots (avg batch %u), "
+			  "%llu poll cycles %llu hits (budget %u), "
+			  "%llu kicks enabled, %llu interrupts %llu coalesced",
+			  guests[k].id, (unsigned long long)r->wakeups,
+			  (unsigned long long)r->backend_wakeups,
+			  (unsigned long long)r->syncs,
+			  (unsigned long long)r->syncs_dry,
+			  (unsigned long long)r->slots, r->batch_avg,
+			  (unsigned long long)r->poll_cycles,
+			  (unsigned long long)r->poll_hits, r->poll_budget,
+			  (unsigned long long)r->kicks_enabled,
+			  (unsigned long long)r->intrs,
+			  (unsigned long long)r->intrs_coalesced);
+			D("    batch sizes 1, 2-3, 4-7, ...:%s", hist);
+			if (tx)
+				D("    %llu batches cut to %u slots",
+				  (unsigned long long)r->batch_cuts,
+				  r->batch_lim);
+		}
+	}
+
+	req.nr_cmd = NETMAP_PT_HOST_DELETE;
+	if (ioctl(fd, NIOCREGIF, &req))
+		D("NETMAP_PT_HOST_DELETE failed [%s]", strerror(errno));
+	munmap(mem, req.nr_memsize);
+	close(fd);
+	for (k = 0; k < num_rings; k++) {
+		close(entries[k].ioeventfd);
+		close(entries[k].irqfd);
+	}
+	free(cfg);
+	free(csb);
+
+	return 0;
+}
@@ -264,6 +264,37 @@ do_rxsync()
 	int ret = ioctl(fd, NIOCRXSYNC, NULL);
 	output_err(ret, "ioctl(%d, NIOCRXSYNC)=%d", fd, ret);
 }
+
+/* ringstats tx|rx RING [fd] */
+void
+do_ringstats()
+{
+	struct nmreq_ring_stats rs;
+	char *arg = nextarg();
+	int fd, ret;
+
+	memset(&rs, 0, sizeof(rs));
+	if (!arg || (strcmp(arg, "tx") && strcmp(arg, "rx"))) {
+		output("usage: ringstats tx|rx RING [fd]");
+		return;
+	}
+	rs.nrs_dir = (arg[0] == 't' ? NETMAP_SYNC_TX : NETMAP_SYNC_RX);
+	arg = nextarg();
+	rs.nrs_ring = arg ? atoi(arg) : 0;
+	arg = nextarg();
+	fd = arg ? atoi(arg) : last_fd;
+	ret = ioctl(fd, NIOCRINGSTATS, &rs);
+	output_err(ret, "ioctl(%d, NIOCRINGSTATS)=%d", fd, ret);
+	if (ret)
+		return;
+	output("syncs:      %llu", (unsigned long long)rs.nrs_syncs);
+	output("slots:      %llu", (unsigned long long)rs.nrs_slots);
+	output("sync_ns:    %llu", (unsigned long long)rs.nrs_sync_ns);
+	output("errors:     %llu", (unsigned long long)rs.nrs_errors);
+	output("poll_wait:  %llu", (unsigned long long)rs.nrs_poll_wait);
+	output("poll_ready: %llu", (unsigned long long)rs.nrs_poll_ready);
+	output("drops:      %u", rs.nrs_drops);
+}
 #endif /* TEST_NETMAP */
 
 
@@ -536,9 +567,12 @@ do_if()
 	printf("tx_rings   %u\n", nifp->ni_tx_rings);
 	printf("rx_rings   %u\n", nifp->ni_rx_rings);
 	printf("bufs_head  %u\n", nifp->ni_bufs_head);
-	for (i = 0; i < 5; i++)
+	printf("host_tx_rings %u\n", nifp->ni_host_tx_rings);
+	printf("host_rx_rings %u\n", nifp->ni_host_rx_rings);
+	for (i = 0; i < 3; i++)
 		printf("spare1[%d]  %u\n", i, nifp->ni_spare1[i]);
-	for (i = 0; i < (nifp->ni_tx_rings + nifp->ni_rx_rings + 2); i++)
+	for (i = 0; i < (nifp->ni_tx_rings + nifp->ni_rx_rings +
+			NETMAP_HOST_TX_RINGS(nifp) + NETMAP_HOST_RX_RINGS(nifp)); i++)
 		printf("ring_ofs[%d] %zd\n", i, nifp->ring_ofs[i]);
 }
 
@@ -1181,6 +1215,7 @@ struct cmd_def commands[] = {
 	{ "regif",	do_regif,	},
 	{ "txsync",	do_txsync,	},
 	{ "rxsync",	do_rxsync,	},
+	{ "ringstats",	do_ringstats,	},
 #endif /* TEST_NETMAP */
 	{ "dup",	do_dup,		},
 	{ "mmap",	do_mmap,	},
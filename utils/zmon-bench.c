@@ -0,0 +1,200 @@
+/*
+ * Benchmark for pipelines of zero-copy monitors.
+ *
+ * Opens a port (by default an ephemeral VALE port) and a chain of 1 to
+ * 4 zero-copy monitors on it ("PORT/z"), each served by its own thread.
+ * A source thread transmits on the port as fast as possible. The
+ * slots released by the port go to the first monitor, the slots
+ * released by each monitor go to the next one, and the last monitor
+ * just releases them.
+ *
+ * At the end, the packets seen and lost by each stage are reported,
+ * together with the rate measured at the last stage.
+ * With -B all the stages bind with NR_BUSY_POLL and spin on NIOCRXSYNC
+ * instead of sleeping in poll(), so the producers skip the wakeups.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <net/netmap.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+
+#define ZB_MAXSTAGES	4
+
+static void usage()
+{
+	D("zmon-bench [-i PORT] [-s STAGES] [-b BATCH] [-n PACKETS] "
+	  "[-l LEN] [-B]");
+}
+
+struct zb_stage {
+	struct nm_desc *nmd;
+	int busy;
+	unsigned long seen;
+	unsigned long batches;
+	unsigned long long drops;
+	pthread_t th;
+};
+
+static volatile int stop = 0;
+
+/* receive and release everything on the monitor rings */
+static void *
+zb_stage_body(void *arg)
+{
+	struct zb_stage *s = arg;
+	struct nm_desc *d = s->nmd;
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = d->fd;
+	pfd.events = POLLIN;
+	while (!stop) {
+		unsigned long got = 0;
+
+		if (s->busy)
+			ioctl(d->fd, NIOCRXSYNC, NULL);
+		else
+			poll(&pfd, 1, 100);
+		for (r = d->first_rx_ring; r <= d->last_rx_ring; r++) {
+			struct netmap_ring *ring = NETMAP_RXRING(d->nifp, r);
+
+			got += nm_ring_space(ring);
+			/* released on the next sync, which also hands
+			 * the slots over to the next stage */
+			ring->head = ring->cur = ring->tail;
+		}
+		if (got) {
+			s->seen += got;
+			s->batches++;
+		}
+	}
+	for (r = d->first_rx_ring; r <= d->last_rx_ring; r++)
+		s->drops += NETMAP_MON_STATS(NETMAP_RXRING(d->nifp, r))->drops;
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *port = "vale0:zb";
+	char name[64];
+	struct zb_stage st[ZB_MAXSTAGES];
+	struct nm_desc *src;
+	struct netmap_ring *txring;
+	struct timeval t1, t2;
+	unsigned long udiff, sent = 0, npkts = 10000000;
+	unsigned int nstages = 1, batch = 64, len = 60, i;
+	int ch, busy = 0;
+
+	while ( (ch = getopt(argc, argv, "i:s:b:n:l:B") ) != -1) {
+		switch(ch) {
+		default:
+			D("bad option %c %s", ch, optarg);
+			usage();
+			return -1;
+
+		case 'i':
+			port = optarg;
+			break;
+
+		case 's':
+			nstages = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			npkts = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'l':
+			len = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'B':
+			busy = 1;
+			break;
+		}
+	}
+	if (nstages < 1 || nstages > ZB_MAXSTAGES) {
+		usage();
+		return -1;
+	}
+	if (batch == 0)
+		batch = 1;
+
+	src = nm_open(port, NULL, 0, NULL);
+	if (!src) {
+		D("Could not open %s [%s]", port, strerror(errno));
+		return -1;
+	}
+	txring = NETMAP_TXRING(src->nifp, src->first_tx_ring);
+
+	/* the stages are chained in the order they are opened */
+	memset(st, 0, sizeof(st));
+	snprintf(name, sizeof(name), "%s/z%s", port, busy ? "b" : "");
+	for (i = 0; i < nstages; i++) {
+		st[i].busy = busy;
+		st[i].nmd = nm_open(name, NULL, 0, NULL);
+		if (!st[i].nmd) {
+			D("Could not open %s [%s]", name, strerror(errno));
+			goto out;
+		}
+	}
+
+	gettimeofday(&t1, NULL);
+	for (i = 0; i < nstages; i++)
+		pthread_create(&st[i].th, NULL, zb_stage_body, &st[i]);
+
+	while (sent < npkts) {
+		unsigned int n = nm_ring_space(txring), head = txring->head;
+
+		if (n > batch)
+			n = batch;
+		if (n > npkts - sent)
+			n = npkts - sent;
+		sent += n;
+		while (n-- > 0) {
+			txring->slot[head].len = len;
+			head = nm_ring_next(txring, head);
+		}
+		txring->head = txring->cur = head;
+		ioctl(src->fd, NIOCTXSYNC, NULL);
+	}
+	/* give the pipeline some time to drain */
+	usleep(200000);
+	stop = 1;
+	for (i = 0; i < nstages; i++)
+		pthread_join(st[i].th, NULL);
+	gettimeofday(&t2, NULL);
+	udiff = (t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_usec - t1.tv_usec);
+	if (udiff <= 200000)
+		udiff = 200001;
+	udiff -= 200000;
+
+	for (i = 0; i < nstages; i++) {
+		D("stage %u: %lu pkts, %llu lost, avg batch %.1f", i + 1,
+			st[i].seen, st[i].drops, st[i].batches ?
+			(double)st[i].seen / st[i].batches : 0.0);
+	}
+	D("%u stages batch %u len %u%s: %lu pkts sent, %.3f Mpps at the last stage",
+		nstages, batch, len, busy ? " busy-poll" : "", sent,
+		(double)st[nstages - 1].seen / (double)udiff);
+
+out:
+	for (i = 0; i < nstages; i++)
+		if (st[i].nmd)
+			nm_close(st[i].nmd);
+	nm_close(src);
+
+	return 0;
+}